@@ -0,0 +1,281 @@
+'use strict';
+
+/*
+ * Multi-core mode: several worker threads each run a Server on the same port
+ * (SO_REUSEPORT, so the kernel spreads connections over them) and own the
+ * sessions they accept.  The main thread holds the registry of which names
+ * are on which workers and copies every change to all workers, so that each
+ * can resolve targets (including wildcards) locally.  A new name is only
+ * reported as registered (and its client sent the AUTH reply) once every other
+ * worker has acknowledged it, so nothing sent to the client after it has
+ * logged in is dropped for want of a registration.  Packets for sessions on
+ * other workers go straight to those workers over a MessageChannel per pair,
+ * which apply the same loopback exclusion to their own sessions.  They carry
+ * the id of the session they came from, so that a worker whose recipient is
+ * backed up can have the sending worker pause (and later resume) that session,
+ * as it would a sender of its own.
+ */
+const { Worker, MessageChannel, isMainThread, parentPort, workerData } = require('worker_threads');
+const EventEmitter = require('events');
+const NameIndex = require('./name-index');
+const packet_format = require('./packet-format');
+
+/* Smaller payloads are copied for each worker, larger ones are shared */
+const SHARE_MIN = 16 * 1024;
+
+/* Stand-ins for remote senders are pruned (those not pausing anyone) above this */
+const REMOTE_SENDERS_MAX = 4096;
+
+/* reusePort for net.Server#listen arrived in Node 22.12 and 23.1 */
+const reuse_port_supported = () => {
+	const [major, minor] = process.versions.node.split('.').map(Number);
+	return major > 23 || major === 23 && minor >= 1 || major === 22 && minor >= 12;
+};
+
+/* True if the payload's ArrayBuffer holds nothing but this packet */
+const owns_buffer = data =>
+	data.buffer instanceof ArrayBuffer &&
+	data.byteOffset <= packet_format.HEADER_LENGTH &&
+	data.buffer.byteLength === data.byteOffset + data.length;
+
+module.exports.WorkerLink = WorkerLink;
+module.exports.start = start;
+
+/* A worker's view of the other workers, used by Server via opts.cluster */
+WorkerLink.prototype = Object.create(EventEmitter.prototype);
+function WorkerLink(id, parent) {
+	EventEmitter.call(this);
+
+	/* Port to each other worker, by worker id */
+	const peers = new Map();
+	/* Names registered on other workers: name -> Set of worker ids */
+	const remote = new Map();
+	const index = new NameIndex();
+	/* Bumped whenever the remote registry changes */
+	let generation = 0;
+	/* Registrations awaiting acknowledgement by every other worker, by sequence number */
+	const pending = new Map();
+	let seq = 0;
+
+	const add_name = (name, worker) => {
+		if (!remote.has(name)) {
+			remote.set(name, new Set());
+			index.add(name);
+		}
+		remote.get(name).add(worker);
+		generation++;
+	};
+
+	const remove_name = (name, worker) => {
+		const workers = remote.get(name);
+		if (!workers || !workers.delete(worker)) {
+			return;
+		}
+		if (workers.size === 0) {
+			remote.delete(name);
+			index.delete(name);
+		}
+		generation++;
+	};
+
+	/*
+	 * Stand-in for a session on another worker which sends to ours, by
+	 * "worker:session".  Sessions pause and resume it like a local sender, and
+	 * the first pause and last resume are passed on to the sending worker.
+	 */
+	const remote_senders = new Map();
+
+	const remote_sender = (worker, session) => {
+		const key = `${worker}:${session}`;
+		let sender = remote_senders.get(key);
+		if (sender) {
+			return sender;
+		}
+		if (remote_senders.size >= REMOTE_SENDERS_MAX) {
+			for (const [k, s] of remote_senders) {
+				if (!s.paused()) {
+					remote_senders.delete(k);
+				}
+			}
+		}
+		const paused_by = new Set();
+		sender = {
+			pause_input: by => {
+				paused_by.add(by);
+				if (paused_by.size === 1) {
+					peers.get(worker).postMessage({ op: 'pause', session });
+				}
+			},
+			resume_input: by => {
+				if (paused_by.delete(by) && paused_by.size === 0) {
+					peers.get(worker).postMessage({ op: 'resume', session });
+				}
+			},
+			paused: () => paused_by.size > 0
+		};
+		remote_senders.set(key, sender);
+		return sender;
+	};
+
+	const on_peer_message = worker => msg => {
+		switch (msg.op) {
+		case 'pause':
+			this.emit('pause', msg.session, worker);
+			return;
+		case 'resume':
+			this.emit('resume', msg.session, worker);
+			return;
+		}
+		const { type, remote: via, from, to, foreign, data, sender } = msg;
+		/* A view of the transferred or shared memory, not a copy */
+		const payload = Buffer.from(data.buffer, data.byteOffset, data.byteLength);
+		this.emit('packet', { type, remote: via, local: from, foreign, data: payload }, to, from, remote_sender(worker, sender));
+	};
+
+	parent.on('message', msg => {
+		switch (msg.op) {
+		case 'peer':
+			peers.set(msg.id, msg.port);
+			msg.port.on('message', on_peer_message(msg.id));
+			break;
+		case 'add':
+			add_name(msg.name, msg.id);
+			parent.postMessage({ op: 'ack', id: msg.id, seq: msg.seq });
+			break;
+		case 'added':
+			pending.get(msg.seq)();
+			pending.delete(msg.seq);
+			break;
+		case 'remove':
+			remove_name(msg.name, msg.id);
+			break;
+		case 'dump':
+			this.emit('dump');
+			break;
+		}
+	});
+
+	this.id = id;
+	this.generation = () => generation;
+	/* Resolves once every other worker knows the name */
+	this.register = name => new Promise(resolve => {
+		pending.set(++seq, resolve);
+		parent.postMessage({ op: 'add', name, id, seq });
+	});
+	this.unregister = name => parent.postMessage({ op: 'remove', name, id });
+
+	/* Ids of other workers with sessions that should receive the packet */
+	this.workers_for = (to, via, from) => {
+		const result = new Set();
+		index.each_match(to, name => {
+			if (name !== via && name !== from) {
+				for (const worker of remote.get(name)) {
+					result.add(worker);
+				}
+			}
+		});
+		return [...result];
+	};
+
+	/*
+	 * Send a packet to other workers.  The payload's memory is handed over if
+	 * only one worker needs it and nothing else here uses it, otherwise large
+	 * payloads are copied once into shared memory for all of them.  Sender is
+	 * the id of the session it came from, as given to 'pause' and 'resume'.
+	 */
+	this.forward = (workers, packet, to, from, used_here, sender) => {
+		const { type, remote: via, foreign, data } = packet;
+		const msg = { type, remote: via, from, to, foreign, data, sender };
+		if (data.buffer instanceof SharedArrayBuffer) {
+			workers.forEach(worker => peers.get(worker).postMessage(msg));
+		} else if (workers.length === 1 && !used_here && owns_buffer(data)) {
+			peers.get(workers[0]).postMessage(msg, [data.buffer]);
+		} else if (data.length < SHARE_MIN) {
+			for (const worker of workers) {
+				const copy = new Uint8Array(data);
+				peers.get(worker).postMessage(Object.assign({}, msg, { data: copy }), [copy.buffer]);
+			}
+		} else {
+			const shared = Buffer.from(new SharedArrayBuffer(data.length));
+			data.copy(shared);
+			msg.data = shared;
+			workers.forEach(worker => peers.get(worker).postMessage(msg));
+		}
+	};
+}
+
+/* Main thread: start workers, connect them to each other, keep the registry */
+function start(opts, count) {
+	/* Worker threads cannot be handed sockets, so there is no fallback */
+	if (count > 1 && !reuse_port_supported()) {
+		console.error(`Multi-core mode (WORKERS=${count}) needs reusePort, from Node 22.12 or 23.1, but this is Node ${process.versions.node}`);
+		process.exit(1);
+	}
+	const workers = [];
+	/* Acknowledgements still due for each registration, by "worker:seq" */
+	const acks = new Map();
+
+	const broadcast = (msg, except) => workers.forEach((worker, id) => id !== except && worker.postMessage(msg));
+
+	const on_worker_message = id => msg => {
+		switch (msg.op) {
+		case 'add':
+			if (count === 1) {
+				workers[id].postMessage({ op: 'added', seq: msg.seq });
+				break;
+			}
+			acks.set(`${id}:${msg.seq}`, count - 1);
+			broadcast(msg, id);
+			break;
+		case 'ack': {
+			const key = `${msg.id}:${msg.seq}`;
+			const due = acks.get(key) - 1;
+			if (due > 0) {
+				acks.set(key, due);
+			} else {
+				acks.delete(key);
+				workers[msg.id].postMessage({ op: 'added', seq: msg.seq });
+			}
+			break;
+		}
+		case 'remove':
+			broadcast(msg, id);
+			break;
+		}
+	};
+
+	for (let id = 0; id < count; id++) {
+		const worker = new Worker(__filename, { workerData: { relay_worker: true, id, count, opts } });
+		worker.on('message', on_worker_message(id));
+		/* Sessions on a lost worker would linger in every registry */
+		worker.on('error', err => {
+			console.error(`Worker ${id} failed:`, err);
+			process.exit(1);
+		});
+		worker.on('exit', code => {
+			console.error(`Worker ${id} exited with code ${code}`);
+			process.exit(1);
+		});
+		workers.push(worker);
+	}
+	for (let a = 0; a < count; a++) {
+		for (let b = a + 1; b < count; b++) {
+			const { port1, port2 } = new MessageChannel();
+			workers[a].postMessage({ op: 'peer', id: b, port: port1 }, [port1]);
+			workers[b].postMessage({ op: 'peer', id: a, port: port2 }, [port2]);
+		}
+	}
+
+	process.on('SIGHUP', () => broadcast({ op: 'dump' }));
+
+	return { workers };
+}
+
+if (!isMainThread && workerData && workerData.relay_worker) {
+	const Server = require('./server');
+	const { id, count, opts } = workerData;
+	const cluster = new WorkerLink(id, parentPort);
+	const server = new Server(Object.assign({}, opts, { cluster, reusePort: count > 1 }));
+	Server.log_to_console(server, `[worker ${id}] `);
+	cluster.on('dump', () => Server.dump(server, `Worker ${id}`));
+}
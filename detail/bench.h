@@ -0,0 +1,87 @@
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Shared helpers for the benchmarks in detail/ */
+
+/* Monotonic time in seconds */
+static inline double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Reads and discards everything from a file descriptor until EOF */
+struct bench_sink {
+	int fd;
+	size_t bytes;
+	pthread_t thread;
+};
+
+static void *bench_sink_thread(void *arg)
+{
+	struct bench_sink *self = arg;
+	static __thread char buf[1 << 20];
+	ssize_t bytes;
+	while ((bytes = read(self->fd, buf, sizeof(buf))) > 0) {
+		self->bytes += bytes;
+	}
+	return NULL;
+}
+
+static inline bool bench_sink_start(struct bench_sink *self, int fd)
+{
+	self->fd = fd;
+	self->bytes = 0;
+	return pthread_create(&self->thread, NULL, bench_sink_thread, self) == 0;
+}
+
+/* Waits for EOF on the sink, returns number of bytes drained */
+static inline size_t bench_sink_join(struct bench_sink *self)
+{
+	pthread_join(self->thread, NULL);
+	close(self->fd);
+	return self->bytes;
+}
+
+/* Connected pair of loopback TCP sockets */
+static inline bool bench_tcp_pair(int sv[2])
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr = { htonl(INADDR_LOOPBACK) } };
+	socklen_t addrlen = sizeof(addr);
+	int ls = socket(AF_INET, SOCK_STREAM, 0);
+	if (ls == -1) {
+		return false;
+	}
+	bool res = bind(ls, (void *) &addr, addrlen) == 0 &&
+		listen(ls, 1) == 0 &&
+		getsockname(ls, (void *) &addr, &addrlen) == 0 &&
+		(sv[0] = socket(AF_INET, SOCK_STREAM, 0)) != -1 &&
+		connect(sv[0], (void *) &addr, addrlen) == 0 &&
+		(sv[1] = accept(ls, NULL, NULL)) != -1;
+	close(ls);
+	return res;
+}
+
+static int bench_compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* Sorts the samples and returns the p-th percentile (0 <= p <= 100) */
+static inline double bench_percentile(double *samples, size_t count, double p)
+{
+	qsort(samples, count, sizeof(*samples), bench_compare_double);
+	size_t i = (size_t) (p / 100 * (count - 1) + 0.5);
+	return samples[i < count ? i : count - 1];
+}
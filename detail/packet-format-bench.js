@@ -0,0 +1,85 @@
+/*
+ * Throughput of packet_format.Reader at several packet sizes, with the input
+ * delivered in socket-sized chunks so that packets also span chunks
+ *
+ *   node detail/packet-format-bench.js [seconds-per-size]
+ */
+const packet_format = require('../packet-format');
+
+const CHUNK_SIZE = 64 * 1024;
+const SIZES = [0, 64, 1024, 16 * 1024, 256 * 1024, 1024 * 1024];
+const STREAM_SIZE = 32 * 1024 * 1024;
+
+const seconds = +process.argv[2] || 1;
+
+/* Encode packets of the given payload size into one stream */
+const make_stream = size => {
+	const bufs = [];
+	const writer = new packet_format.Writer();
+	writer.on('data', buf => bufs.push(buf));
+	const data = Buffer.alloc(size, 'x');
+	const count = Math.max(1, Math.floor(STREAM_SIZE / (size + 40)));
+	for (let i = 0; i < count; i++) {
+		writer.write({ type: 'DATA', remote: 'red:*', local: `sender:${i % 100}`, data });
+	}
+	return { stream: Buffer.concat(bufs), count };
+};
+
+/* Split like a socket would, returns chunks */
+const split = (stream, chunk_size) => {
+	const chunks = [];
+	for (let offset = 0; offset < stream.length; offset += chunk_size) {
+		chunks.push(stream.subarray(offset, offset + chunk_size));
+	}
+	return chunks;
+};
+
+/* Checks every packet arrives intact whatever the chunking */
+const verify = () => {
+	const { stream, count } = make_stream(100);
+	for (const chunk_size of [1, 7, 40, 41, 139, CHUNK_SIZE]) {
+		const reader = new packet_format.Reader();
+		let received = 0;
+		reader.on('data', packet => {
+			if (packet.type !== 'DATA' || packet.remote !== 'red:*' || packet.local !== `sender:${received % 100}` ||
+					packet.length !== 100 || !packet.data.equals(Buffer.alloc(100, 'x'))) {
+				throw new Error(`Wrong packet ${received} with ${chunk_size}-byte chunks`);
+			}
+			received++;
+		});
+		split(stream.subarray(0, 140 * 1000), chunk_size).forEach(chunk => reader.write(chunk));
+		if (received !== Math.min(count, 1000)) {
+			throw new Error(`Received ${received} packets with ${chunk_size}-byte chunks`);
+		}
+	}
+};
+
+const bench = size => {
+	const { stream, count } = make_stream(size);
+	const chunks = split(stream, CHUNK_SIZE);
+	const reader = new packet_format.Reader();
+	let packets = 0;
+	/* Use the fields the server uses for routing */
+	reader.on('data', packet => {
+		packets += packet.remote.length && packet.local.length ? 1 : 0;
+	});
+	let rounds = 0;
+	const start = process.hrtime.bigint();
+	let elapsed;
+	do {
+		for (const chunk of chunks) {
+			reader.write(chunk);
+		}
+		rounds++;
+		elapsed = Number(process.hrtime.bigint() - start) / 1e9;
+	} while (elapsed < seconds);
+	if (packets !== count * rounds) {
+		throw new Error(`Expected ${count * rounds} packets, got ${packets}`);
+	}
+	const bytes = stream.length * rounds;
+	console.log(`${String(size).padStart(8)} B: ${(packets / elapsed).toFixed(0).padStart(10)} packets/s ${(bytes / elapsed / 1e6).toFixed(1).padStart(9)} MB/s`);
+};
+
+verify();
+console.log(`Packet reader, ${CHUNK_SIZE}-byte chunks`);
+SIZES.forEach(bench);
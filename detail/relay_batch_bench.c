@@ -0,0 +1,84 @@
+#if defined BENCH_relay_batch
+
+/*
+ * Packets per second for small payloads, sending each packet on its own
+ * versus gathering them with the batch API.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "bench.h"
+
+#define PACKETS 200000
+#define BATCH 64
+
+/* Returns packets per second, or negative on failure */
+static double run(bool tcp, bool batched, size_t length)
+{
+	static char payload[256];
+	int sv[2];
+	if (tcp ? !bench_tcp_pair(sv) : socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		return -1;
+	}
+	struct bench_sink sink;
+	if (!bench_sink_start(&sink, sv[1])) {
+		return -1;
+	}
+	struct relay_client client;
+	if (!relay_client_init_fd(&client, NULL, sv[0], true, false)) {
+		return -1;
+	}
+	double start = bench_now();
+	for (size_t i = 0; i < PACKETS; i += BATCH) {
+		if (batched) {
+			if (!relay_client_batch_begin(&client)) {
+				return -1;
+			}
+			for (size_t j = 0; j < BATCH; j++) {
+				if (!relay_client_batch_append(&client, "BNCH", "sink", payload, length)) {
+					return -1;
+				}
+			}
+			if (!relay_client_flush(&client)) {
+				return -1;
+			}
+		} else {
+			for (size_t j = 0; j < BATCH; j++) {
+				if (!relay_client_send_packet(&client, "BNCH", "sink", payload, length)) {
+					return -1;
+				}
+			}
+		}
+	}
+	relay_client_destroy(&client);
+	size_t bytes = bench_sink_join(&sink);
+	double elapsed = bench_now() - start;
+	if (bytes != PACKETS * relay_serialised_packet_size(length)) {
+		return -1;
+	}
+	return PACKETS / elapsed;
+}
+
+int main()
+{
+	static const size_t sizes[] = { 0, 16, 64, 256 };
+	printf("%-10s %8s %14s %14s %8s\n", "transport", "payload", "single pkt/s", "batched pkt/s", "ratio");
+	for (int tcp = 0; tcp < 2; tcp++) {
+		for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+			double single = run(tcp, false, sizes[i]);
+			double batched = run(tcp, true, sizes[i]);
+			if (single < 0 || batched < 0) {
+				fprintf(stderr, "Benchmark failed at %zu bytes\n", sizes[i]);
+				return 1;
+			}
+			printf("%-10s %8zu %14.0f %14.0f %8.2f\n", tcp ? "tcp" : "socketpair", sizes[i], single, batched, batched / single);
+		}
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,236 @@
+#if defined BENCH_relay
+
+/*
+ * End-to-end suite: relay_client over the fd adapter on pipes, socketpairs
+ * and loopback TCP, and relay_pipe between two pipes, across payload sizes.
+ *
+ * For each case, measures one-way throughput (msgs/s, MB/s) and ping-pong
+ * round-trip latency percentiles.  Prints a table, and writes the results as
+ * JSON to the file named by the first argument (default relay_bench.json).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "../relay_pipe.h"
+#include "bench.h"
+
+#if !defined BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+/* Bytes moved per throughput run, and bytes echoed per latency run */
+#define THROUGHPUT_BYTES (64 << 20)
+#define LATENCY_BYTES (32 << 20)
+#define MIN_PACKETS 8
+#define MAX_PACKETS 200000
+#define MAX_SAMPLES 5000
+
+enum transport { tr_pipe, tr_socketpair, tr_tcp, tr_relay_pipe, transports };
+
+static const char *transport_names[] = { "pipe", "socketpair", "tcp", "relay_pipe" };
+
+static const size_t sizes[] = { 0, 64, 1 << 10, 16 << 10, 256 << 10, 1 << 20, 16 << 20 };
+
+/*
+ * Near and far ends of a bidirectional link, each end with a client to send
+ * on and a client to receive on (the same fd, duplicated, for sockets).
+ */
+struct link {
+	struct relay_client near_tx;
+	struct relay_client near_rx;
+	struct relay_client far_tx;
+	struct relay_client far_rx;
+	bool has_pipe;
+	struct relay_pipe pipe;
+};
+
+static bool link_clients(struct link *self, int near_tx, int near_rx, int far_tx, int far_rx)
+{
+	return relay_client_init_fd(&self->near_tx, NULL, near_tx, true, false) &&
+		relay_client_init_fd(&self->near_rx, NULL, near_rx, true, false) &&
+		relay_client_init_fd(&self->far_tx, NULL, far_tx, true, false) &&
+		relay_client_init_fd(&self->far_rx, NULL, far_rx, true, false);
+}
+
+static bool link_init(struct link *self, enum transport transport)
+{
+	memset(self, 0, sizeof(*self));
+	int a[2];
+	int b[2];
+	int c[2];
+	switch (transport) {
+	case tr_pipe:
+		return pipe(a) == 0 && pipe(b) == 0 && link_clients(self, a[1], b[0], b[1], a[0]);
+	case tr_socketpair:
+		return socketpair(AF_UNIX, SOCK_STREAM, 0, a) == 0 && link_clients(self, a[0], dup(a[0]), a[1], dup(a[1]));
+	case tr_tcp:
+		return bench_tcp_pair(a) && link_clients(self, a[0], dup(a[0]), a[1], dup(a[1]));
+	case tr_relay_pipe:
+		/* Outbound goes through the relay_pipe, the return path is direct */
+		if (pipe(a) || pipe(b) || pipe(c) || !link_clients(self, a[1], c[0], c[1], b[0])) {
+			return false;
+		}
+		self->has_pipe = relay_pipe_init(&self->pipe, a[0], b[1], true, NULL, NULL);
+		return self->has_pipe;
+	default:
+		return false;
+	}
+}
+
+static void link_destroy(struct link *self)
+{
+	relay_client_destroy(&self->near_tx);
+	relay_client_destroy(&self->far_tx);
+	if (self->has_pipe) {
+		relay_pipe_destroy(&self->pipe);
+	}
+	relay_client_destroy(&self->near_rx);
+	relay_client_destroy(&self->far_rx);
+}
+
+/* Far end: count (and optionally echo) packets until EOF or a count is reached */
+struct far_end {
+	struct link *link;
+	size_t expect;
+	bool echo;
+	size_t received;
+	pthread_t thread;
+};
+
+static void *far_thread(void *arg)
+{
+	struct far_end *self = arg;
+	while (self->received < self->expect) {
+		struct relay_packet *p;
+		if (!relay_client_recv_packet(&self->link->far_rx, &p) || !p) {
+			break;
+		}
+		self->received++;
+		bool ok = !self->echo || relay_client_send_packet2(&self->link->far_tx, p);
+		free(p);
+		if (!ok) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static size_t packet_count(size_t total, size_t length, size_t max)
+{
+	size_t count = total / (length + sizeof(struct relay_packet_serial_hdr));
+	return count < MIN_PACKETS ? MIN_PACKETS : count > max ? max : count;
+}
+
+struct result {
+	enum transport transport;
+	size_t length;
+	double msgs_per_s;
+	double mb_per_s;
+	double p50_us;
+	double p99_us;
+	double p999_us;
+};
+
+static bool throughput(enum transport transport, size_t length, const char *payload, struct result *out)
+{
+	struct link link;
+	struct far_end far = { .link = &link, .expect = packet_count(THROUGHPUT_BYTES, length, MAX_PACKETS) };
+	if (!link_init(&link, transport) || pthread_create(&far.thread, NULL, far_thread, &far)) {
+		return false;
+	}
+	double start = bench_now();
+	for (size_t i = 0; i < far.expect; i++) {
+		if (!relay_client_send_packet(&link.near_tx, "BNCH", "far", payload, length)) {
+			return false;
+		}
+	}
+	pthread_join(far.thread, NULL);
+	double elapsed = bench_now() - start;
+	link_destroy(&link);
+	if (far.received != far.expect) {
+		return false;
+	}
+	out->msgs_per_s = far.expect / elapsed;
+	out->mb_per_s = far.expect * (double) relay_serialised_packet_size(length) / elapsed / (1 << 20);
+	return true;
+}
+
+static bool latency(enum transport transport, size_t length, const char *payload, struct result *out)
+{
+	static double samples[MAX_SAMPLES];
+	struct link link;
+	struct far_end far = { .link = &link, .echo = true, .expect = packet_count(LATENCY_BYTES, length, MAX_SAMPLES) };
+	if (!link_init(&link, transport) || pthread_create(&far.thread, NULL, far_thread, &far)) {
+		return false;
+	}
+	for (size_t i = 0; i < far.expect; i++) {
+		double start = bench_now();
+		struct relay_packet *p;
+		if (!relay_client_send_packet(&link.near_tx, "BNCH", "far", payload, length) ||
+				!relay_client_recv_packet(&link.near_rx, &p) || !p) {
+			return false;
+		}
+		free(p);
+		samples[i] = bench_now() - start;
+	}
+	pthread_join(far.thread, NULL);
+	link_destroy(&link);
+	out->p50_us = bench_percentile(samples, far.expect, 50) * 1e6;
+	out->p99_us = bench_percentile(samples, far.expect, 99) * 1e6;
+	out->p999_us = bench_percentile(samples, far.expect, 99.9) * 1e6;
+	return true;
+}
+
+static bool write_json(const char *path, const struct result *results, size_t count)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		return false;
+	}
+	fprintf(f, "{\n\t\"version\": \"%s\",\n\t\"results\": [\n", BENCH_VERSION);
+	for (size_t i = 0; i < count; i++) {
+		const struct result *r = &results[i];
+		fprintf(f, "\t\t{ \"transport\": \"%s\", \"payload\": %zu, \"msgs_per_s\": %.1f, \"mb_per_s\": %.2f, "
+			"\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f }%s\n",
+			transport_names[r->transport], r->length, r->msgs_per_s, r->mb_per_s,
+			r->p50_us, r->p99_us, r->p999_us, i + 1 < count ? "," : "");
+	}
+	fprintf(f, "\t]\n}\n");
+	return fclose(f) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "relay_bench.json";
+	const size_t nsizes = sizeof(sizes)/sizeof(sizes[0]);
+	struct result results[transports * nsizes];
+	size_t count = 0;
+	char *payload = calloc(1, sizes[nsizes - 1]);
+	printf("%-11s %9s %12s %10s %10s %10s %10s\n", "transport", "payload", "msgs/s", "MB/s", "p50 us", "p99 us", "p999 us");
+	for (enum transport transport = 0; transport < transports; transport++) {
+		for (size_t i = 0; i < nsizes; i++) {
+			struct result *r = &results[count++];
+			r->transport = transport;
+			r->length = sizes[i];
+			if (!throughput(transport, sizes[i], payload, r) || !latency(transport, sizes[i], payload, r)) {
+				fprintf(stderr, "Benchmark failed for %s at %zu bytes\n", transport_names[transport], sizes[i]);
+				return 1;
+			}
+			printf("%-11s %9zu %12.0f %10.1f %10.1f %10.1f %10.1f\n", transport_names[transport], r->length,
+				r->msgs_per_s, r->mb_per_s, r->p50_us, r->p99_us, r->p999_us);
+		}
+	}
+	free(payload);
+	if (!write_json(path, results, count)) {
+		fprintf(stderr, "Failed to write %s\n", path);
+		return 1;
+	}
+	printf("Results written to %s\n", path);
+	return 0;
+}
+
+#endif
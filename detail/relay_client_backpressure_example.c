@@ -0,0 +1,106 @@
+#if defined DEMO_relay_client_backpressure
+
+/*
+ * Needs a server at <addr> <port> with the default pause egress policy.
+ *
+ * Several fast senders flood a consumer which never reads.  Once the
+ * consumer's egress queue is over its high water mark, the server must stop
+ * reading from every sender, so each of them is held back after a bounded
+ * amount.  Run against a server with WORKERS=2 to check that senders on
+ * another worker than the consumer are paused too (with several senders,
+ * some almost certainly land on the other worker).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+
+#define SENDERS 8
+#define PAYLOAD (64 * 1024)
+/* Far beyond the server's high water mark plus socket buffers */
+#define SENDER_LIMIT (128UL * 1024 * 1024)
+/* A sender which has made no progress for this long is held back */
+#define STALL_MS 2000
+#define CONSUMER_NAME "bp_consumer"
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3) {
+		fprintf(stderr, "Syntax: %s <addr> <port>\n", argv[0]);
+		return 1;
+	}
+	const char *addr = argv[1];
+	const char *port = argv[2];
+	struct relay_client consumer;
+	struct relay_client senders[SENDERS];
+	if (!relay_client_init_socket(&consumer, CONSUMER_NAME, addr, port)) {
+		fprintf(stderr, "Failed to connect consumer\n");
+		return 2;
+	}
+	for (size_t i = 0; i < SENDERS; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "bp_sender%zu", i);
+		if (!relay_client_init_socket(&senders[i], name, addr, port)) {
+			fprintf(stderr, "Failed to connect sender %zu\n", i);
+			return 2;
+		}
+	}
+	char *payload = malloc(PAYLOAD);
+	memset(payload, 'x', PAYLOAD);
+	size_t sent[SENDERS] = { 0 };
+	long long progress[SENDERS];
+	for (size_t i = 0; i < SENDERS; i++) {
+		progress[i] = now_ms();
+	}
+	size_t held = 0;
+	while (held < SENDERS) {
+		struct pollfd pfd[SENDERS];
+		held = 0;
+		for (size_t i = 0; i < SENDERS; i++) {
+			pfd[i].fd = relay_client_get_fd(&senders[i]);
+			pfd[i].events = POLLOUT;
+			if (now_ms() - progress[i] >= STALL_MS) {
+				held++;
+				pfd[i].fd = -1;
+				continue;
+			}
+			if (sent[i] >= SENDER_LIMIT) {
+				fprintf(stderr, "Sender %zu was not held back after %zu bytes\n", i, sent[i]);
+				return 3;
+			}
+			struct relay_packet p;
+			relay_make_packet(&p, "TEST", CONSUMER_NAME, NULL, payload, PAYLOAD);
+			enum rca_recv_result res = relay_client_try_send(&senders[i], &p);
+			if (res == rcarr_success) {
+				sent[i] += PAYLOAD;
+				progress[i] = now_ms();
+			} else if (res != rcarr_again) {
+				fprintf(stderr, "Sender %zu failed\n", i);
+				return 4;
+			}
+		}
+		poll(pfd, SENDERS, 10);
+	}
+	size_t total = 0;
+	for (size_t i = 0; i < SENDERS; i++) {
+		total += sent[i];
+		relay_client_destroy(&senders[i]);
+	}
+	relay_client_destroy(&consumer);
+	free(payload);
+	fprintf(stderr, "Test completed (%zu senders held back after %zu MiB in total)\n", (size_t) SENDERS, total >> 20);
+	return 0;
+}
+
+#endif
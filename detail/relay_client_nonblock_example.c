@@ -0,0 +1,95 @@
+#if defined DEMO_relay_client_nonblock
+
+/*
+ * Drives two relay clients over a socketpair from one poll() loop, using only
+ * the non-blocking try_send/try_recv functions.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+
+#define PACKETS 1000
+
+static size_t packet_size(int i)
+{
+	/* Mostly small, with some large enough to fill the socket buffer */
+	return i % 100 == 0 ? 1 << 20 : i % 97;
+}
+
+int main()
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		fprintf(stderr, "Failed to create socketpair\n");
+		return 1;
+	}
+	struct relay_client tx;
+	struct relay_client rx;
+	if (!relay_client_init_fd(&tx, NULL, sv[0], true, false) ||
+			!relay_client_init_fd(&rx, NULL, sv[1], true, false)) {
+		fprintf(stderr, "Failed to create relay interfaces\n");
+		return 2;
+	}
+	char *payload = malloc(1 << 20);
+	memset(payload, 'x', 1 << 20);
+	int sent = 0;
+	int received = 0;
+	int waits = 0;
+	while (received < PACKETS) {
+		/* Send until the transport pushes back */
+		while (sent < PACKETS) {
+			struct relay_packet p;
+			relay_make_packet(&p, "TEST", "Potato", NULL, payload, packet_size(sent));
+			enum rca_recv_result res = relay_client_try_send(&tx, &p);
+			if (res == rcarr_again) {
+				break;
+			} else if (res != rcarr_success) {
+				fprintf(stderr, "Failed to send\n");
+				return 3;
+			}
+			sent++;
+		}
+		if (sent == PACKETS && relay_client_try_flush(&tx) == rcarr_fail) {
+			fprintf(stderr, "Failed to flush\n");
+			return 3;
+		}
+		/* Receive everything available */
+		while (true) {
+			struct relay_packet *p;
+			enum rca_recv_result res = relay_client_try_recv(&rx, &p);
+			if (res == rcarr_again) {
+				break;
+			} else if (res != rcarr_success) {
+				fprintf(stderr, "Failed to receive\n");
+				return 4;
+			}
+			if (p->length != packet_size(received)) {
+				fprintf(stderr, "Wrong length received: %zu\n", p->length);
+				return 5;
+			}
+			free(p);
+			received++;
+		}
+		struct pollfd pfd[2] = {
+			{ .fd = relay_client_get_fd(&tx), .events = relay_client_poll_events(&tx) & ~POLLIN },
+			{ .fd = relay_client_get_fd(&rx), .events = relay_client_poll_events(&rx) }
+		};
+		if (received < PACKETS && poll(pfd, 2, -1) == -1) {
+			fprintf(stderr, "Failed to poll\n");
+			return 6;
+		}
+		waits++;
+	}
+	free(payload);
+	relay_client_destroy(&tx);
+	relay_client_destroy(&rx);
+	fprintf(stderr, "Test completed (%d packets, %d waits)\n", received, waits);
+	return 0;
+}
+
+#endif
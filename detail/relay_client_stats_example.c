@@ -0,0 +1,171 @@
+#if defined DEMO_relay_client_stats
+
+/*
+ * Sends packets between two relay clients over a socketpair with stats
+ * enabled on both, while a monitoring thread scrapes snapshots, then checks
+ * the counters and histograms add up.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+
+#define PACKETS 2000
+
+static size_t packet_size(int i)
+{
+	/* Mostly small, with some large enough to fill the socket buffer */
+	return i % 100 == 0 ? 1 << 20 : i % 97;
+}
+
+struct sender {
+	struct relay_client *client;
+	char *payload;
+	bool ok;
+};
+
+static void *send_thread(void *arg)
+{
+	struct sender *s = arg;
+	s->ok = true;
+	for (int i = 0; s->ok && i < PACKETS; i++) {
+		s->ok = relay_client_send_packet(s->client, "TEST", "Potato", s->payload, packet_size(i));
+	}
+	return NULL;
+}
+
+static volatile bool monitoring = true;
+
+static void *monitor_thread(void *arg)
+{
+	struct relay_client *client = arg;
+	struct relay_client_stats snap;
+	uint64_t last = 0;
+	while (monitoring) {
+		relay_client_get_stats(client, &snap);
+		if (snap.packets_received < last) {
+			fprintf(stderr, "Counter went backwards\n");
+			exit(4);
+		}
+		last = snap.packets_received;
+		usleep(100);
+	}
+	return NULL;
+}
+
+static uint64_t histogram_total(const struct relay_client_histogram *hist)
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < RELAY_CLIENT_HIST_BUCKETS; i++) {
+		total += hist->count[i];
+	}
+	return total;
+}
+
+static void print_stats(const char *name, const struct relay_client_stats *s)
+{
+	printf("%s: %lu/%lu packets sent/received, %lu/%lu bytes, %lu writes, %lu reads, %lu EAGAIN, %lu polls (%.3f ms)\n",
+		name, s->packets_sent, s->packets_received, s->bytes_sent, s->bytes_received,
+		s->write_calls, s->read_calls, s->eagain, s->poll_waits, s->blocked_ns / 1e6);
+	printf("%s: send p50=%luns p99=%luns, recv p50=%luns p99=%luns\n", name,
+		relay_client_histogram_percentile(&s->send_latency, 50),
+		relay_client_histogram_percentile(&s->send_latency, 99),
+		relay_client_histogram_percentile(&s->recv_latency, 50),
+		relay_client_histogram_percentile(&s->recv_latency, 99));
+}
+
+int main()
+{
+	/* Bucket boundaries increase strictly and percentiles land on them */
+	for (size_t i = 1; i < RELAY_CLIENT_HIST_BUCKETS - 4; i++) {
+		if (relay_client_histogram_bucket_min(i) <= relay_client_histogram_bucket_min(i - 1)) {
+			fprintf(stderr, "Histogram bucket %zu out of order\n", i);
+			return 1;
+		}
+	}
+	struct relay_client_histogram hist;
+	memset(&hist, 0, sizeof(hist));
+	hist.count[10] = 90;
+	hist.count[40] = 10;
+	if (relay_client_histogram_percentile(&hist, 50) != relay_client_histogram_bucket_min(10) ||
+			relay_client_histogram_percentile(&hist, 99) != relay_client_histogram_bucket_min(40)) {
+		fprintf(stderr, "Wrong histogram percentile\n");
+		return 1;
+	}
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		fprintf(stderr, "Failed to create socketpair\n");
+		return 1;
+	}
+	struct relay_client tx;
+	struct relay_client rx;
+	if (!relay_client_init_fd(&tx, NULL, sv[0], true, false) ||
+			!relay_client_init_fd(&rx, NULL, sv[1], true, false)) {
+		fprintf(stderr, "Failed to create relay interfaces\n");
+		return 2;
+	}
+	if (!relay_client_enable_stats(&tx) || !relay_client_enable_stats(&rx)) {
+		fprintf(stderr, "Failed to enable stats\n");
+		return 2;
+	}
+	struct sender s = { .client = &tx, .payload = malloc(1 << 20) };
+	memset(s.payload, 'x', 1 << 20);
+	pthread_t sender;
+	pthread_t monitor;
+	pthread_create(&sender, NULL, send_thread, &s);
+	pthread_create(&monitor, NULL, monitor_thread, &rx);
+	uint64_t bytes = 0;
+	for (int i = 0; i < PACKETS; i++) {
+		struct relay_packet *p;
+		if (!relay_client_recv_packet(&rx, &p) || !p) {
+			fprintf(stderr, "Failed to receive packet %d\n", i);
+			return 3;
+		}
+		if (p->length != packet_size(i)) {
+			fprintf(stderr, "Packet %d has wrong length\n", i);
+			return 3;
+		}
+		bytes += relay_serialised_packet_size(p->length);
+		free(p);
+	}
+	pthread_join(sender, NULL);
+	monitoring = false;
+	pthread_join(monitor, NULL);
+	if (!s.ok) {
+		fprintf(stderr, "Failed to send\n");
+		return 3;
+	}
+
+	struct relay_client_stats ts;
+	struct relay_client_stats rs;
+	relay_client_get_stats(&tx, &ts);
+	relay_client_get_stats(&rx, &rs);
+	print_stats("tx", &ts);
+	print_stats("rx", &rs);
+	if (ts.packets_sent != PACKETS || ts.bytes_sent != bytes ||
+			rs.packets_received != PACKETS || rs.bytes_received != bytes) {
+		fprintf(stderr, "Packet/byte counters do not match\n");
+		return 4;
+	}
+	if (ts.write_calls < PACKETS || rs.read_calls < PACKETS || ts.read_calls || rs.write_calls) {
+		fprintf(stderr, "Syscall counters do not match\n");
+		return 4;
+	}
+	if (histogram_total(&ts.send_latency) != PACKETS || histogram_total(&rs.recv_latency) != PACKETS ||
+			histogram_total(&ts.recv_latency) || histogram_total(&rs.send_latency)) {
+		fprintf(stderr, "Histogram totals do not match\n");
+		return 4;
+	}
+	relay_client_destroy(&rx);
+	relay_client_destroy(&tx);
+	free(s.payload);
+	printf("Test completed\n");
+	return 0;
+}
+
+#endif
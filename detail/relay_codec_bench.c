@@ -0,0 +1,118 @@
+#if defined BENCH_relay_codec
+
+/*
+ * Nanoseconds per header built, per serialised packet built, and per packet
+ * sent to /dev/null, with and without a header template.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "bench.h"
+
+#define ITERATIONS 5000000
+#define SEND_ITERATIONS 1000000
+
+static char payload[64];
+
+/* Keeps the compiler from discarding the work */
+static volatile uint32_t sink;
+
+static double header_via_packet()
+{
+	struct relay_packet_serial_hdr hdr;
+	double start = bench_now();
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		struct relay_packet p;
+		relay_make_packet(&p, "BNCH", "remote-endpoint", "local-endpoint", payload, i & 63);
+		relay_serialise_packet_header(&hdr, &p);
+		sink += hdr.length;
+	}
+	return (bench_now() - start) / ITERATIONS * 1e9;
+}
+
+static double header_via_template()
+{
+	struct relay_packet_serial_hdr hdr;
+	struct relay_header_template tpl;
+	relay_header_template_init(&tpl, "BNCH", "remote-endpoint", "local-endpoint");
+	double start = bench_now();
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		relay_header_template_apply(&tpl, &hdr, i & 63);
+		sink += hdr.length;
+	}
+	return (bench_now() - start) / ITERATIONS * 1e9;
+}
+
+static double serialised_via_packet()
+{
+	double start = bench_now();
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		struct relay_packet p;
+		size_t size;
+		relay_make_packet(&p, "BNCH", "remote-endpoint", "local-endpoint", payload, i & 63);
+		struct relay_packet_serial *ps = relay_serialise_packet(NULL, &p, &size);
+		sink += ps->header.length;
+		free(ps);
+	}
+	return (bench_now() - start) / ITERATIONS * 1e9;
+}
+
+static double serialised_direct()
+{
+	double start = bench_now();
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		size_t size;
+		struct relay_packet_serial *ps = relay_make_serialised_packet("BNCH", "remote-endpoint", "local-endpoint", payload, i & 63, &size);
+		sink += ps->header.length;
+		free(ps);
+	}
+	return (bench_now() - start) / ITERATIONS * 1e9;
+}
+
+static double send_null(bool template)
+{
+	struct relay_client client;
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd == -1 || !relay_client_init_fd(&client, "local-endpoint", fd, true, false)) {
+		return -1;
+	}
+	struct relay_header_template tpl;
+	relay_client_make_template(&client, &tpl, "BNCH", "remote-endpoint");
+	double start = bench_now();
+	for (size_t i = 0; i < SEND_ITERATIONS; i++) {
+		bool ok = template ?
+			relay_client_send_template(&client, &tpl, payload, i & 63) :
+			relay_client_send_packet(&client, "BNCH", "remote-endpoint", payload, i & 63);
+		if (!ok) {
+			return -1;
+		}
+	}
+	double elapsed = bench_now() - start;
+	relay_client_destroy(&client);
+	return elapsed / SEND_ITERATIONS * 1e9;
+}
+
+int main()
+{
+	double send_packet = send_null(false);
+	double send_template = send_null(true);
+	if (send_packet < 0 || send_template < 0) {
+		fprintf(stderr, "Benchmark failed\n");
+		return 1;
+	}
+	printf("%-20s %12s %12s %8s\n", "operation", "generic ns", "direct ns", "ratio");
+	double generic = header_via_packet();
+	double direct = header_via_template();
+	printf("%-20s %12.1f %12.1f %8.2f\n", "header", generic, direct, generic / direct);
+	generic = serialised_via_packet();
+	direct = serialised_direct();
+	printf("%-20s %12.1f %12.1f %8.2f\n", "serialised packet", generic, direct, generic / direct);
+	printf("%-20s %12.1f %12.1f %8.2f\n", "send to /dev/null", send_packet, send_template, send_packet / send_template);
+	return 0;
+}
+
+#endif
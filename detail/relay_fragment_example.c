@@ -0,0 +1,220 @@
+#if defined DEMO_relay_fragment
+
+/*
+ * Sends large messages fragmented over a socketpair, interleaved with small
+ * packets and with each other, and checks that the receiving client
+ * reassembles them whichever receive function completes them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+
+#define FRAGMENT_SIZE 4096
+#define LARGE (1 << 20)
+
+static char *large_a;
+static char *large_b;
+
+static void fill(char *buf, size_t length, unsigned seed)
+{
+	for (size_t i = 0; i < length; i++) {
+		buf[i] = seed + i * 7 + (i >> 12);
+	}
+}
+
+/* Writes one fragment straight to the socket, bypassing the client */
+static bool write_fragment(int fd, struct relay_fragmenter *it)
+{
+	struct iovec iov[3];
+	size_t iovcnt = relay_fragmenter_next(it, iov);
+	size_t length = 0;
+	for (size_t i = 0; i < iovcnt; i++) {
+		length += iov[i].iov_len;
+	}
+	return iovcnt && writev(fd, iov, iovcnt) == (ssize_t) length;
+}
+
+struct sender {
+	struct relay_client *client;
+	int fd;
+	bool ok;
+};
+
+static void *send_thread(void *arg)
+{
+	struct sender *s = arg;
+	struct relay_client *c = s->client;
+	relay_client_set_fragment_size(c, FRAGMENT_SIZE);
+	bool ok = true;
+	/* 1: fragmented message, then a small packet which is not fragmented */
+	ok = ok && relay_client_send_packet(c, "BIG", "rx", large_a, LARGE);
+	ok = ok && relay_client_send_text(c, "CTRL", "rx", "ping");
+	/* 2: as a template send, and a serialised packet */
+	struct relay_header_template tpl;
+	relay_client_make_template(c, &tpl, "TPL", "rx");
+	ok = ok && relay_client_send_template(c, &tpl, large_b, LARGE / 2 + 1);
+	size_t size;
+	struct relay_packet_serial *ps = relay_make_serialised_packet("SER", "rx", "tx", large_a, FRAGMENT_SIZE * 3, &size);
+	ok = ok && relay_client_send_packet3(c, ps, size);
+	free(ps);
+	/* 3: two messages interleaved a fragment at a time, with a control packet between */
+	struct relay_header_template ta;
+	struct relay_header_template tb;
+	struct relay_packet_serial_hdr ha;
+	struct relay_packet_serial_hdr hb;
+	relay_header_template_init(&ta, "IA", "rx", "tx");
+	relay_header_template_init(&tb, "IB", "rx", "tx");
+	relay_header_template_apply(&ta, &ha, FRAGMENT_SIZE * 3);
+	relay_header_template_apply(&tb, &hb, FRAGMENT_SIZE * 2 + 5);
+	struct relay_fragmenter fa;
+	struct relay_fragmenter fb;
+	relay_fragmenter_init(&fa, &ha, 1, large_a, FRAGMENT_SIZE);
+	relay_fragmenter_init(&fb, &hb, 2, large_b, FRAGMENT_SIZE);
+	ok = ok && write_fragment(s->fd, &fa) && write_fragment(s->fd, &fb);
+	ok = ok && relay_client_send_text(c, "CTRL", "rx", "pong");
+	ok = ok && write_fragment(s->fd, &fa) && write_fragment(s->fd, &fb);
+	ok = ok && write_fragment(s->fd, &fa) && write_fragment(s->fd, &fb);
+	/* 4: a message which never completes, and a stray fragment of an unknown one */
+	struct relay_fragmenter fc;
+	relay_fragmenter_init(&fc, &ha, 3, large_a, FRAGMENT_SIZE);
+	ok = ok && write_fragment(s->fd, &fc);
+	relay_fragmenter_init(&fc, &ha, 4, large_a, FRAGMENT_SIZE);
+	fc.offset = FRAGMENT_SIZE;
+	ok = ok && write_fragment(s->fd, &fc);
+	ok = ok && relay_client_send_text(c, "END", "rx", "");
+	s->ok = ok;
+	return NULL;
+}
+
+static bool check(struct relay_packet *p, const char *type, const void *data, size_t length)
+{
+	if (!p) {
+		fprintf(stderr, "Missing packet, expected %s\n", type);
+		return false;
+	}
+	if (strcmp(p->type, type) != 0 || p->length != length || memcmp(p->data, data, length) != 0 || p->data[length] != 0) {
+		fprintf(stderr, "Wrong packet: got %s/%zu, expected %s/%zu\n", p->type, p->length, type, length);
+		return false;
+	}
+	if (strcmp(p->remote, "rx") != 0 || strcmp(p->local, "tx") != 0) {
+		fprintf(stderr, "Wrong endpoints on %s: %s/%s\n", type, p->remote, p->local);
+		return false;
+	}
+	return true;
+}
+
+int main()
+{
+	large_a = malloc(LARGE);
+	large_b = malloc(LARGE);
+	fill(large_a, LARGE, 1);
+	fill(large_b, LARGE, 2);
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		fprintf(stderr, "Failed to create socketpair\n");
+		return 1;
+	}
+	struct relay_client tx;
+	struct relay_client rx;
+	if (!relay_client_init_fd(&tx, "tx", sv[0], true, false) ||
+			!relay_client_init_fd(&rx, NULL, sv[1], true, false) ||
+			!relay_client_enable_pool(&rx) || !relay_client_enable_stats(&rx)) {
+		fprintf(stderr, "Failed to create relay interfaces\n");
+		return 2;
+	}
+	struct sender s = { .client = &tx, .fd = sv[0] };
+	pthread_t sender;
+	pthread_create(&sender, NULL, send_thread, &s);
+
+	struct relay_packet *p;
+	bool ok = true;
+	ok = ok && relay_client_recv_packet(&rx, &p) && check(p, "BIG", large_a, LARGE);
+	free(p);
+	ok = ok && relay_client_recv_pooled_packet(&rx, &p) && check(p, "CTRL", "ping", 4);
+	relay_client_release_packet(&rx, p);
+	ok = ok && relay_client_recv_pooled_packet(&rx, &p) && check(p, "TPL", large_b, LARGE / 2 + 1);
+	relay_client_release_packet(&rx, p);
+	struct relay_packet_serial *ps;
+	ok = ok && relay_client_recv_serialised_packet(&rx, &ps) && ps;
+	if (ok) {
+		struct relay_packet d;
+		relay_deserialise_packet(&d, ps, sizeof(*ps) + relay_serialised_packet_data_length(&ps->header));
+		ok = check(&d, "SER", large_a, FRAGMENT_SIZE * 3);
+		free(ps);
+	}
+	/* Control packet overtakes both interleaved messages */
+	ok = ok && relay_client_recv_packet(&rx, &p) && check(p, "CTRL", "pong", 4);
+	free(p);
+	/* IA was started by a malloc receive and is completed by a pooled one */
+	ok = ok && relay_client_recv_pooled_packet(&rx, &p) && check(p, "IA", large_a, FRAGMENT_SIZE * 3);
+	relay_client_release_packet(&rx, p);
+	enum rca_recv_result res;
+	while (ok && (res = relay_client_try_recv(&rx, &p)) == rcarr_again) {
+		usleep(1000);
+	}
+	ok = ok && res == rcarr_success && check(p, "IB", large_b, FRAGMENT_SIZE * 2 + 5);
+	free(p);
+	ok = ok && relay_client_recv_packet(&rx, &p) && check(p, "END", "", 0);
+	free(p);
+	pthread_join(sender, NULL);
+	if (!ok || !s.ok) {
+		fprintf(stderr, "Test failed (send %s)\n", s.ok ? "ok" : "failed");
+		return 3;
+	}
+	struct relay_client_stats stats;
+	relay_client_get_stats(&rx, &stats);
+	if (stats.packets_received != 8) {
+		fprintf(stderr, "Expected 8 messages received, counted %lu\n", stats.packets_received);
+		return 4;
+	}
+
+	/* With reassembly off, fragments arrive as they are */
+	struct relay_client raw;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) ||
+			!relay_client_init_fd(&raw, NULL, sv[1], true, false)) {
+		fprintf(stderr, "Failed to create relay interface\n");
+		return 2;
+	}
+	relay_client_set_reassembly(&raw, false);
+	struct relay_fragmenter fa;
+	struct relay_packet_serial_hdr ha;
+	struct relay_header_template ta;
+	relay_header_template_init(&ta, "IA", "rx", "tx");
+	relay_header_template_apply(&ta, &ha, FRAGMENT_SIZE + 1);
+	relay_fragmenter_init(&fa, &ha, 9, large_a, FRAGMENT_SIZE);
+	if (!write_fragment(sv[0], &fa) || !write_fragment(sv[0], &fa) || write_fragment(sv[0], &fa)) {
+		fprintf(stderr, "Wrong number of fragments\n");
+		return 5;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (!relay_client_recv_packet(&raw, &p) || !p || strcmp(p->type, RELAY_FRAGMENT_TYPE) != 0) {
+			fprintf(stderr, "Expected a raw fragment\n");
+			return 5;
+		}
+		const struct relay_fragment_hdr *frag = (const void *) p->data;
+		if (memcmp(frag->type, "IA", 2) != 0 || ntohl(frag->id) != 9 || ntohl(frag->total_length) != FRAGMENT_SIZE + 1 ||
+				ntohl(frag->offset) != (uint32_t) (i * FRAGMENT_SIZE) ||
+				p->length != sizeof(*frag) + (i ? 1 : FRAGMENT_SIZE)) {
+			fprintf(stderr, "Wrong raw fragment %d\n", i);
+			return 5;
+		}
+		free(p);
+	}
+	close(sv[0]);
+	relay_client_destroy(&raw);
+	relay_client_destroy(&rx);
+	relay_client_destroy(&tx);
+	free(large_a);
+	free(large_b);
+	printf("Test completed\n");
+	return 0;
+}
+
+#endif
@@ -0,0 +1,125 @@
+#if defined BENCH_relay_pipe
+
+/*
+ * Burst throughput through relay_pipe with each kind of tap, and through
+ * forwarding pipes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "../relay_pipe.h"
+#include "bench.h"
+
+#define PACKETS 200000
+#define BURST 256
+
+enum mode { no_tap, packet_tap, batch_tap, forward_splice, forward_header_tap, modes };
+
+static const char *mode_names[] = { "no tap", "packet tap", "batch tap", "splice", "header tap" };
+
+/* All taps drop every fourth packet (marked by its type) */
+
+static bool drop_packet(struct relay_packet **packet, void *misc)
+{
+	(void) misc;
+	return strcmp((*packet)->type, "DROP") != 0;
+}
+
+static uint64_t drop_batch(struct relay_packet **packets, size_t count, void *misc)
+{
+	(void) misc;
+	uint64_t keep = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (strcmp(packets[i]->type, "DROP") != 0) {
+			keep |= UINT64_C(1) << i;
+		}
+	}
+	return keep;
+}
+
+static bool drop_header(struct relay_packet_serial_hdr *header, void *misc)
+{
+	(void) misc;
+	return memcmp(header->type, "DROP", RELAY_TYPE_LENGTH) != 0;
+}
+
+/* Returns packets per second, or negative on failure */
+static double run(enum mode mode, size_t length)
+{
+	static char payload[4096];
+	int in[2];
+	int out[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, in) || socketpair(AF_UNIX, SOCK_STREAM, 0, out)) {
+		return -1;
+	}
+	struct bench_sink sink;
+	struct relay_client client;
+	struct relay_pipe pipe;
+	bool ok;
+	switch (mode) {
+	case no_tap: ok = relay_pipe_init(&pipe, in[1], out[0], true, NULL, NULL); break;
+	case packet_tap: ok = relay_pipe_init(&pipe, in[1], out[0], true, drop_packet, NULL); break;
+	case batch_tap: ok = relay_pipe_init_batch(&pipe, in[1], out[0], true, drop_batch, NULL); break;
+	case forward_splice: ok = relay_pipe_init_forward(&pipe, in[1], out[0], true, NULL, NULL); break;
+	case forward_header_tap: ok = relay_pipe_init_forward(&pipe, in[1], out[0], true, drop_header, NULL); break;
+	default: ok = false;
+	}
+	if (!ok || !bench_sink_start(&sink, out[1]) || !relay_client_init_fd(&client, NULL, in[0], true, false)) {
+		return -1;
+	}
+	bool dropping = mode != no_tap && mode != forward_splice;
+	size_t expect = 0;
+	double start = bench_now();
+	for (size_t i = 0; i < PACKETS; i += BURST) {
+		if (!relay_client_batch_begin(&client)) {
+			return -1;
+		}
+		for (size_t j = 0; j < BURST; j++) {
+			const char *type = j % 4 == 3 ? "DROP" : "KEEP";
+			if (!relay_client_batch_append(&client, type, "sink", payload, length)) {
+				return -1;
+			}
+			if (!dropping || j % 4 != 3) {
+				expect += relay_serialised_packet_size(length);
+			}
+		}
+		if (!relay_client_flush(&client)) {
+			return -1;
+		}
+	}
+	/* Pipe exits on EOF from the client, which closes the output for the sink */
+	relay_client_destroy(&client);
+	while (__atomic_load_n(&sink.bytes, __ATOMIC_RELAXED) < expect) {
+		usleep(100);
+	}
+	double elapsed = bench_now() - start;
+	relay_pipe_destroy(&pipe);
+	size_t bytes = bench_sink_join(&sink);
+	if (pipe.failed || bytes != expect) {
+		return -1;
+	}
+	return PACKETS / elapsed;
+}
+
+int main()
+{
+	static const size_t sizes[] = { 16, 256, 4096 };
+	printf("%-12s %8s %14s\n", "mode", "payload", "pkt/s");
+	for (enum mode mode = 0; mode < modes; mode++) {
+		for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+			double rate = run(mode, sizes[i]);
+			if (rate < 0) {
+				fprintf(stderr, "Benchmark failed for %s at %zu bytes\n", mode_names[mode], sizes[i]);
+				return 1;
+			}
+			printf("%-12s %8zu %14.0f\n", mode_names[mode], sizes[i], rate);
+		}
+	}
+	return 0;
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include "../relay_packet.h"
 #include "../relay_client.h"
 #include "../relay_pipe.h"
@@ -45,7 +46,7 @@ int main()
 	struct relay_pipe mid;
 	if (!relay_client_init_fd(&in, NULL, pin.write, true, false) ||
 			!relay_client_init_fd(&out, NULL, pout.read, true, false) ||
-			!relay_pipe_init(&mid, pin.read, pout.write, true, tap, NULL)) {
+			!relay_pipe_init(&mid, pin.read, pout.write, false, tap, NULL)) {
 		fprintf(stderr, "Failed to create relay interfaces\n");
 		return 2;
 	}
@@ -83,6 +84,13 @@ int main()
 	free(p);
 	/* Deinit */
 	relay_pipe_destroy(&mid);
+	/* The pipe does not own its fds, and leaves the input as it found it */
+	if (fcntl(pin.read, F_GETFL) & O_NONBLOCK) {
+		fprintf(stderr, "Pipe input left non-blocking\n");
+		return 8;
+	}
+	close(pin.read);
+	close(pout.write);
 	relay_client_destroy(&in);
 	relay_client_destroy(&out);
 	fprintf(stderr, "Test completed\n");
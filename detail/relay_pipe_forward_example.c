@@ -0,0 +1,187 @@
+#if defined DEMO_relay_pipe_forward
+
+/*
+ * Forwarding pipes: one filtering on headers only, one splicing the raw
+ * stream with no tap, and one splicing into a file opened for appending, which
+ * splice() cannot write to.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "../relay_pipe.h"
+
+#define PACKETS 1000
+
+static bool header_tap(struct relay_packet_serial_hdr *header, void *misc)
+{
+	(void) misc;
+	if (memcmp(header->type, "DROP", RELAY_TYPE_LENGTH) == 0) {
+		return false;
+	}
+	memcpy(header->remote, "Tapped", 7);
+	return true;
+}
+
+static size_t packet_size(int i)
+{
+	return i % 100 == 0 ? 100000 : i % 37;
+}
+
+static int run(bool tapped)
+{
+	int pin[2];
+	int pout[2];
+	if (pipe(pin) || pipe(pout)) {
+		fprintf(stderr, "Failed to create pipes\n");
+		return 1;
+	}
+	struct relay_client in;
+	struct relay_client out;
+	struct relay_pipe mid;
+	if (!relay_client_init_fd(&in, NULL, pin[1], true, false) ||
+			!relay_client_init_fd(&out, NULL, pout[0], true, false) ||
+			!relay_pipe_init_forward(&mid, pin[0], pout[1], true, tapped ? header_tap : NULL, NULL)) {
+		fprintf(stderr, "Failed to create relay interfaces\n");
+		return 2;
+	}
+	char *payload = malloc(100000);
+	int received = 0;
+	for (int i = 0; i < PACKETS; i++) {
+		size_t length = packet_size(i);
+		memset(payload, i, length);
+		struct relay_packet p;
+		relay_make_packet(&p, i % 3 == 0 ? "DROP" : "KEEP", "Potato", NULL, payload, length);
+		if (!relay_client_send_packet2(&in, &p)) {
+			fprintf(stderr, "Failed to send\n");
+			return 3;
+		}
+		if (tapped && i % 3 == 0) {
+			continue;
+		}
+		struct relay_packet *r;
+		if (!relay_client_recv_packet(&out, &r) || r == NULL) {
+			fprintf(stderr, "Failed to receive\n");
+			return 4;
+		}
+		if (r->length != length || memcmp(r->data, payload, length) != 0 ||
+				strcmp(r->remote, tapped ? "Tapped" : "Potato") != 0) {
+			fprintf(stderr, "Wrong packet received for %d\n", i);
+			return 5;
+		}
+		free(r);
+		received++;
+	}
+	free(payload);
+	relay_pipe_destroy(&mid);
+	relay_client_destroy(&in);
+	relay_client_destroy(&out);
+	fprintf(stderr, "%s: %d packets forwarded\n", tapped ? "Header tap" : "Splice", received);
+	return 0;
+}
+
+/* Fills the pipe's input from another thread, so a stuck pipe cannot block the test */
+static void *append_sender(void *arg)
+{
+	struct relay_client *in = arg;
+	char *payload = malloc(100000);
+	for (int i = 0; i < PACKETS; i++) {
+		size_t length = packet_size(i);
+		memset(payload, i, length);
+		if (!relay_client_send_packet(in, "KEEP", "Potato", payload, length)) {
+			fprintf(stderr, "Failed to send\n");
+			break;
+		}
+	}
+	free(payload);
+	return NULL;
+}
+
+/* The input is spliced into the kernel pipe before the output refuses it */
+static int run_append()
+{
+	/* Report a sender cut off by a failed pipe, rather than dying of SIGPIPE */
+	signal(SIGPIPE, SIG_IGN);
+	char path[] = "/tmp/relay_pipe_forward_XXXXXX";
+	int fd = mkstemp(path);
+	int pin[2];
+	if (fd == -1 || pipe(pin)) {
+		fprintf(stderr, "Failed to create file and pipe\n");
+		return 6;
+	}
+	int fd_out = open(path, O_WRONLY | O_APPEND);
+	unlink(path);
+	struct relay_client in;
+	struct relay_client out;
+	struct relay_pipe mid;
+	if (fd_out == -1 ||
+			!relay_client_init_fd(&in, NULL, pin[1], true, false) ||
+			!relay_pipe_init_forward(&mid, pin[0], fd_out, true, NULL, NULL)) {
+		fprintf(stderr, "Failed to create relay interfaces\n");
+		return 6;
+	}
+	pthread_t sender;
+	if (pthread_create(&sender, NULL, append_sender, &in)) {
+		fprintf(stderr, "Failed to start sender\n");
+		return 7;
+	}
+	off_t total = 0;
+	for (int i = 0; i < PACKETS; i++) {
+		total += relay_serialised_packet_size(packet_size(i));
+	}
+	/* Wait for everything to reach the file */
+	struct stat st;
+	for (int i = 0; i < 5000 && fstat(fd, &st) == 0 && st.st_size < total; i++) {
+		usleep(1000);
+	}
+	/* Closes the input, so a sender held up by a failed pipe gives up */
+	relay_pipe_destroy(&mid);
+	pthread_join(sender, NULL);
+	relay_client_destroy(&in);
+	if (st.st_size != total) {
+		fprintf(stderr, "File has %jd of %jd bytes (pipe state %d)\n", (intmax_t) st.st_size, (intmax_t) total, mid.failed);
+		return 8;
+	}
+	if (!relay_client_init_fd(&out, NULL, fd, true, false)) {
+		return 9;
+	}
+	char *payload = malloc(100000);
+	for (int i = 0; i < PACKETS; i++) {
+		size_t length = packet_size(i);
+		memset(payload, i, length);
+		struct relay_packet *r;
+		if (!relay_client_recv_packet(&out, &r) || r == NULL ||
+				r->length != length || memcmp(r->data, payload, length) != 0) {
+			fprintf(stderr, "Wrong packet in file for %d\n", i);
+			return 10;
+		}
+		free(r);
+	}
+	free(payload);
+	relay_client_destroy(&out);
+	fprintf(stderr, "Append: %d packets forwarded\n", PACKETS);
+	return 0;
+}
+
+int main()
+{
+	int ret = run(true);
+	if (ret == 0) {
+		ret = run(false);
+	}
+	if (ret == 0) {
+		ret = run_append();
+	}
+	if (ret == 0) {
+		fprintf(stderr, "Test completed\n");
+	}
+	return ret;
+}
+
+#endif
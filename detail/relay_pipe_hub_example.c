@@ -0,0 +1,173 @@
+#if defined DEMO_relay_pipe_hub
+
+/*
+ * Runs many pipes on a two-thread hub, removing half of them part way through,
+ * then checks that a pipe added with a backlog of input is drained completely.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "../relay_pipe.h"
+
+#define PIPES 32
+#define ROUNDS 100
+#define BACKLOG 200
+
+static bool tap(struct relay_packet **packet, void *misc)
+{
+	/* Drop empty packets, tag the rest with the pipe index */
+	struct relay_packet *p = *packet;
+	if (p->length == 0) {
+		return false;
+	}
+	p->data[0] = (char) (size_t) misc;
+	return true;
+}
+
+struct endpoint {
+	struct relay_client in;
+	struct relay_client out;
+	struct relay_pipe mid;
+	bool open;
+};
+
+static bool round_trip(struct endpoint *ep, size_t index, int round)
+{
+	char data[64];
+	size_t length = 1 + round % (sizeof(data) - 1);
+	memset(data, 'x', length);
+	struct relay_packet p;
+	relay_make_packet(&p, "TEST", "Potato", NULL, "", 0);
+	if (!relay_client_send_packet2(&ep->in, &p)) {
+		return false;
+	}
+	relay_make_packet(&p, "TEST", "Potato", NULL, data, length);
+	if (!relay_client_send_packet2(&ep->in, &p)) {
+		return false;
+	}
+	struct relay_packet *r;
+	if (!relay_client_recv_packet(&ep->out, &r) || r == NULL) {
+		return false;
+	}
+	bool ok = r->length == length && r->data[0] == (char) index;
+	free(r);
+	return ok;
+}
+
+static bool backlog()
+{
+	/*
+	 * Queue the input before the pipe joins the hub, so most of it sits in
+	 * the reader's buffer rather than in the fd
+	 */
+	struct relay_pipe_hub hub;
+	struct relay_client in;
+	struct relay_client out;
+	struct relay_pipe mid;
+	int pin[2];
+	int pout[2];
+	if (!relay_pipe_hub_init(&hub, 1) || pipe(pin) || pipe(pout) ||
+			!relay_client_init_fd(&in, NULL, pin[1], true, false) ||
+			!relay_client_init_fd(&out, NULL, pout[0], true, false)) {
+		fprintf(stderr, "Failed to create backlog interfaces\n");
+		return false;
+	}
+	struct relay_packet p;
+	relay_make_packet(&p, "TEST", "Potato", NULL, "x", 1);
+	for (int i = 0; i < BACKLOG; i++) {
+		if (!relay_client_send_packet2(&in, &p)) {
+			fprintf(stderr, "Failed to queue packet %d\n", i);
+			return false;
+		}
+	}
+	if (!relay_pipe_hub_add(&hub, &mid, pin[0], pout[1], true, NULL, NULL)) {
+		fprintf(stderr, "Failed to add backlog pipe\n");
+		return false;
+	}
+	int received = 0;
+	while (received < BACKLOG) {
+		struct pollfd pfd = { .fd = pout[0], .events = POLLIN };
+		if (poll(&pfd, 1, 1000) != 1) {
+			break;
+		}
+		struct relay_packet *r;
+		if (!relay_client_recv_packet(&out, &r) || r == NULL) {
+			break;
+		}
+		free(r);
+		received++;
+	}
+	relay_pipe_destroy(&mid);
+	relay_client_destroy(&in);
+	relay_client_destroy(&out);
+	relay_pipe_hub_destroy(&hub);
+	if (received < BACKLOG) {
+		fprintf(stderr, "STALL after %d packets\n", received);
+		return false;
+	}
+	return true;
+}
+
+int main()
+{
+	struct relay_pipe_hub hub;
+	if (!relay_pipe_hub_init(&hub, 2)) {
+		fprintf(stderr, "Failed to create hub\n");
+		return 1;
+	}
+	struct endpoint *ep = calloc(PIPES, sizeof(*ep));
+	for (size_t i = 0; i < PIPES; i++) {
+		int pin[2];
+		int pout[2];
+		if (pipe(pin) || pipe(pout)) {
+			fprintf(stderr, "Failed to create pipes\n");
+			return 1;
+		}
+		if (!relay_client_init_fd(&ep[i].in, NULL, pin[1], true, false) ||
+				!relay_client_init_fd(&ep[i].out, NULL, pout[0], true, false) ||
+				!relay_pipe_hub_add(&hub, &ep[i].mid, pin[0], pout[1], true, tap, (void *) i)) {
+			fprintf(stderr, "Failed to create relay interfaces\n");
+			return 2;
+		}
+		ep[i].open = true;
+	}
+	for (int round = 0; round < ROUNDS; round++) {
+		/* Remove every other pipe half way through */
+		if (round == ROUNDS / 2) {
+			for (size_t i = 0; i < PIPES; i += 2) {
+				relay_pipe_destroy(&ep[i].mid);
+				ep[i].open = false;
+			}
+		}
+		for (size_t i = 0; i < PIPES; i++) {
+			if (ep[i].open && !round_trip(&ep[i], i, round)) {
+				fprintf(stderr, "Round trip failed on pipe %zu, round %d\n", i, round);
+				return 3;
+			}
+		}
+	}
+	for (size_t i = 0; i < PIPES; i++) {
+		if (ep[i].open) {
+			if (ep[i].mid.failed) {
+				fprintf(stderr, "Pipe %zu failed (%d)\n", i, ep[i].mid.failed);
+				return 4;
+			}
+			relay_pipe_destroy(&ep[i].mid);
+		}
+		relay_client_destroy(&ep[i].in);
+		relay_client_destroy(&ep[i].out);
+	}
+	free(ep);
+	relay_pipe_hub_destroy(&hub);
+	if (!backlog()) {
+		return 5;
+	}
+	fprintf(stderr, "Test completed\n");
+	return 0;
+}
+
+#endif
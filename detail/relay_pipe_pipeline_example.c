@@ -0,0 +1,142 @@
+#if defined DEMO_relay_pipe_pipeline
+
+/*
+ * Pipelined pipes: a lossless one with a slow tap, and lossy ones with a
+ * stalled consumer for each drop policy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "../relay_pipe.h"
+
+#define PACKETS 20000
+
+/* Drops packets with odd sequence numbers, and is occasionally slow */
+static bool tap(struct relay_packet **packet, void *misc)
+{
+	(void) misc;
+	unsigned seq;
+	memcpy(&seq, (*packet)->data, sizeof(seq));
+	if (seq % 1000 == 0) {
+		usleep(1000);
+	}
+	return seq % 2 == 0;
+}
+
+static void *send_all(void *arg)
+{
+	struct relay_client *in = arg;
+	char payload[256] = { 0 };
+	for (unsigned seq = 0; seq < PACKETS; seq++) {
+		memcpy(payload, &seq, sizeof(seq));
+		struct relay_packet p;
+		relay_make_packet(&p, "TEST", "Potato", NULL, payload, sizeof(payload));
+		if (!relay_client_send_packet2(in, &p)) {
+			return NULL;
+		}
+	}
+	return in;
+}
+
+static int run(enum relay_pipe_overflow overflow, relay_pipe_tap *t)
+{
+	int pin[2];
+	int pout[2];
+	if (pipe(pin) || pipe(pout)) {
+		fprintf(stderr, "Failed to create pipes\n");
+		return 1;
+	}
+	struct relay_pipe_pipeline config = { .depth = 64, .overflow = overflow };
+	struct relay_client in;
+	struct relay_client out;
+	struct relay_pipe mid;
+	if (!relay_client_init_fd(&in, NULL, pin[1], true, false) ||
+			!relay_client_init_fd(&out, NULL, pout[0], true, false) ||
+			!relay_pipe_init_pipeline(&mid, pin[0], pout[1], true, t, NULL, &config)) {
+		fprintf(stderr, "Failed to create relay interfaces\n");
+		return 2;
+	}
+	/* Lossless: read as we go.  Lossy: stall the consumer until everything is sent */
+	bool lossy = overflow != rpo_block;
+	pthread_t sender;
+	void *sent;
+	if (pthread_create(&sender, NULL, send_all, &in)) {
+		fprintf(stderr, "Failed to start sender\n");
+		return 3;
+	}
+	if (lossy && (pthread_join(sender, &sent) || !sent)) {
+		fprintf(stderr, "Failed to send\n");
+		return 3;
+	}
+	unsigned received = 0;
+	long last = -1;
+	while (true) {
+		if (!lossy && last == PACKETS - 2) {
+			break;
+		}
+		if (lossy) {
+			struct pollfd pfd = { .fd = pout[0], .events = POLLIN };
+			if (poll(&pfd, 1, 500) == 0) {
+				break;
+			}
+		}
+		struct relay_packet *p;
+		if (!relay_client_recv_packet(&out, &p) || p == NULL) {
+			fprintf(stderr, "Failed to receive\n");
+			return 4;
+		}
+		unsigned seq;
+		memcpy(&seq, p->data, sizeof(seq));
+		free(p);
+		if ((long) seq <= last || (!lossy && (long) seq != (last < 0 ? 0 : last + 2))) {
+			fprintf(stderr, "Out of sequence: %u after %ld\n", seq, last);
+			return 5;
+		}
+		last = seq;
+		received++;
+	}
+	if (!lossy && (pthread_join(sender, &sent) || !sent)) {
+		fprintf(stderr, "Failed to send\n");
+		return 3;
+	}
+	uint64_t dropped = 0;
+	for (size_t i = 0; i < mid.nqueues; i++) {
+		dropped += __atomic_load_n(&mid.queue[i].dropped, __ATOMIC_RELAXED);
+	}
+	relay_pipe_destroy(&mid);
+	relay_client_destroy(&in);
+	relay_client_destroy(&out);
+	if (!lossy ? dropped != 0 : received + dropped != PACKETS || dropped == 0) {
+		fprintf(stderr, "Received %u, dropped %lu\n", received, (unsigned long) dropped);
+		return 6;
+	}
+	/* Oldest-first dropping always keeps the most recent packet */
+	if (overflow == rpo_drop_oldest && last != PACKETS - 1) {
+		fprintf(stderr, "Wrong packets dropped (last received %ld)\n", last);
+		return 7;
+	}
+	fprintf(stderr, "Policy %d: %u packets received, %lu dropped\n", overflow, received, (unsigned long) dropped);
+	return 0;
+}
+
+int main()
+{
+	int ret = run(rpo_block, tap);
+	if (ret == 0) {
+		ret = run(rpo_drop_oldest, NULL);
+	}
+	if (ret == 0) {
+		ret = run(rpo_drop_newest, NULL);
+	}
+	if (ret == 0) {
+		fprintf(stderr, "Test completed\n");
+	}
+	return ret;
+}
+
+#endif
@@ -0,0 +1,85 @@
+#if defined BENCH_relay_sendv
+
+/*
+ * Compares the old copying send path (serialise header and payload into one
+ * buffer, then write it) against the vectored path used by send_packet2.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "bench.h"
+
+typedef bool send_func(struct relay_client *client, const struct relay_packet *packet);
+
+static bool send_copy(struct relay_client *client, const struct relay_packet *packet)
+{
+	size_t size;
+	struct relay_packet_serial *s = relay_serialise_packet(NULL, packet, &size);
+	bool res = relay_client_send_packet3(client, s, size);
+	free(s);
+	return res;
+}
+
+static bool send_vectored(struct relay_client *client, const struct relay_packet *packet)
+{
+	return relay_client_send_packet2(client, packet);
+}
+
+/* Returns throughput in MB/s, or negative on failure */
+static double run(send_func *send, char *payload, size_t length, size_t count)
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		return -1;
+	}
+	struct bench_sink sink;
+	if (!bench_sink_start(&sink, sv[1])) {
+		return -1;
+	}
+	struct relay_client client;
+	if (!relay_client_init_fd(&client, NULL, sv[0], true, false)) {
+		return -1;
+	}
+	struct relay_packet packet;
+	relay_make_packet(&packet, "BNCH", "sink", "bench", payload, length);
+	double start = bench_now();
+	for (size_t i = 0; i < count; i++) {
+		if (!send(&client, &packet)) {
+			return -1;
+		}
+	}
+	relay_client_destroy(&client);
+	size_t bytes = bench_sink_join(&sink);
+	double elapsed = bench_now() - start;
+	if (bytes != count * relay_serialised_packet_size(length)) {
+		return -1;
+	}
+	return bytes / elapsed / 1e6;
+}
+
+int main()
+{
+	static const size_t sizes[] = { 1 << 10, 64 << 10, 16 << 20 };
+	static const size_t total = 1 << 30;
+	char *payload = malloc(sizes[2]);
+	memset(payload, 0x5a, sizes[2]);
+	printf("%10s %14s %14s %8s\n", "payload", "copy MB/s", "vectored MB/s", "ratio");
+	for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		size_t count = total / sizes[i];
+		double copy = run(send_copy, payload, sizes[i], count);
+		double vectored = run(send_vectored, payload, sizes[i], count);
+		if (copy < 0 || vectored < 0) {
+			fprintf(stderr, "Benchmark failed at %zu bytes\n", sizes[i]);
+			return 1;
+		}
+		printf("%10zu %14.1f %14.1f %8.2f\n", sizes[i], copy, vectored, vectored / copy);
+	}
+	free(payload);
+	return 0;
+}
+
+#endif
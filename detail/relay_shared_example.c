@@ -0,0 +1,140 @@
+#if defined DEMO_relay_shared
+
+/*
+ * Several threads send through one shared client to an echo endpoint, and
+ * the echoes are dispatched back by the receive thread.  The queue is
+ * limited, so the producers are held back to the pace of the connection.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "../relay_shared.h"
+
+#define THREADS 8
+#define PACKETS 20000
+#define QUEUE_LIMIT 1024
+
+struct message {
+	unsigned thread;
+	unsigned seq;
+};
+
+static struct relay_shared shared;
+
+/* Next expected sequence number from each thread */
+static unsigned expect[THREADS];
+static unsigned errors;
+static unsigned received;
+
+static void dispatch(struct relay_packet *packet, void *misc)
+{
+	(void) misc;
+	struct message m;
+	memcpy(&m, packet->data, sizeof(m));
+	free(packet);
+	/* Per-thread order is kept through the queue */
+	if (m.thread >= THREADS || m.seq != expect[m.thread]++) {
+		errors++;
+	}
+	__atomic_fetch_add(&received, 1, __ATOMIC_RELEASE);
+}
+
+static void *producer(void *arg)
+{
+	struct message m = { .thread = (size_t) arg };
+	char remote[16];
+	snprintf(remote, sizeof(remote), "thread-%u", m.thread);
+	for (m.seq = 0; m.seq < PACKETS; m.seq++) {
+		if (!relay_shared_send(&shared, "TEST", remote, &m, sizeof(m))) {
+			return NULL;
+		}
+	}
+	return arg;
+}
+
+static void *echo(void *arg)
+{
+	struct relay_client *client = arg;
+	struct relay_packet *p;
+	while (relay_client_recv_packet(client, &p) && p) {
+		bool ok = relay_client_send_packet2(client, p);
+		free(p);
+		if (!ok) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+int main()
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		fprintf(stderr, "Failed to create socketpair\n");
+		return 1;
+	}
+	struct relay_client client;
+	struct relay_client peer;
+	pthread_t echoer;
+	if (!relay_client_init_fd(&client, "shared", sv[0], true, false) ||
+			!relay_client_init_fd(&peer, NULL, sv[1], true, false) ||
+			!relay_shared_init(&shared, &client, dispatch, NULL) ||
+			pthread_create(&echoer, NULL, echo, &peer)) {
+		fprintf(stderr, "Failed to create relay interfaces\n");
+		return 2;
+	}
+	relay_shared_set_limit(&shared, QUEUE_LIMIT, rsfp_block);
+	pthread_t threads[THREADS];
+	for (size_t i = 0; i < THREADS; i++) {
+		if (pthread_create(&threads[i], NULL, producer, (void *) i)) {
+			fprintf(stderr, "Failed to start producer\n");
+			return 3;
+		}
+	}
+	for (size_t i = 0; i < THREADS; i++) {
+		void *res;
+		pthread_join(threads[i], &res);
+		if (res != (void *) i) {
+			fprintf(stderr, "Producer %zu failed to send\n", i);
+			return 4;
+		}
+	}
+	while (__atomic_load_n(&received, __ATOMIC_ACQUIRE) < THREADS * PACKETS && !shared.failed) {
+		usleep(1000);
+	}
+	struct relay_shared_stats stats;
+	relay_shared_get_stats(&shared, &stats);
+	relay_shared_destroy(&shared);
+	/* The client is still ours, and blocking again */
+	if (fcntl(sv[0], F_GETFL) & O_NONBLOCK) {
+		fprintf(stderr, "Client fd left non-blocking\n");
+		return 6;
+	}
+	shutdown(sv[0], SHUT_RDWR);
+	pthread_join(echoer, NULL);
+	relay_client_destroy(&client);
+	relay_client_destroy(&peer);
+	if (errors || stats.written != THREADS * PACKETS || stats.received != THREADS * PACKETS) {
+		fprintf(stderr, "Wrong packets received (%u out of order, %lu written, %lu received)\n",
+			errors, (unsigned long) stats.written, (unsigned long) stats.received);
+		return 5;
+	}
+	/* Each producer may overshoot by one */
+	if (stats.max_depth > QUEUE_LIMIT + THREADS) {
+		fprintf(stderr, "Queue grew to %lu past its limit\n", (unsigned long) stats.max_depth);
+		return 7;
+	}
+	fprintf(stderr, "Test completed (max depth %lu, %lu sends held, mean latency %.1f us, max %.1f us)\n",
+		(unsigned long) stats.max_depth, (unsigned long) stats.full,
+		stats.latency_total_ns / 1e3 / stats.written,
+		stats.latency_max_ns / 1e3);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,176 @@
+#if defined DEMO_relay_shm
+
+/*
+ * Echoes packets between two processes over a shared-memory channel, with
+ * some packets larger than the rings so that both sides have to sleep.  Then
+ * streams packets with the non-blocking functions from one poll() loop.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "../relay_shm.h"
+
+#define PACKETS 10000
+#define RING_SIZE (64 << 10)
+#define STREAM_PACKETS 2000
+
+static size_t packet_size(int i)
+{
+	return i % 1000 == 0 ? 1 << 20 : i % 251;
+}
+
+static int echo(const struct relay_shm_channel *channel)
+{
+	struct relay_client client;
+	if (!relay_client_init_shm(&client, NULL, channel, 1)) {
+		return 1;
+	}
+	struct relay_packet *p;
+	while (relay_client_recv_packet(&client, &p) && p) {
+		/* Streamed packets are consumed slowly, so the sender has to wait for space */
+		if (strcmp(p->type, "STRM") == 0) {
+			usleep(50);
+		}
+		bool ok = relay_client_send_packet2(&client, p);
+		free(p);
+		if (!ok) {
+			return 1;
+		}
+	}
+	relay_client_destroy(&client);
+	return 0;
+}
+
+/* Keeps the rings full in both directions, waiting on the channel's eventfds */
+static int stream(struct relay_client *client, char *payload)
+{
+	int sent = 0;
+	int received = 0;
+	int waits = 0;
+	while (received < STREAM_PACKETS) {
+		while (sent < STREAM_PACKETS) {
+			struct relay_packet p;
+			relay_make_packet(&p, "STRM", "Potato", NULL, payload, packet_size(sent));
+			enum rca_recv_result res = relay_client_try_send(client, &p);
+			if (res == rcarr_again) {
+				break;
+			} else if (res != rcarr_success) {
+				fprintf(stderr, "Failed to send\n");
+				return 7;
+			}
+			sent++;
+		}
+		if (relay_client_try_flush(client) == rcarr_fail) {
+			fprintf(stderr, "Failed to flush\n");
+			return 7;
+		}
+		while (true) {
+			struct relay_packet *p;
+			enum rca_recv_result res = relay_client_try_recv(client, &p);
+			if (res == rcarr_again) {
+				break;
+			} else if (res != rcarr_success) {
+				fprintf(stderr, "Failed to receive\n");
+				return 8;
+			}
+			if (p->length != packet_size(received)) {
+				fprintf(stderr, "Wrong length received for packet %d: %zu\n", received, p->length);
+				return 9;
+			}
+			free(p);
+			received++;
+		}
+		if (received == STREAM_PACKETS) {
+			break;
+		}
+		short events;
+		int send_fd = relay_client_get_send_fd(client, &events);
+		struct pollfd pfd[2] = {
+			{ .fd = relay_client_get_fd(client), .events = POLLIN },
+			{ .fd = send_fd, .events = relay_client_poll_events(client) & POLLOUT ? events : 0 }
+		};
+		if (poll(pfd, 2, -1) == -1) {
+			fprintf(stderr, "Failed to poll\n");
+			return 10;
+		}
+		waits++;
+	}
+	/* Each wait should follow a wakeup from the peer, not spin on a ready fd */
+	if (waits > 4 * STREAM_PACKETS) {
+		fprintf(stderr, "Too many waits (%d) for %d packets\n", waits, STREAM_PACKETS);
+		return 11;
+	}
+	fprintf(stderr, "Streamed %d packets with %d waits\n", received, waits);
+	return 0;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main()
+{
+	struct relay_shm_channel channel;
+	if (!relay_shm_channel_create(&channel, RING_SIZE)) {
+		fprintf(stderr, "Failed to create channel\n");
+		return 1;
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		return echo(&channel);
+	}
+	struct relay_client client;
+	if (!relay_client_init_shm(&client, NULL, &channel, 0)) {
+		fprintf(stderr, "Failed to create relay interface\n");
+		return 2;
+	}
+	relay_shm_channel_close(&channel);
+	char *payload = malloc(1 << 20);
+	double t0 = now();
+	for (int i = 0; i < PACKETS; i++) {
+		size_t length = packet_size(i);
+		memset(payload, i, length);
+		struct relay_packet p;
+		relay_make_packet(&p, "TEST", "Potato", NULL, payload, length);
+		if (!relay_client_send_packet2(&client, &p)) {
+			fprintf(stderr, "Failed to send\n");
+			return 3;
+		}
+		struct relay_packet *r;
+		if (!relay_client_recv_packet(&client, &r) || !r) {
+			fprintf(stderr, "Failed to receive\n");
+			return 4;
+		}
+		if (r->length != length || memcmp(r->data, payload, length) != 0) {
+			fprintf(stderr, "Wrong data received for packet %d\n", i);
+			return 5;
+		}
+		free(r);
+	}
+	double elapsed = now() - t0;
+	memset(payload, 'x', 1 << 20);
+	int res = stream(&client, payload);
+	if (res) {
+		return res;
+	}
+	free(payload);
+	relay_client_destroy(&client);
+	int status;
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "Echo process failed\n");
+		return 6;
+	}
+	fprintf(stderr, "Test completed (%d round trips, %.2f us each)\n", PACKETS, elapsed / PACKETS * 1e6);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,197 @@
+#if defined DEMO_relay_stripe
+
+/*
+ * Striped client, for each policy: every packet comes back exactly once
+ * through the merged receive, and with pinning each remote's packets come
+ * back in order.
+ *
+ * With no arguments the stripes are socketpairs to echo threads which, like
+ * the server, deliver each echo to every stripe.  Given <addr> <port>, the
+ * stripes connect to the server and an echo client there.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "../relay_stripe.h"
+
+#define STRIPES 4
+#define REMOTES 8
+#define PACKETS 20000
+#define ECHO_NAME "stripe_echo"
+
+static const char *addr;
+static const char *port;
+
+/* Server side of each stripe, an echo goes to all of them as the server would */
+static struct relay_client peers[STRIPES];
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *echo(void *arg)
+{
+	struct relay_client *client = arg;
+	struct relay_packet *p;
+	bool ok = true;
+	while (ok && relay_client_recv_packet(client, &p) && p) {
+		pthread_mutex_lock(&peers_lock);
+		for (size_t i = 0; ok && i < STRIPES; i++) {
+			ok = relay_client_send_packet2(&peers[i], p);
+		}
+		pthread_mutex_unlock(&peers_lock);
+		free(p);
+	}
+	return NULL;
+}
+
+/* Echo client on the server, replying to whoever sent */
+static void *echo_server(void *arg)
+{
+	struct relay_client *client = arg;
+	struct relay_packet *p;
+	while (relay_client_recv_packet(client, &p) && p) {
+		bool ok = relay_client_send_packet(client, p->type, p->remote, p->data, p->length);
+		free(p);
+		if (!ok) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static struct relay_stripe stripe;
+
+static void *sender(void *arg)
+{
+	(void) arg;
+	char payload[1024] = { 0 };
+	for (unsigned seq = 0; seq < PACKETS; seq++) {
+		char remote[16];
+		snprintf(remote, sizeof(remote), addr ? ECHO_NAME : "remote-%u", seq % REMOTES);
+		memcpy(payload, &seq, sizeof(seq));
+		/* Mix of small and large packets */
+		if (!relay_stripe_send_packet(&stripe, "TEST", remote, payload, seq % 10 ? 16 : sizeof(payload))) {
+			return NULL;
+		}
+	}
+	return &stripe;
+}
+
+static int run(enum relay_stripe_policy policy)
+{
+	pthread_t echoers[STRIPES];
+	size_t nechoers = 0;
+	struct relay_client echo_client;
+	if (addr) {
+		if (!relay_client_init_socket(&echo_client, ECHO_NAME, addr, port) ||
+				pthread_create(&echoers[nechoers++], NULL, echo_server, &echo_client) ||
+				!relay_stripe_init_socket(&stripe, STRIPES, policy, "striped", addr, port)) {
+			fprintf(stderr, "Failed to connect to %s:%s\n", addr, port);
+			return 1;
+		}
+		/* Sessions are not open to packets straight after authenticating */
+		sleep(1);
+	} else {
+		struct relay_client *clients = calloc(STRIPES, sizeof(*clients));
+		for (size_t i = 0; i < STRIPES; i++) {
+			int sv[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) ||
+					!relay_client_init_fd(&clients[i], "striped", sv[0], true, false) ||
+					!relay_client_init_fd(&peers[i], NULL, sv[1], true, false)) {
+				fprintf(stderr, "Failed to create relay interfaces\n");
+				return 1;
+			}
+		}
+		for (size_t i = 0; i < STRIPES; i++) {
+			if (pthread_create(&echoers[nechoers++], NULL, echo, &peers[i])) {
+				return 1;
+			}
+		}
+		if (!relay_stripe_init(&stripe, STRIPES, policy, clients)) {
+			fprintf(stderr, "Failed to create striped client\n");
+			return 2;
+		}
+	}
+	/* Send from another thread, the echoes would otherwise fill the sockets */
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, sender, NULL)) {
+		return 3;
+	}
+	long last[REMOTES];
+	for (size_t i = 0; i < REMOTES; i++) {
+		last[i] = -1;
+	}
+	bool *seen = calloc(PACKETS, sizeof(*seen));
+	for (unsigned received = 0; received < PACKETS; received++) {
+		struct relay_packet *p;
+		if (!relay_stripe_recv_packet(&stripe, &p) || !p) {
+			fprintf(stderr, "Failed to receive\n");
+			return 4;
+		}
+		unsigned seq;
+		memcpy(&seq, p->data, sizeof(seq));
+		free(p);
+		if (seq >= PACKETS || seen[seq]) {
+			fprintf(stderr, "Duplicate packet %u\n", seq);
+			return 5;
+		}
+		seen[seq] = true;
+		if (policy == rsp_pinned && (long) seq <= last[seq % REMOTES]) {
+			fprintf(stderr, "Out of order: %u after %ld\n", seq, last[seq % REMOTES]);
+			return 5;
+		}
+		last[seq % REMOTES] = seq;
+	}
+	free(seen);
+	void *res;
+	pthread_join(thread, &res);
+	if (!res) {
+		fprintf(stderr, "Failed to send\n");
+		return 6;
+	}
+	/* Every copy has arrived by now, none may come through */
+	usleep(200000);
+	struct relay_packet *extra;
+	if (relay_stripe_try_recv(&stripe, &extra) != rcarr_again) {
+		fprintf(stderr, "Received more than was sent\n");
+		return 7;
+	}
+	/* Closing our ends makes the echo threads exit */
+	relay_stripe_destroy(&stripe);
+	if (addr) {
+		shutdown(relay_client_get_fd(&echo_client), SHUT_RDWR);
+	}
+	for (size_t i = 0; i < nechoers; i++) {
+		pthread_join(echoers[i], NULL);
+	}
+	if (addr) {
+		relay_client_destroy(&echo_client);
+	} else {
+		for (size_t i = 0; i < STRIPES; i++) {
+			relay_client_destroy(&peers[i]);
+		}
+	}
+	fprintf(stderr, "Policy %d: %d packets\n", policy, PACKETS);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 3) {
+		addr = argv[1];
+		port = argv[2];
+	}
+	int ret = 0;
+	for (int policy = rsp_round_robin; ret == 0 && policy <= rsp_pinned; policy++) {
+		ret = run(policy);
+	}
+	if (ret == 0) {
+		fprintf(stderr, "Test completed\n");
+	}
+	return ret;
+}
+
+#endif
@@ -0,0 +1,149 @@
+#if defined BENCH_relay_uring
+
+/*
+ * Compares the io_uring adapter against the fd adapter: one-way throughput
+ * into a buffered receiver, and ping-pong round-trip latency.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "../relay_packet.h"
+#include "../relay_client.h"
+#include "../relay_uring.h"
+#include "bench.h"
+
+#define RX_BUFFER (256 << 10)
+#define ROUND_TRIPS 20000
+
+typedef bool init_func(struct relay_client *self, const char *local, int fd, bool owns, bool auth_needed);
+
+struct receiver {
+	struct relay_client client;
+	size_t packets;
+	bool echo;
+	pthread_t thread;
+};
+
+static void *receiver_thread(void *arg)
+{
+	struct receiver *self = arg;
+	struct relay_packet *p;
+	while (relay_client_recv_packet(&self->client, &p) && p) {
+		self->packets++;
+		if (self->echo && !relay_client_send_packet2(&self->client, p)) {
+			free(p);
+			break;
+		}
+		free(p);
+	}
+	return NULL;
+}
+
+static bool receiver_start(struct receiver *self, init_func *init, int fd, bool echo)
+{
+	memset(self, 0, sizeof(*self));
+	self->echo = echo;
+	return init(&self->client, NULL, fd, true, false) &&
+		relay_client_set_recv_buffer(&self->client, RX_BUFFER) &&
+		pthread_create(&self->thread, NULL, receiver_thread, self) == 0;
+}
+
+static size_t receiver_join(struct receiver *self)
+{
+	pthread_join(self->thread, NULL);
+	relay_client_destroy(&self->client);
+	return self->packets;
+}
+
+/* Returns MB/s, or negative on failure */
+static double throughput(init_func *init, size_t length)
+{
+	static char payload[64 << 10];
+	size_t count = (256 << 20) / (length + sizeof(struct relay_packet_serial_hdr));
+	int sv[2];
+	struct receiver rx;
+	struct relay_client tx;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) ||
+			!receiver_start(&rx, init, sv[1], false) ||
+			!init(&tx, NULL, sv[0], true, false)) {
+		return -1;
+	}
+	double start = bench_now();
+	for (size_t i = 0; i < count; i++) {
+		if (!relay_client_send_packet(&tx, "BNCH", "sink", payload, length)) {
+			return -1;
+		}
+	}
+	relay_client_destroy(&tx);
+	if (receiver_join(&rx) != count) {
+		return -1;
+	}
+	return count * relay_serialised_packet_size(length) / (bench_now() - start) / 1e6;
+}
+
+/* Ping-pong round trip, returns false on failure */
+static bool latency(init_func *init, double *p50, double *p99)
+{
+	static double samples[ROUND_TRIPS];
+	int sv[2];
+	struct receiver echo;
+	struct relay_client client;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) ||
+			!receiver_start(&echo, init, sv[1], true) ||
+			!init(&client, NULL, sv[0], true, false)) {
+		return false;
+	}
+	for (size_t i = 0; i < ROUND_TRIPS; i++) {
+		struct relay_packet *p;
+		double start = bench_now();
+		if (!relay_client_send_text(&client, "PING", "echo", "ping") ||
+				!relay_client_recv_packet(&client, &p) || !p) {
+			return false;
+		}
+		samples[i] = (bench_now() - start) * 1e6;
+		free(p);
+	}
+	relay_client_destroy(&client);
+	receiver_join(&echo);
+	*p50 = bench_percentile(samples, ROUND_TRIPS, 50);
+	*p99 = bench_percentile(samples, ROUND_TRIPS, 99);
+	return true;
+}
+
+int main()
+{
+	static const size_t sizes[] = { 64, 4 << 10, 64 << 10 };
+	static const struct {
+		const char *name;
+		init_func *init;
+	} adapters[] = {
+		{ "fd", relay_client_init_fd },
+		{ "uring", relay_client_init_uring }
+	};
+	printf("%-8s %10s %12s\n", "adapter", "payload", "MB/s");
+	for (size_t a = 0; a < sizeof(adapters)/sizeof(adapters[0]); a++) {
+		for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+			double mbps = throughput(adapters[a].init, sizes[i]);
+			if (mbps < 0) {
+				fprintf(stderr, "Throughput benchmark failed for %s adapter\n", adapters[a].name);
+				return 1;
+			}
+			printf("%-8s %10zu %12.1f\n", adapters[a].name, sizes[i], mbps);
+		}
+	}
+	printf("\n%-8s %12s %12s\n", "adapter", "rtt p50 us", "rtt p99 us");
+	for (size_t a = 0; a < sizeof(adapters)/sizeof(adapters[0]); a++) {
+		double p50;
+		double p99;
+		if (!latency(adapters[a].init, &p50, &p99)) {
+			fprintf(stderr, "Latency benchmark failed for %s adapter\n", adapters[a].name);
+			return 1;
+		}
+		printf("%-8s %12.2f %12.2f\n", adapters[a].name, p50, p99);
+	}
+	return 0;
+}
+
+#endif
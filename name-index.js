@@ -0,0 +1,166 @@
+const wildcard_to_regexp = require('./wildcard_to_regexp');
+
+/*
+ * Index of registered names for wildcard lookups.  Names are kept sorted, and
+ * also sorted by their reversed spelling, so that the literal prefix or suffix
+ * of a pattern (e.g. "red:" in "red:*") selects a range of candidates by binary
+ * search instead of the pattern being tested against every name.  Patterns with
+ * neither (e.g. "*w*") still scan every name.
+ */
+
+/* Compiled patterns kept, least recently used are discarded first */
+const PATTERN_CACHE_SIZE = 256;
+
+const wildcard_rx = /[*?]/;
+
+const reverse = str => str.split('').reverse().join('');
+
+/* Index of first element not less than key */
+const lower_bound = (list, key) => {
+	let lo = 0;
+	let hi = list.length;
+	while (lo < hi) {
+		const mid = (lo + hi) >>> 1;
+		if (list[mid] < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+};
+
+const insert_sorted = (list, key) => {
+	const i = lower_bound(list, key);
+	if (list[i] !== key) {
+		list.splice(i, 0, key);
+	}
+};
+
+const remove_sorted = (list, key) => {
+	const i = lower_bound(list, key);
+	if (list[i] === key) {
+		list.splice(i, 1);
+	}
+};
+
+/* Call fn for each element of the sorted list which starts with prefix */
+const each_prefixed = (list, prefix, fn) => {
+	for (let i = lower_bound(list, prefix); i < list.length && list[i].startsWith(prefix); i++) {
+		fn(list[i]);
+	}
+};
+
+const compile = pattern => {
+	const first = pattern.search(wildcard_rx);
+	if (first === -1) {
+		return { prefix: pattern, rsuffix: '', test: name => name === pattern };
+	}
+	const last = Math.max(pattern.lastIndexOf('*'), pattern.lastIndexOf('?'));
+	const prefix = pattern.slice(0, first);
+	const suffix = pattern.slice(last + 1);
+	const rx = wildcard_to_regexp(pattern);
+	/* A literal prefix then one "*": every name in the prefix range matches */
+	const prefix_only = first === last && pattern[last] === '*' && suffix === '';
+	return {
+		prefix,
+		rsuffix: reverse(suffix),
+		test: prefix_only ? () => true : name => rx.test(name)
+	};
+};
+
+module.exports = NameIndex;
+
+function NameIndex() {
+	const names = [];
+	const reversed = [];
+	const cache = new Map();
+
+	const get_compiled = pattern => {
+		let compiled = cache.get(pattern);
+		if (compiled) {
+			cache.delete(pattern);
+		} else {
+			compiled = compile(pattern);
+			if (cache.size >= PATTERN_CACHE_SIZE) {
+				cache.delete(cache.keys().next().value);
+			}
+		}
+		cache.set(pattern, compiled);
+		return compiled;
+	};
+
+	/* Call fn for each name matching the wildcard pattern */
+	const each_match = (pattern, fn) => {
+		const { prefix, rsuffix, test } = get_compiled(pattern);
+		if (prefix.length >= rsuffix.length) {
+			each_prefixed(names, prefix, name => test(name) && fn(name));
+		} else {
+			each_prefixed(reversed, rsuffix, rname => {
+				const name = reverse(rname);
+				return test(name) && fn(name);
+			});
+		}
+	};
+
+	this.add = name => {
+		insert_sorted(names, name);
+		insert_sorted(reversed, reverse(name));
+	};
+	this.delete = name => {
+		remove_sorted(names, name);
+		remove_sorted(reversed, reverse(name));
+	};
+	this.clear = () => {
+		names.length = 0;
+		reversed.length = 0;
+	};
+	this.each_match = each_match;
+	this.size = () => names.length;
+}
+
+if (!module.parent) {
+	/* Compare against testing every name, and time both */
+	const colours = ['red', 'green', 'blue', 'yellow', 'white'];
+	const index = new NameIndex();
+	const all = [];
+	for (const colour of colours) {
+		for (let i = 0; i < 2000; i++) {
+			const name = `${colour}:${i.toString(36)}`;
+			all.push(name);
+			index.add(name);
+		}
+	}
+	index.add('red');
+	all.push('red');
+	index.delete('blue:0');
+	all.splice(all.indexOf('blue:0'), 1);
+	const patterns = ['red:*', '*:one', '*w*', '?e??o*', 'blue:?', 'blue:1?', '*:1*z', 'r*', '*', 'red', 'nobody:*', 're*d'];
+	let failed = false;
+	for (const pattern of patterns) {
+		const rx = wildcard_to_regexp(pattern);
+		const expect = all.filter(name => rx.test(name)).sort();
+		const actual = [];
+		const match = () => {
+			actual.length = 0;
+			index.each_match(pattern, name => actual.push(name));
+		};
+		const reps = 200;
+		let t = process.hrtime.bigint();
+		for (let i = 0; i < reps; i++) {
+			const scan_rx = wildcard_to_regexp(pattern);
+			all.filter(name => scan_rx.test(name));
+		}
+		const t_scan = Number(process.hrtime.bigint() - t) / reps / 1000;
+		t = process.hrtime.bigint();
+		for (let i = 0; i < reps; i++) {
+			match();
+		}
+		const t_index = Number(process.hrtime.bigint() - t) / reps / 1000;
+		actual.sort();
+		const ok = JSON.stringify(actual) === JSON.stringify(expect);
+		failed = failed || !ok;
+		console.log(`${ok ? 'ok  ' : 'FAIL'} ${pattern.padEnd(10)} ${String(actual.length).padStart(5)} matches, scan ${t_scan.toFixed(1)} us, index ${t_index.toFixed(1)} us`);
+	}
+	process.exitCode = failed ? 1 : 0;
+}
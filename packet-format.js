@@ -1,5 +1,4 @@
 const Component = require('component');
-const ByteStream = require('byte-stream');
 
 const TYPE_LEN = 4;
 const ENDPOINT_NAME_LEN = 16;
@@ -17,13 +16,16 @@ const DATA_OFFSET = LENGTH_OFFSET + LENGTH_LEN;
 /* Bit 30 instead of 31, since bitwise arithmetic in Java* languages is shite */
 const FOREIGN_BIT = 1<<30;
 
+/* Reserved type of fragments of large messages (see PROTOCOL.md) */
+const FRAGMENT_TYPE = 'FRAG';
+
 /* Read null-terminated ASCII string from buffer */
-const read_str = buf => {
-	let len = buf.indexOf(0);
-	if (len === -1) {
-		len = buf.length;
+const read_str = (buf, offset, length) => {
+	let end = buf.indexOf(0, offset);
+	if (end === -1 || end > offset + length) {
+		end = offset + length;
 	}
-	return buf.slice(0, len).toString('ascii');
+	return buf.toString('ascii', offset, end);
 };
 
 const write_str = (buf, str, offset, length) =>
@@ -31,116 +33,217 @@ const write_str = (buf, str, offset, length) =>
 
 module.exports.Reader = Reader;
 module.exports.Writer = Writer;
+module.exports.FRAGMENT_TYPE = FRAGMENT_TYPE;
+module.exports.HEADER_LENGTH = DATA_OFFSET;
+
+/*
+ * Received packet: data is a view of the received bytes, and the name fields
+ * are only decoded from the header if they are used (or replaced if assigned)
+ */
+function Packet(buf, offset, length, foreign) {
+	this.$header = buf;
+	this.$offset = offset;
+	this.$type = undefined;
+	this.$remote = undefined;
+	this.$local = undefined;
+	this.length = length;
+	this.foreign = foreign;
+	this.data = buf.subarray(offset + DATA_OFFSET, offset + DATA_OFFSET + length);
+}
+
+const header_field = (key, offset, length) => ({
+	get() {
+		if (this[key] === undefined) {
+			this[key] = read_str(this.$header, this.$offset + offset, length);
+		}
+		return this[key];
+	},
+	set(value) {
+		this[key] = value;
+	},
+	enumerable: true
+});
+
+Object.defineProperties(Packet.prototype, {
+	type: header_field('$type', TYPE_OFFSET, TYPE_LEN),
+	remote: header_field('$remote', TARGET_OFFSET, TARGET_LEN),
+	local: header_field('$local', ORIGIN_OFFSET, ORIGIN_LEN)
+});
 
-/* Basically an asynchronous fold over the input stream */
+/*
+ * Parses every complete packet in each chunk in one pass.  Only packets which
+ * span chunks are copied, once, when their last byte arrives.
+ */
 Reader.prototype = new Component();
 function Reader() {
 	Component.call(this, 'Packet reader', true);
 
-	const stream = new ByteStream();
+	/* Received parts of a packet which spans chunks */
+	const parts = [];
+	let parts_length = 0;
+	/* Bytes needed to complete the header, or the packet once its header is in */
+	let needed = DATA_OFFSET;
+	let failed = false;
 
-	const newPacket = () => ({
-		type: null,
-		remote: null,
-		local: null,
-		length: null,
-		data: null,
-		foreign: false
-	});
+	/* Returns packet length, or -1 if invalid */
+	const read_length = (buf, offset) => {
+		const lenfield = buf.readUInt32BE(offset + LENGTH_OFFSET);
+		return lenfield > 0x7fffffff ? -1 : lenfield & ~FOREIGN_BIT;
+	};
 
-	let packet = newPacket();
+	const fail = () => {
+		this.warn({ msg: 'Negative packet length' });
+		failed = true;
+		parts.length = 0;
+		parts_length = 0;
+	};
 
-	/* TODO: Make ByteStream a Component and clear its buffer on close */
+	const emit_packet = (buf, offset, length) => {
+		const foreign = (buf.readUInt32BE(offset + LENGTH_OFFSET) & FOREIGN_BIT) !== 0;
+		this.emit('data', new Packet(buf, offset, length, foreign));
+	};
 
-	const readPacket = () => {
-		if (packet.type === null) {
-			const buf = stream.read(TYPE_LEN);
-			if (!buf) {
-				return false;
+	/* Append to a packet which spans chunks, returns offset of first unused byte */
+	const continue_packet = (buf, offset) => {
+		while (offset < buf.length) {
+			const take = Math.min(needed - parts_length, buf.length - offset);
+			parts.push(buf.subarray(offset, offset + take));
+			parts_length += take;
+			offset += take;
+			if (parts_length < needed) {
+				break;
 			}
-			packet.type = read_str(buf);
-		}
-		if (packet.remote === null) {
-			const buf = stream.read(TARGET_LEN);
-			if (!buf) {
-				return false;
+			const packet = parts.length === 1 ? parts[0] : Buffer.concat(parts, parts_length);
+			parts.length = 0;
+			parts.push(packet);
+			if (needed === DATA_OFFSET) {
+				const length = read_length(packet, 0);
+				if (length < 0) {
+					fail();
+					return buf.length;
+				}
+				needed = DATA_OFFSET + length;
 			}
-			packet.remote = read_str(buf);
-		}
-		if (packet.local === null) {
-			const buf = stream.read(ORIGIN_LEN);
-			if (!buf) {
-				return false;
+			if (parts_length === needed) {
+				parts.length = 0;
+				parts_length = 0;
+				needed = DATA_OFFSET;
+				emit_packet(packet, 0, packet.length - DATA_OFFSET);
+				break;
 			}
-			packet.local = read_str(buf);
 		}
-		if (packet.length === null) {
-			const buf = stream.read(LENGTH_LEN);
-			if (!buf) {
-				return false;
-			}
-			const length = buf.readUInt32BE(0);
-			packet.foreign = (length & FOREIGN_BIT) !== 0;
-			packet.length = length & ~FOREIGN_BIT;
-		}
-		if (packet.length < 0) {
-			this.warn({ msg: 'Negative packet length' });
-			return false;
-		}
-		const buf = packet.length ? stream.read(packet.length) : new Buffer([]);
-		if (!buf) {
-			return false;
-		}
-		packet.data = buf;
-		return true;
+		return offset;
 	};
 
-	const streamOnData = () => {
-		while (readPacket()) {
-			this.emit('data', packet);
-			packet = newPacket();
+	const write = buf => {
+		if (failed) {
+			return;
+		}
+		let offset = parts_length ? continue_packet(buf, 0) : 0;
+		while (!failed && !parts_length && buf.length - offset >= DATA_OFFSET) {
+			const length = read_length(buf, offset);
+			if (length < 0) {
+				return fail();
+			}
+			const end = offset + DATA_OFFSET + length;
+			if (end > buf.length) {
+				break;
+			}
+			emit_packet(buf, offset, length);
+			offset = end;
+		}
+		if (!failed && offset < buf.length) {
+			continue_packet(buf, offset);
 		}
 	};
 
-	stream.on('data', streamOnData);
-	this.write = buf => stream.write(buf);
+	this.$on(this, 'close', () => {
+		parts.length = 0;
+		parts_length = 0;
+	});
+	this.write = write;
 }
 
+/* Validate packet fields, returns them with data as a Buffer */
+const check_packet = packet => {
+	let { data } = packet;
+	if (typeof data !== 'string' && !(data instanceof Buffer)) {
+		throw new Error('Invalid packet data');
+	}
+	if (typeof data === 'string') {
+		data = Buffer.from(data);
+	}
+	const { type, remote, local, length = data.length, foreign = false } = packet;
+	if (data.length !== length) {
+		throw new Error(`Packet length mismatch: ${data.length} != ${length}`);
+	}
+	if (typeof type !== 'string' || type.length > TYPE_LEN) {
+		throw new Error(`Invalid packet type: ${JSON.stringify(type)}`);
+	}
+	if (typeof remote !== 'string' || remote.length > TARGET_LEN) {
+		throw new Error(`Invalid packet remote: ${JSON.stringify(remote)}`);
+	}
+	if (typeof local !== 'string' || local.length > ORIGIN_LEN) {
+		throw new Error(`Invalid packet local: ${JSON.stringify(local)}`);
+	}
+	if (typeof length !== 'number' || length < 0) {
+		throw new Error(`Invalid packet length: ${JSON.stringify(length)}`);
+	}
+	return { type, remote, local, length, foreign, data };
+};
+
+/* Write header fields into a zero-filled buffer */
+const write_header = (buf, { type, remote, local, length, foreign }) => {
+	write_str(buf, type, TYPE_OFFSET, TYPE_LEN);
+	write_str(buf, remote, TARGET_OFFSET, TARGET_LEN);
+	write_str(buf, local, ORIGIN_OFFSET, ORIGIN_LEN);
+	buf.writeInt32BE(length | (foreign ? FOREIGN_BIT : 0), LENGTH_OFFSET);
+};
+
+/*
+ * Encode a packet once for sending to several recipients: the payload is
+ * shared (not copied) by every copy re-addressed with readdress, which only
+ * gets its own header.  The payload must not be modified after this.
+ */
+const encode = packet => {
+	const fields = check_packet(packet);
+	const header = Buffer.alloc(DATA_OFFSET, 0);
+	write_header(header, fields);
+	return Object.freeze(Object.assign(fields, { header }));
+};
+
+/* Copy of an encoded packet with a different local (recipient) name */
+const readdress = (encoded, local) => {
+	if (typeof local !== 'string' || local.length > ORIGIN_LEN) {
+		throw new Error(`Invalid packet local: ${JSON.stringify(local)}`);
+	}
+	const header = Buffer.allocUnsafe(DATA_OFFSET);
+	encoded.header.copy(header);
+	header.fill(0, ORIGIN_OFFSET, ORIGIN_OFFSET + ORIGIN_LEN);
+	write_str(header, local, ORIGIN_OFFSET, ORIGIN_LEN);
+	return Object.freeze(Object.assign({}, encoded, { local, header }));
+};
+
+module.exports.encode = encode;
+module.exports.readdress = readdress;
+
+/*
+ * Emits ('data', buf) for plain packets, or ('data', header, payload) for
+ * encoded ones so that the shared payload is written without copying
+ */
 Writer.prototype = new Component();
 function Writer() {
 	Component.call(this, 'Packet writer', true);
 
 	const write = packet => {
-		let { data } = packet;
-		if (typeof data !== 'string' && !(data instanceof Buffer)) {
-			throw new Error('Invalid packet data');
-		}
-		if (typeof data === 'string') {
-			data = Buffer.from(data);
-		}
-		const { type, remote, local, length = data.length, foreign = false } = packet;
-		if (data.length !== length) {
-			throw new Error(`Packet length mismatch: ${data.length} != ${length}`);
-		}
-		if (typeof type !== 'string' || type.length > TYPE_LEN) {
-			throw new Error(`Invalid packet type: ${JSON.stringify(type)}`);
-		}
-		if (typeof remote !== 'string' || remote.length > TARGET_LEN) {
-			throw new Error(`Invalid packet remote: ${JSON.stringify(remote)}`);
-		}
-		if (typeof local !== 'string' || local.length > ORIGIN_LEN) {
-			throw new Error(`Invalid packet local: ${JSON.stringify(local)}`);
-		}
-		if (typeof length !== 'number' || length < 0) {
-			throw new Error(`Invalid packet length: ${JSON.stringify(length)}`);
+		if (packet.header instanceof Buffer) {
+			this.emit('data', packet.header, packet.data);
+			return;
 		}
-		const buf = Buffer.alloc(DATA_OFFSET + length, 0);
-		const lenfield = length | (foreign ? FOREIGN_BIT : 0);
-		write_str(buf, type, TYPE_OFFSET, TYPE_LEN);
-		write_str(buf, remote, TARGET_OFFSET, TARGET_LEN);
-		write_str(buf, local, ORIGIN_OFFSET, ORIGIN_LEN);
-		buf.writeInt32BE(lenfield, LENGTH_OFFSET);
-		data.copy(buf, DATA_OFFSET);
+		const fields = check_packet(packet);
+		const buf = Buffer.alloc(DATA_OFFSET + fields.length, 0);
+		write_header(buf, fields);
+		fields.data.copy(buf, DATA_OFFSET);
 		this.emit('data', buf);
 	};
 
@@ -155,15 +258,15 @@ if (!module.parent) {
 		const timeout = setTimeout(() => err('Timeout'), test_timeout);
 		reader.on('error', err);
 		writer.on('error', err);
-		writer.on('data', buf => reader.write(buf));
+		writer.on('data', (...bufs) => bufs.forEach(buf => reader.write(buf)));
 		reader.on('data', actual => {
 			console.log(JSON.stringify(expect));
-			actual.data = actual.data.toString();
-			console.log(JSON.stringify(actual));
+			const { type, remote, local, length, foreign } = actual;
+			console.log(JSON.stringify({ type, remote, local, length, data: actual.data.toString(), foreign }));
 			clearTimeout(timeout);
 			done();
 		});
-		writer.write(expect);
+		writer.write(expect.encoded ? readdress(encode(expect), expect.local) : expect);
 	});
 	const samples = [
 		{ type: 'halo', local: 'red', remote: 'blue', data: 'I have a message for you', foreign: true },
@@ -171,7 +274,9 @@ if (!module.parent) {
 		{ type: 'NR', local: 'me', remote: '', data: 'Data' },
 		{ type: 'NDR', local: 'me', remote: '', data: '' },
 		{ type: 'AUTH', local: 'me', remote: '', data: '', foreign: false },
-		{ type: 'AUTH', local: 'me', remote: '', data: '', foreign: true }
+		{ type: 'AUTH', local: 'me', remote: '', data: '', foreign: true },
+		{ type: 'enc', local: 'recipient', remote: 'sender', data: 'Encoded once', encoded: true },
+		{ type: 'ENC', local: 'r', remote: 's', data: Buffer.from('Shared payload'), foreign: true, encoded: true }
 	];
 	const next = () => {
 		if (samples.length) {
@@ -1,13 +1,113 @@
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include "relay_packet.h"
 #include "relay_client.h"
 #include "debug.h"
 
+#if !defined IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 /* Socket adapter uses fd adapter for IO */
 #define RCA_SOCKET_USE_FD
 
 size_t relay_client_mtu = 1L << 31;
 
-static bool relay_authenticate(struct relay_client *self)
+/* Statistics (every update is a no-op unless stats are enabled) */
+
+#define add_stat(stats, name, n) __atomic_fetch_add(&(stats)->name, (n), __ATOMIC_RELAXED)
+#define get_stat(stats, name) __atomic_load_n(&(stats)->name, __ATOMIC_RELAXED)
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static size_t histogram_bucket(uint64_t ns)
+{
+	const uint64_t sub = 1 << RELAY_CLIENT_HIST_SUB_BITS;
+	if (ns < sub) {
+		return ns;
+	}
+	int log = 63 - __builtin_clzll(ns);
+	return (log - RELAY_CLIENT_HIST_SUB_BITS + 1) * sub + ((ns >> (log - RELAY_CLIENT_HIST_SUB_BITS)) & (sub - 1));
+}
+
+uint64_t relay_client_histogram_bucket_min(size_t bucket)
+{
+	const size_t sub = 1 << RELAY_CLIENT_HIST_SUB_BITS;
+	if (bucket < sub) {
+		return bucket;
+	}
+	int log = bucket / sub + RELAY_CLIENT_HIST_SUB_BITS - 1;
+	return (uint64_t) (sub + bucket % sub) << (log - RELAY_CLIENT_HIST_SUB_BITS);
+}
+
+uint64_t relay_client_histogram_percentile(const struct relay_client_histogram *hist, double percentile)
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < RELAY_CLIENT_HIST_BUCKETS; i++) {
+		total += hist->count[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	/* Rank of the requested sample, counting from one */
+	uint64_t rank = percentile / 100 * total;
+	if (rank < 1) {
+		rank = 1;
+	} else if (rank > total) {
+		rank = total;
+	}
+	for (size_t i = 0; i < RELAY_CLIENT_HIST_BUCKETS; i++) {
+		if (hist->count[i] >= rank) {
+			return relay_client_histogram_bucket_min(i);
+		}
+		rank -= hist->count[i];
+	}
+	return 0;
+}
+
+/* Start time for the latency histograms, zero if stats are disabled */
+static uint64_t stats_start(struct relay_client *self)
+{
+	return self->stats ? now_ns() : 0;
+}
+
+static void stats_send_latency(struct relay_client *self, uint64_t start)
+{
+	if (self->stats) {
+		add_stat(self->stats, send_latency.count[histogram_bucket(now_ns() - start)], 1);
+	}
+}
+
+static void stats_recv_latency(struct relay_client *self, uint64_t start)
+{
+	if (self->stats) {
+		add_stat(self->stats, recv_latency.count[histogram_bucket(now_ns() - start)], 1);
+	}
+}
+
+static void stats_sent(struct relay_client *self, size_t packets, size_t bytes)
+{
+	if (self->stats) {
+		add_stat(self->stats, packets_sent, packets);
+		add_stat(self->stats, bytes_sent, bytes);
+	}
+}
+
+static void stats_received(struct relay_client *self, size_t bytes)
+{
+	if (self->stats) {
+		add_stat(self->stats, packets_received, 1);
+		add_stat(self->stats, bytes_received, bytes);
+	}
+}
+
+bool relay_client_authenticate(struct relay_client *self)
 {
 	if (strlen(self->local) == 0) {
 		return true;
@@ -40,6 +140,9 @@ static bool relay_authenticate(struct relay_client *self)
 struct rca_fd_data {
 	int fd;
 	bool owns_fd;
+	bool is_socket;
+	/* Owning client, for its stats */
+	struct relay_client *client;
 };
 
 static bool rca_fd_init_int(struct relay_client *self, struct rca_fd_data *this, const struct relay_client_fd_data *args)
@@ -47,16 +150,18 @@ static bool rca_fd_init_int(struct relay_client *self, struct rca_fd_data *this,
 	if (this->fd < 0) {
 		return false;
 	}
+	this->client = self;
 	this->fd = args->fd;
 	this->owns_fd = args->owns;
 	struct stat ss;
 	if (fstat(this->fd, &ss) == 0 && S_ISSOCK(ss.st_mode)) {
 		log_debug("Configuring socket interface");
+		this->is_socket = true;
 		setsockopt_nodelay(this->fd);
 		setsockopt_keepalive(this->fd);
 	}
 	/* Authenticate if fd is backed by a socket */
-	if (args->auth_needed && !relay_authenticate(self)) {
+	if (args->auth_needed && !relay_client_authenticate(self)) {
 		log_error("Failed to authenticate with fd#%d (%s)", this->fd, strerror(errno));
 		return false;
 	}
@@ -82,13 +187,45 @@ static int poll_one(int fd, int event) {
 	return poll(&pfd, 1, -1) == 1 || errno == EAGAIN;
 }
 
+/* Counts a read/write syscall and whether it would have blocked */
+static void fd_count(struct rca_fd_data *this, bool write, ssize_t res)
+{
+	struct relay_client_stats *stats = this->client->stats;
+	if (!stats) {
+		return;
+	}
+	if (write) {
+		add_stat(stats, write_calls, 1);
+	} else {
+		add_stat(stats, read_calls, 1);
+	}
+	if (again(res)) {
+		add_stat(stats, eagain, 1);
+	}
+}
+
+/* poll_one, timed when stats are enabled */
+static int fd_wait(struct rca_fd_data *this, int event)
+{
+	struct relay_client_stats *stats = this->client->stats;
+	if (!stats) {
+		return poll_one(this->fd, event);
+	}
+	uint64_t start = now_ns();
+	int res = poll_one(this->fd, event);
+	add_stat(stats, poll_waits, 1);
+	add_stat(stats, blocked_ns, now_ns() - start);
+	return res;
+}
+
 static bool rca_fd_send_int(struct rca_fd_data *this, const void *buf, size_t length)
 {
 	for (size_t done = 0; done < length; ) {
 		errno = 0;
 		ssize_t bytes = write(this->fd, buf + done, length - done);
+		fd_count(this, true, bytes);
 		if (again(bytes)) {
-			if (!poll_one(this->fd, POLLOUT)) {
+			if (!fd_wait(this, POLLOUT)) {
 				log_error("poll", "%d, POLLOUT", this->fd);
 				return false;
 			}
@@ -99,6 +236,73 @@ static bool rca_fd_send_int(struct rca_fd_data *this, const void *buf, size_t le
 		}
 		done += bytes;
 	}
+	return true;
+}
+
+static bool rca_fd_sendv_int(struct rca_fd_data *this, const struct iovec *iov, size_t iovcnt)
+{
+	/* Partial writes advance through a local copy of the vector */
+	struct iovec vec[iovcnt];
+	memcpy(vec, iov, sizeof(vec));
+	struct iovec *v = vec;
+	size_t count = iovcnt;
+	while (count > 0 && v->iov_len == 0) {
+		v++;
+		count--;
+	}
+	while (count > 0) {
+		errno = 0;
+		ssize_t bytes;
+		if (this->is_socket) {
+			struct msghdr msg = {
+				.msg_iov = v,
+				.msg_iovlen = count < IOV_MAX ? count : IOV_MAX
+			};
+			bytes = sendmsg(this->fd, &msg, 0);
+		} else {
+			bytes = writev(this->fd, v, count < IOV_MAX ? count : IOV_MAX);
+		}
+		fd_count(this, true, bytes);
+		if (again(bytes)) {
+			if (!fd_wait(this, POLLOUT)) {
+				log_error("Failed to poll fd#%d for POLLOUT (%s)", this->fd, strerror(errno));
+				return false;
+			}
+			continue;
+		} else if (bytes == -1) {
+			log_error("Failed to send %zu buffers on fd (%s)", iovcnt, strerror(errno));
+			return false;
+		}
+		size_t done = bytes;
+		while (count > 0 && done >= v->iov_len) {
+			done -= v->iov_len;
+			v++;
+			count--;
+		}
+		if (count > 0) {
+			v->iov_base += done;
+			v->iov_len -= done;
+		}
+	}
+	return true;
+}
+
+static bool rca_fd_cork_int(struct rca_fd_data *this, bool cork)
+{
+	if (!this->is_socket) {
+		return true;
+	}
+	int value = cork;
+	/* Not a TCP socket: nothing to cork */
+	if (setsockopt(this->fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) == -1 && errno != EOPNOTSUPP && errno != ENOPROTOOPT) {
+		log_error("Failed to set TCP_CORK=%d on fd (%s)", value, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static bool rca_fd_sync_int(struct rca_fd_data *this)
+{
 	return fsync(this->fd) == 0 || errno == EINVAL;
 }
 
@@ -112,8 +316,9 @@ static enum rca_recv_result rca_fd_recv_int(struct rca_fd_data *this, void *buf,
 	for (size_t done = 0; done < length; ) {
 		errno = 0;
 		ssize_t bytes = read(this->fd, buf + done, length - done);
+		fd_count(this, false, bytes);
 		if (again(bytes)) {
-			if (!poll_one(this->fd, POLLIN)) {
+			if (!fd_wait(this, POLLIN)) {
 				log_error("poll", "%d, POLLIN", this->fd);
 				return rcarr_fail;
 			}
@@ -132,6 +337,75 @@ static enum rca_recv_result rca_fd_recv_int(struct rca_fd_data *this, void *buf,
 	return rcarr_success;
 }
 
+static enum rca_recv_result rca_fd_recv_some_int(struct rca_fd_data *this, void *buf, size_t length, size_t *received)
+{
+	while (true) {
+		errno = 0;
+		ssize_t bytes = read(this->fd, buf, length);
+		fd_count(this, false, bytes);
+		if (again(bytes)) {
+			if (!fd_wait(this, POLLIN)) {
+				log_error("Failed to poll fd#%d for POLLIN (%s)", this->fd, strerror(errno));
+				return rcarr_fail;
+			}
+			continue;
+		} else if (bytes == -1) {
+			log_error("Failed to read up to %zu bytes on fd (%s)", length, strerror(errno));
+			return rcarr_fail;
+		} else if (bytes == 0) {
+			log_debug("EOF fd=%d read_len=%zu", this->fd, length);
+			return rcarr_eof;
+		}
+		*received = bytes;
+		return rcarr_success;
+	}
+}
+
+static enum rca_recv_result rca_fd_try_recv_int(struct rca_fd_data *this, void *buf, size_t length, size_t *received)
+{
+	*received = 0;
+	errno = 0;
+	ssize_t bytes = this->is_socket ?
+		recv(this->fd, buf, length, MSG_DONTWAIT) :
+		read(this->fd, buf, length);
+	fd_count(this, false, bytes);
+	if (again(bytes)) {
+		return rcarr_again;
+	} else if (bytes == -1) {
+		log_error("Failed to read up to %zu bytes on fd (%s)", length, strerror(errno));
+		return rcarr_fail;
+	} else if (bytes == 0) {
+		return rcarr_eof;
+	}
+	*received = bytes;
+	return rcarr_success;
+}
+
+static enum rca_recv_result rca_fd_try_sendv_int(struct rca_fd_data *this, const struct iovec *iov, size_t iovcnt, size_t *sent)
+{
+	*sent = 0;
+	errno = 0;
+	ssize_t bytes;
+	if (this->is_socket) {
+		struct msghdr msg = {
+			.msg_iov = (struct iovec *) iov,
+			.msg_iovlen = iovcnt < IOV_MAX ? iovcnt : IOV_MAX
+		};
+		bytes = sendmsg(this->fd, &msg, MSG_DONTWAIT);
+	} else {
+		bytes = writev(this->fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+	}
+	fd_count(this, true, bytes);
+	if (again(bytes)) {
+		return rcarr_again;
+	} else if (bytes == -1) {
+		log_error("Failed to send %zu buffers on fd (%s)", iovcnt, strerror(errno));
+		return rcarr_fail;
+	}
+	*sent = bytes;
+	return rcarr_success;
+}
+
 static bool rca_fd_init(struct relay_client *self, const void *initargs)
 {
 	return rca_fd_init_int(self, self->data, initargs);
@@ -147,6 +421,42 @@ static bool rca_fd_send(struct relay_client *self, const void *buf, size_t lengt
 	return rca_fd_send_int(self->data, buf, length);
 }
 
+static bool rca_fd_sendv(struct relay_client *self, const struct iovec *iov, size_t iovcnt)
+{
+	return rca_fd_sendv_int(self->data, iov, iovcnt);
+}
+
+static enum rca_recv_result rca_fd_recv_some(struct relay_client *self, void *buf, size_t length, size_t *received)
+{
+	return rca_fd_recv_some_int(self->data, buf, length, received);
+}
+
+static enum rca_recv_result rca_fd_try_recv(struct relay_client *self, void *buf, size_t length, size_t *received)
+{
+	return rca_fd_try_recv_int(self->data, buf, length, received);
+}
+
+static enum rca_recv_result rca_fd_try_sendv(struct relay_client *self, const struct iovec *iov, size_t iovcnt, size_t *sent)
+{
+	return rca_fd_try_sendv_int(self->data, iov, iovcnt, sent);
+}
+
+static int rca_fd_get_fd(struct relay_client *self)
+{
+	struct rca_fd_data *this = self->data;
+	return this->fd;
+}
+
+static bool rca_fd_cork(struct relay_client *self, bool cork)
+{
+	return rca_fd_cork_int(self->data, cork);
+}
+
+static bool rca_fd_sync(struct relay_client *self)
+{
+	return rca_fd_sync_int(self->data);
+}
+
 static enum rca_recv_result rca_fd_recv(struct relay_client *self, void *buf, size_t length)
 {
 	return rca_fd_recv_int(self->data, buf, length);
@@ -157,6 +467,13 @@ const struct relay_client_adapter relay_client_fd_adapter = {
 	.destroy = rca_fd_destroy,
 	.send = rca_fd_send,
 	.recv = rca_fd_recv,
+	.sendv = rca_fd_sendv,
+	.recv_some = rca_fd_recv_some,
+	.try_recv = rca_fd_try_recv,
+	.try_sendv = rca_fd_try_sendv,
+	.get_fd = rca_fd_get_fd,
+	.cork = rca_fd_cork,
+	.sync = rca_fd_sync,
 	.instdata_size = sizeof(struct rca_fd_data)
 };
 
@@ -192,7 +509,7 @@ static bool rca_socket_init(struct relay_client *self, const void *initargs)
 #else
 	setsockopt_nodelay(this->socket.fd);
 	setsockopt_keepalive(this->socket.fd);
-	if (!relay_authenticate(self)) {
+	if (!relay_client_authenticate(self)) {
 		log_error("Failed to authenticate with " PRIfs ":" PRIfs " (%s)", prifs(&addr), prifs(&port), strerror(errno));
 		return false;
 	}
@@ -219,6 +536,70 @@ static bool rca_socket_send(struct relay_client *self, const void *buf, size_t l
 #endif
 }
 
+static bool rca_socket_sendv(struct relay_client *self, const struct iovec *iov, size_t iovcnt)
+{
+	struct rca_socket_data *this = self->data;
+#if defined RCA_SOCKET_USE_FD
+	return rca_fd_sendv_int(&this->fd, iov, iovcnt);
+#else
+	for (size_t i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len && !socket_client_send(&this->socket, iov[i].iov_base, iov[i].iov_len)) {
+			return false;
+		}
+	}
+	return true;
+#endif
+}
+
+static enum rca_recv_result rca_socket_recv_some(struct relay_client *self, void *buf, size_t length, size_t *received)
+{
+	struct rca_socket_data *this = self->data;
+#if defined RCA_SOCKET_USE_FD
+	return rca_fd_recv_some_int(&this->fd, buf, length, received);
+#else
+	ssize_t bytes = recv(this->socket.fd, buf, length, 0);
+	if (bytes == -1) {
+		log_error("Failed to receive up to %zu bytes on socket (%s)", length, strerror(errno));
+		return rcarr_fail;
+	} else if (bytes == 0) {
+		return rcarr_eof;
+	}
+	*received = bytes;
+	return rcarr_success;
+#endif
+}
+
+#if defined RCA_SOCKET_USE_FD
+static enum rca_recv_result rca_socket_try_recv(struct relay_client *self, void *buf, size_t length, size_t *received)
+{
+	struct rca_socket_data *this = self->data;
+	return rca_fd_try_recv_int(&this->fd, buf, length, received);
+}
+
+static enum rca_recv_result rca_socket_try_sendv(struct relay_client *self, const struct iovec *iov, size_t iovcnt, size_t *sent)
+{
+	struct rca_socket_data *this = self->data;
+	return rca_fd_try_sendv_int(&this->fd, iov, iovcnt, sent);
+}
+#endif
+
+static int rca_socket_get_fd(struct relay_client *self)
+{
+	struct rca_socket_data *this = self->data;
+	return this->socket.fd;
+}
+
+static bool rca_socket_cork(struct relay_client *self, bool cork)
+{
+	struct rca_socket_data *this = self->data;
+#if defined RCA_SOCKET_USE_FD
+	return rca_fd_cork_int(&this->fd, cork);
+#else
+	int value = cork;
+	return setsockopt(this->socket.fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value)) == 0;
+#endif
+}
+
 static enum rca_recv_result rca_socket_recv(struct relay_client *self, void *buf, size_t length)
 {
 	struct rca_socket_data *this = self->data;
@@ -242,19 +623,49 @@ const struct relay_client_adapter relay_client_socket_adapter = {
 	.destroy = rca_socket_destroy,
 	.send = rca_socket_send,
 	.recv = rca_socket_recv,
+	.sendv = rca_socket_sendv,
+	.recv_some = rca_socket_recv_some,
+#if defined RCA_SOCKET_USE_FD
+	.try_recv = rca_socket_try_recv,
+	.try_sendv = rca_socket_try_sendv,
+#endif
+	.get_fd = rca_socket_get_fd,
+	.cork = rca_socket_cork,
 	.instdata_size = sizeof(struct rca_socket_data)
 };
 
 /* I/O */
 
-static bool relay_client_write(struct relay_client *self, const void *buf, const size_t length)
+static bool relay_client_writev(struct relay_client *self, const struct iovec *iov, size_t iovcnt)
 {
 	if (self->failed) {
 		log_error("Attempted to write to relay client while in failed state");
 		return false;
 	}
-	log_debug("Writing %zu bytes", length);
-	bool res =  self->adapter->send(self, buf, length);
+	/* Output left over from non-blocking sends goes first */
+	struct relay_client_buffer *tx = &self->tx;
+	if (tx->tail > tx->head) {
+		log_debug("Writing %zu pending bytes", tx->tail - tx->head);
+		if (!self->adapter->send(self, tx->buf + tx->head, tx->tail - tx->head)) {
+			log_error("Relay write of pending output failed (errno=%d)", errno);
+			return false;
+		}
+		tx->head = 0;
+		tx->tail = 0;
+	}
+	size_t length = 0;
+	for (size_t i = 0; i < iovcnt; i++) {
+		length += iov[i].iov_len;
+	}
+	log_debug("Writing %zu bytes from %zu buffers", length, iovcnt);
+	bool res = true;
+	if (self->adapter->sendv) {
+		res = self->adapter->sendv(self, iov, iovcnt);
+	} else {
+		for (size_t i = 0; res && i < iovcnt; i++) {
+			res = self->adapter->send(self, iov[i].iov_base, iov[i].iov_len);
+		}
+	}
 	if (res) {
 		log_debug("Written %zu bytes", length);
 	} else {
@@ -263,21 +674,103 @@ static bool relay_client_write(struct relay_client *self, const void *buf, const
 	return res;
 }
 
+/* Serves a read from the receive buffer, refilling it as needed */
+static enum rca_recv_result relay_client_read_buffered(struct relay_client *self, void *buf, size_t length)
+{
+	struct relay_client_buffer *rx = &self->rx;
+	size_t done = 0;
+	while (true) {
+		size_t take = rx->tail - rx->head;
+		if (take > length - done) {
+			take = length - done;
+		}
+		memcpy(buf + done, rx->buf + rx->head, take);
+		rx->head += take;
+		done += take;
+		if (rx->head == rx->tail) {
+			rx->head = 0;
+			rx->tail = 0;
+		}
+		if (done == length) {
+			return rcarr_success;
+		}
+		/* Buffer is empty now, large remainders bypass it */
+		if (length - done >= rx->size) {
+			return self->adapter->recv(self, buf + done, length - done);
+		}
+		size_t received;
+		enum rca_recv_result res = self->adapter->recv_some(self, rx->buf, rx->size, &received);
+		if (res != rcarr_success) {
+			return res;
+		}
+		log_debug("Buffered %zu bytes", received);
+		rx->tail = received;
+	}
+}
+
+static bool relay_client_write(struct relay_client *self, const void *buf, const size_t length)
+{
+	struct iovec iov = { .iov_base = (void *) buf, .iov_len = length };
+	return relay_client_writev(self, &iov, 1);
+}
+
 static enum rca_recv_result relay_client_read(struct relay_client *self, void *buf, size_t length)
 {
 	if (self->failed) {
 		log_error("Attempted to read from relay client while in failed state");
 		return false;
 	}
-	enum rca_recv_result res = self->adapter->recv(self, buf, length);
+	enum rca_recv_result res = self->rx.buf ?
+		relay_client_read_buffered(self, buf, length) :
+		self->adapter->recv(self, buf, length);
 	switch (res) {
 	case rcarr_success: log_debug("Read %zu bytes", length); break;
 	case rcarr_eof: log_debug("EOF While reading %zu bytes", length); break;
 	case rcarr_fail: log_error("Read failed (errno=%d, bytes=%zu)", errno, length); break;
+	case rcarr_again: log_error("Read would block (bytes=%zu)", length); res = rcarr_fail; break;
 	}
 	return res;
 }
 
+static void relay_client_free_block(char *block, bool pooled)
+{
+	if (pooled) {
+		relay_pool_release(block);
+	} else {
+		free(block);
+	}
+}
+
+/* Partly reassembled messages (see relay_client_reassemble) */
+
+struct relay_client_partial {
+	struct relay_client_partial *next;
+	/* Sender and message id */
+	char remote[RELAY_ENDPOINT_LENGTH];
+	uint32_t id;
+	/* Message block, allocated as for the receive which got the first fragment */
+	char *block;
+	size_t prefix;
+	bool pooled;
+	size_t length;
+	size_t done;
+};
+
+static void relay_client_drop_partial(struct relay_client_partial **link)
+{
+	struct relay_client_partial *partial = *link;
+	*link = partial->next;
+	relay_client_free_block(partial->block, partial->pooled);
+	free(partial);
+}
+
+static void relay_client_drop_partials(struct relay_client *self)
+{
+	while (self->partials) {
+		relay_client_drop_partial(&self->partials);
+	}
+}
+
 /* Convenience constructors */
 
 bool relay_client_init_socket(struct relay_client *self, const char *local, const char *addr, const char *port)
@@ -315,6 +808,8 @@ bool relay_client_init(struct relay_client *self, const char *local, const struc
 	}
 	/* Other config */
 	self->mtu = relay_client_mtu;
+	/* Distinct starting message ids make clashes between same-named clients unlikely */
+	self->fragment_id = now_ns() ^ ((uint64_t) getpid() << 16);
 	self->adapter = adapter;
 	/* Child constructor */
 	self->data = malloc(adapter->instdata_size);
@@ -342,51 +837,435 @@ void relay_client_destroy(struct relay_client *self)
 	}
 	free(self->data);
 	self->data = NULL;
+	free(self->batch.entries);
+	free(self->batch.iov);
+	memset(&self->batch, 0, sizeof(self->batch));
+	free(self->rx.buf);
+	memset(&self->rx, 0, sizeof(self->rx));
+	free(self->tx.buf);
+	memset(&self->tx, 0, sizeof(self->tx));
+	free(self->rx_block);
+	self->rx_block = NULL;
+	relay_client_drop_partials(self);
+	if (self->pool) {
+		relay_pool_destroy(self->pool);
+		free(self->pool);
+		self->pool = NULL;
+	}
+	free(self->stats);
+	self->stats = NULL;
 }
 
-/* Writing */
-
-bool relay_client_send_text(struct relay_client *self, const char *type, const char *remote, const char *text)
-{
-	return relay_client_send_packet(self, type, remote, text, strlen(text));
-}
-
-bool relay_client_send_packet(struct relay_client *self, const char *type, const char *remote, const void *data, const size_t length)
-{
-	struct relay_packet p;
-	relay_make_packet(&p, type, remote, self->local, (char *) data, length);
-	return relay_client_send_packet2(self, &p);
-}
-
-bool relay_client_send_packet2(struct relay_client *self, const struct relay_packet *packet)
-{
-// fprintf(stderr, "Sending '%s' from '%s' to '%s'\n", packet->type, packet->local, packet->remote);
-	size_t total_length = relay_serialised_packet_size(packet->length);
-	char buf[total_length];
-	struct relay_packet_serial *s = (void *) buf;
-	relay_serialise_packet(s, packet, &total_length);
-	bool res = relay_client_send_packet3(self, s, total_length);
-	return res;
-}
-
-bool relay_client_send_packet3(struct relay_client *self, const struct relay_packet_serial *packet, size_t total_length)
+bool relay_client_set_recv_buffer(struct relay_client *self, size_t size)
 {
-	if (total_length == 0) {
-		total_length = sizeof(*packet) + ntohl(packet->header.length);
+	struct relay_client_buffer *rx = &self->rx;
+	if (size && !self->adapter->recv_some) {
+		log_error("Relay client adapter does not support buffered receive");
+		return false;
 	}
-	if (total_length > self->mtu) {
-		self->failed |= RCF_SEND_TOO_LARGE;
-		log_error("Attempted to send packet larger (%zu) than client MTU (%zu)", total_length, self->mtu);
+	if (rx->tail - rx->head > size) {
+		log_error("Cannot shrink receive buffer below %zu bytes of buffered data", rx->tail - rx->head);
 		return false;
 	}
-	if (!relay_client_write(self, packet, total_length)) {
-		log_error("Failed to write %zu bytes (%d)", total_length, errno);
+	if (size == 0) {
+		free(rx->buf);
+		memset(rx, 0, sizeof(*rx));
+		return true;
+	}
+	char *buf = malloc(size);
+	if (!buf) {
+		log_error("Failed to allocate %zu byte receive buffer", size);
 		return false;
 	}
+	if (rx->buf) {
+		memcpy(buf, rx->buf + rx->head, rx->tail - rx->head);
+	}
+	rx->tail -= rx->head;
+	rx->head = 0;
+	free(rx->buf);
+	rx->buf = buf;
+	rx->size = size;
 	return true;
 }
 
-/* Reading */
+/* Writing */
+
+static bool relay_client_check_mtu(struct relay_client *self, size_t total_length)
+{
+	if (total_length > self->mtu) {
+		self->failed |= RCF_SEND_TOO_LARGE;
+		log_error("Attempted to send packet larger (%zu) than client MTU (%zu)", total_length, self->mtu);
+		return false;
+	}
+	return true;
+}
+
+/* Sends whatever the batch holds, the batch remains open */
+static bool relay_client_batch_send(struct relay_client *self)
+{
+	struct relay_client_batch *batch = &self->batch;
+	if (batch->count == 0) {
+		return true;
+	}
+	size_t iovcnt = 0;
+	for (size_t i = 0; i < batch->count; i++) {
+		struct relay_client_batch_entry *entry = &batch->entries[i];
+		batch->iov[iovcnt++] = (struct iovec) { .iov_base = &entry->hdr, .iov_len = sizeof(entry->hdr) };
+		if (entry->length) {
+			batch->iov[iovcnt++] = (struct iovec) { .iov_base = (void *) entry->data, .iov_len = entry->length };
+		}
+	}
+	size_t packets = batch->count;
+	batch->count = 0;
+	if (!relay_client_writev(self, batch->iov, iovcnt)) {
+		log_error("Failed to write batch of %zu buffers (%d)", iovcnt, errno);
+		return false;
+	}
+	if (self->stats) {
+		size_t bytes = 0;
+		for (size_t i = 0; i < iovcnt; i++) {
+			bytes += batch->iov[i].iov_len;
+		}
+		stats_sent(self, packets, bytes);
+	}
+	return true;
+}
+
+/* Fragmentation */
+
+void relay_client_set_fragment_size(struct relay_client *self, size_t size)
+{
+	self->fragment_size = size;
+}
+
+void relay_client_set_reassembly(struct relay_client *self, bool enable)
+{
+	self->no_reassembly = !enable;
+}
+
+static bool relay_client_fragmenting(struct relay_client *self, size_t length)
+{
+	return self->fragment_size && length > self->fragment_size;
+}
+
+/* Sends a message as fragments, "hdr" is its unfragmented header */
+static bool relay_client_send_fragments(struct relay_client *self, const struct relay_packet_serial_hdr *hdr, const void *data)
+{
+	struct relay_fragmenter it;
+	relay_fragmenter_init(&it, hdr, self->fragment_id++, data, self->fragment_size);
+	struct iovec iov[3];
+	size_t iovcnt;
+	while ((iovcnt = relay_fragmenter_next(&it, iov))) {
+		if (!relay_client_writev(self, iov, iovcnt)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Sends a header and payload, fragmenting the message if it is large */
+static bool relay_client_send_message(struct relay_client *self, const struct relay_packet_serial_hdr *hdr, const void *data, size_t length)
+{
+	if (relay_client_fragmenting(self, length)) {
+		return relay_client_send_fragments(self, hdr, data);
+	}
+	struct iovec iov[2] = {
+		{ .iov_base = (void *) hdr, .iov_len = sizeof(*hdr) },
+		{ .iov_base = (void *) data, .iov_len = length }
+	};
+	return relay_client_writev(self, iov, length ? 2 : 1);
+}
+
+bool relay_client_send_text(struct relay_client *self, const char *type, const char *remote, const char *text)
+{
+	return relay_client_send_packet(self, type, remote, text, strlen(text));
+}
+
+bool relay_client_send_packet(struct relay_client *self, const char *type, const char *remote, const void *data, const size_t length)
+{
+	struct relay_packet p;
+	relay_make_packet(&p, type, remote, self->local, (char *) data, length);
+	return relay_client_send_packet2(self, &p);
+}
+
+bool relay_client_send_packet2(struct relay_client *self, const struct relay_packet *packet)
+{
+// fprintf(stderr, "Sending '%s' from '%s' to '%s'\n", packet->type, packet->local, packet->remote);
+	uint64_t start = stats_start(self);
+	size_t total_length = relay_serialised_packet_size(packet->length);
+	if (!relay_client_check_mtu(self, total_length)) {
+		return false;
+	}
+	if (!relay_client_batch_send(self)) {
+		return false;
+	}
+	/* Header and payload go to the adapter separately, payload is not copied */
+	struct relay_packet_serial_hdr hdr;
+	relay_serialise_packet_header(&hdr, packet);
+	if (!relay_client_send_message(self, &hdr, packet->data, packet->length)) {
+		log_error("Failed to write %zu bytes (%d)", total_length, errno);
+		return false;
+	}
+	stats_sent(self, 1, total_length);
+	stats_send_latency(self, start);
+	return true;
+}
+
+void relay_client_make_template(struct relay_client *self, struct relay_header_template *tpl, const char *type, const char *remote)
+{
+	relay_header_template_init(tpl, type, remote, self->local);
+}
+
+bool relay_client_send_template(struct relay_client *self, const struct relay_header_template *tpl, const void *data, size_t length)
+{
+	uint64_t start = stats_start(self);
+	size_t total_length = relay_serialised_packet_size(length);
+	if (!relay_client_check_mtu(self, total_length)) {
+		return false;
+	}
+	if (!relay_client_batch_send(self)) {
+		return false;
+	}
+	struct relay_packet_serial_hdr hdr;
+	relay_header_template_apply(tpl, &hdr, length);
+	if (!relay_client_send_message(self, &hdr, data, length)) {
+		log_error("Failed to write %zu bytes (%d)", total_length, errno);
+		return false;
+	}
+	stats_sent(self, 1, total_length);
+	stats_send_latency(self, start);
+	return true;
+}
+
+bool relay_client_send_packet3(struct relay_client *self, const struct relay_packet_serial *packet, size_t total_length)
+{
+	uint64_t start = stats_start(self);
+	if (total_length == 0) {
+		total_length = sizeof(*packet) + relay_serialised_packet_data_length(&packet->header);
+	}
+	if (!relay_client_check_mtu(self, total_length)) {
+		return false;
+	}
+	if (!relay_client_batch_send(self)) {
+		return false;
+	}
+	const size_t length = total_length - sizeof(*packet);
+	const bool ok = relay_client_fragmenting(self, length) ?
+		relay_client_send_fragments(self, &packet->header, packet->data) :
+		relay_client_write(self, packet, total_length);
+	if (!ok) {
+		log_error("Failed to write %zu bytes (%d)", total_length, errno);
+		return false;
+	}
+	stats_sent(self, 1, total_length);
+	stats_send_latency(self, start);
+	return true;
+}
+
+/* Sends the header and a memory-mapped file range with one writev (or as fragments) */
+static bool relay_client_send_mapped(struct relay_client *self, const struct relay_packet_serial_hdr *hdr, int fd, off_t offset, size_t length)
+{
+	struct iovec iov[2];
+	size_t iovcnt = 0;
+	if (hdr) {
+		iov[iovcnt++] = (struct iovec) { .iov_base = (void *) hdr, .iov_len = sizeof(*hdr) };
+	}
+	void *map = NULL;
+	size_t map_length = 0;
+	if (length) {
+		/* Mappings must start on a page boundary */
+		off_t skip = offset % sysconf(_SC_PAGESIZE);
+		map_length = skip + length;
+		map = mmap(NULL, map_length, PROT_READ, MAP_SHARED, fd, offset - skip);
+		if (map == MAP_FAILED) {
+			log_error("Failed to map %zu bytes of fd#%d (%s)", length, fd, strerror(errno));
+			return false;
+		}
+		madvise(map, map_length, MADV_SEQUENTIAL);
+		iov[iovcnt++] = (struct iovec) { .iov_base = map + skip, .iov_len = length };
+	}
+	bool res;
+	if (hdr && relay_client_fragmenting(self, length)) {
+		res = relay_client_send_fragments(self, hdr, iov[1].iov_base);
+	} else {
+		res = iovcnt == 0 || relay_client_writev(self, iov, iovcnt);
+	}
+	if (map) {
+		munmap(map, map_length);
+	}
+	return res;
+}
+
+bool relay_client_send_file(struct relay_client *self, const struct relay_header_template *tpl, int fd, off_t offset, size_t length)
+{
+	uint64_t start = stats_start(self);
+	size_t total_length = relay_serialised_packet_size(length);
+	if (!relay_client_check_mtu(self, total_length)) {
+		return false;
+	}
+	if (!relay_client_batch_send(self)) {
+		return false;
+	}
+	struct relay_packet_serial_hdr hdr;
+	relay_header_template_apply(tpl, &hdr, length);
+	const bool fd_backed = self->adapter == &relay_client_fd_adapter || self->adapter == &relay_client_socket_adapter;
+	if (!fd_backed || length == 0 || relay_client_fragmenting(self, length)) {
+		if (!relay_client_send_mapped(self, &hdr, fd, offset, length)) {
+			log_error("Failed to write %zu bytes (%d)", total_length, errno);
+			return false;
+		}
+		goto sent;
+	}
+	/* Header is held back by the cork so it leaves with the start of the file */
+	if (self->adapter->cork && !self->adapter->cork(self, true)) {
+		return false;
+	}
+	bool res = relay_client_write(self, &hdr, sizeof(hdr));
+	const int out = self->adapter->get_fd(self);
+	size_t done = 0;
+	while (res && done < length) {
+		errno = 0;
+		ssize_t bytes = sendfile(out, fd, &offset, length - done);
+		if (self->stats) {
+			add_stat(self->stats, write_calls, 1);
+		}
+		if (bytes == -1 && done == 0 && (errno == EINVAL || errno == ENOSYS)) {
+			/* Source cannot be spliced, the header has gone so send the rest mapped */
+			log_debug("sendfile not supported for fd#%d, using mmap", fd);
+			res = relay_client_send_mapped(self, NULL, fd, offset, length);
+			break;
+		} else if (again(bytes)) {
+			if (self->stats) {
+				add_stat(self->stats, eagain, 1);
+			}
+			if (!poll_one(out, POLLOUT)) {
+				log_error("Failed to wait on fd#%d (%s)", out, strerror(errno));
+				res = false;
+			}
+		} else if (bytes == -1) {
+			log_error("Failed to send %zu bytes from fd#%d (%s)", length - done, fd, strerror(errno));
+			res = false;
+		} else if (bytes == 0) {
+			log_error("File fd#%d ended %zu bytes short", fd, length - done);
+			res = false;
+		} else {
+			done += bytes;
+		}
+	}
+	if (self->adapter->cork && !self->adapter->cork(self, false)) {
+		res = false;
+	}
+	if (!res) {
+		log_error("Failed to write %zu bytes (%d)", total_length, errno);
+		return false;
+	}
+sent:
+	stats_sent(self, 1, total_length);
+	stats_send_latency(self, start);
+	return true;
+}
+
+/* Batched writing */
+
+bool relay_client_batch_begin(struct relay_client *self)
+{
+	struct relay_client_batch *batch = &self->batch;
+	if (batch->active) {
+		return true;
+	}
+	if (!batch->entries) {
+		/* Both or neither, so a failure here is retried in full next time */
+		struct relay_client_batch_entry *entries = malloc(RELAY_CLIENT_BATCH_MAX * sizeof(*entries));
+		struct iovec *iov = malloc(RELAY_CLIENT_BATCH_MAX * 2 * sizeof(*iov));
+		if (!entries || !iov) {
+			log_error("Failed to allocate batch buffers");
+			free(entries);
+			free(iov);
+			return false;
+		}
+		batch->entries = entries;
+		batch->iov = iov;
+	}
+	if (self->adapter->cork && !self->adapter->cork(self, true)) {
+		return false;
+	}
+	batch->active = true;
+	batch->count = 0;
+	return true;
+}
+
+bool relay_client_batch_append(struct relay_client *self, const char *type, const char *remote, const void *data, const size_t length)
+{
+	struct relay_packet p;
+	relay_make_packet(&p, type, remote, self->local, (char *) data, length);
+	return relay_client_batch_append2(self, &p);
+}
+
+bool relay_client_batch_append2(struct relay_client *self, const struct relay_packet *packet)
+{
+	struct relay_client_batch *batch = &self->batch;
+	if (!batch->active) {
+		log_error("Attempted to append to relay client batch before batch_begin");
+		return false;
+	}
+	if (!relay_client_check_mtu(self, relay_serialised_packet_size(packet->length))) {
+		return false;
+	}
+	if (batch->count == RELAY_CLIENT_BATCH_MAX && !relay_client_batch_send(self)) {
+		return false;
+	}
+	struct relay_client_batch_entry *entry = &batch->entries[batch->count++];
+	relay_serialise_packet_header(&entry->hdr, packet);
+	entry->data = packet->data;
+	entry->length = packet->length;
+	return true;
+}
+
+bool relay_client_batch_append3(struct relay_client *self, const struct relay_packet_serial *packet)
+{
+	struct relay_client_batch *batch = &self->batch;
+	if (!batch->active) {
+		log_error("Attempted to append to relay client batch before batch_begin");
+		return false;
+	}
+	const size_t length = relay_serialised_packet_data_length(&packet->header);
+	if (!relay_client_check_mtu(self, relay_serialised_packet_size(length))) {
+		return false;
+	}
+	if (batch->count == RELAY_CLIENT_BATCH_MAX && !relay_client_batch_send(self)) {
+		return false;
+	}
+	struct relay_client_batch_entry *entry = &batch->entries[batch->count++];
+	memcpy(&entry->hdr, &packet->header, sizeof(entry->hdr));
+	entry->data = packet->data;
+	entry->length = length;
+	return true;
+}
+
+bool relay_client_flush(struct relay_client *self)
+{
+	struct relay_client_batch *batch = &self->batch;
+	bool res = true;
+	if (batch->active) {
+		uint64_t start = stats_start(self);
+		res = relay_client_batch_send(self);
+		if (res) {
+			stats_send_latency(self, start);
+		}
+		batch->active = false;
+		batch->count = 0;
+		if (self->adapter->cork && !self->adapter->cork(self, false)) {
+			res = false;
+		}
+	}
+	if (res && self->adapter->sync && !self->adapter->sync(self)) {
+		log_error("Failed to sync relay client (%d)", errno);
+		res = false;
+	}
+	return res;
+}
+
+/* Reading */
 
 static enum rca_recv_result relay_client_read_hdr(struct relay_client *self, size_t *datalen)
 {
@@ -395,7 +1274,9 @@ static enum rca_recv_result relay_client_read_hdr(struct relay_client *self, siz
 		return rcarr_success;
 	}
 	log_debug("Reading header");
-	switch (relay_client_read(self, &self->hdr, sizeof(self->hdr))) {
+	/* Resume after any part of the header received by try_recv */
+	switch (relay_client_read(self, (char *) &self->hdr + self->hdr_done, sizeof(self->hdr) - self->hdr_done)) {
+	case rcarr_again:
 	case rcarr_fail:
 		log_error("Failed to read relay packet header (%d)", errno);
 		return rcarr_fail;
@@ -405,6 +1286,7 @@ static enum rca_recv_result relay_client_read_hdr(struct relay_client *self, siz
 		break;
 	}
 	self->has_header = true;
+	self->hdr_done = 0;
 	*datalen = ntohl(self->hdr.length);
 	return rcarr_success;
 }
@@ -422,6 +1304,7 @@ static bool relay_client_read_payload(struct relay_client *self, struct relay_pa
 	case rcarr_eof:
 		log_error("Unexpected EOF");
 		/* Fall through */
+	case rcarr_again:
 	case rcarr_fail:
 		log_error("Failed to read relay packet payload (%d)", errno);
 		return false;
@@ -433,20 +1316,25 @@ static bool relay_client_read_payload(struct relay_client *self, struct relay_pa
 	return true;
 }
 
-bool relay_client_recv_serialised_packet(struct relay_client *self, struct relay_packet_serial **out)
+/*
+ * Receives a packet into a block which has "prefix" bytes reserved ahead of
+ * the serialised packet.  Block comes from the pool if "pooled" is set, else
+ * from malloc.  Returns true with *out == NULL on EOF.
+ */
+static bool relay_client_recv_raw_block(struct relay_client *self, size_t prefix, bool pooled, char **out)
 {
 	size_t data_length;
 	*out = NULL;
 	switch (relay_client_read_hdr(self, &data_length)) {
+	case rcarr_again:
 	case rcarr_fail:
-		log_error("Failed to read raw packet header (%d)", errno);
+		log_error("Failed to read packet header (%d)", errno);
 		return false;
 	case rcarr_eof:
 		return true;
 	case rcarr_success:
 		break;
 	}
-	struct relay_packet_serial *ps;
 	size_t in_length = sizeof(self->hdr) + data_length;
 	/* MTU/max-size check */
 	if (in_length > self->mtu) {
@@ -455,32 +1343,195 @@ bool relay_client_recv_serialised_packet(struct relay_client *self, struct relay
 		return false;
 	}
 	/* Add extra byte for null-terminator */
-	size_t alloc_length = sizeof(*ps) + data_length + 1;
-	ps = malloc(alloc_length);
+	size_t alloc_length = prefix + in_length + 1;
+	char *block = pooled ? relay_pool_alloc(self->pool, alloc_length) : malloc(alloc_length);
+	if (!block) {
+		log_error("Failed to allocate %zu bytes for packet", alloc_length);
+		return false;
+	}
+	struct relay_packet_serial *ps = (void *) (block + prefix);
 	/* Add null-terminator to after received data block */
 	ps->data[data_length] = 0;
 	if (!relay_client_read_payload(self, ps)) {
-		free(ps);
-		log_error("Failed to read raw packet payload (%d)", errno);
+		log_error("Failed to read packet payload (%d)", errno);
+		relay_client_free_block(block, pooled);
 		return false;
 	}
-	*out = ps;
+	*out = block;
 	return true;
 }
 
-bool relay_client_recv_packet(struct relay_client *self, struct relay_packet **out)
+/* Reassembly */
+
+static bool relay_client_reassembling(struct relay_client *self, const struct relay_packet_serial *ps)
+{
+	return !self->no_reassembly && relay_is_fragment(&ps->header);
+}
+
+/*
+ * Starts reassembling a message at the head of the list (newest first).
+ * Returns false if allocation fails, true without adding it if the message
+ * is too large.
+ */
+static bool relay_client_new_partial(struct relay_client *self, const struct relay_packet_serial *ps, const struct relay_fragment_hdr *frag, size_t prefix, bool pooled)
+{
+	const size_t length = ntohl(frag->total_length);
+	const size_t in_length = sizeof(*ps) + length;
+	if (in_length > self->mtu) {
+		log_error("Dropping fragmented message larger (%zu) than client MTU (%zu)", in_length, self->mtu);
+		return true;
+	}
+	size_t count = 0;
+	struct relay_client_partial **link = &self->partials;
+	for (; *link; link = &(*link)->next) {
+		if (++count == RELAY_CLIENT_PARTIALS_MAX) {
+			log_error("Too many fragmented messages in progress, dropping the oldest");
+			relay_client_drop_partial(link);
+			break;
+		}
+	}
+	struct relay_client_partial *partial = malloc(sizeof(*partial));
+	/* Add extra byte for null-terminator */
+	char *block = pooled ? relay_pool_alloc(self->pool, prefix + in_length + 1) : malloc(prefix + in_length + 1);
+	if (!partial || !block) {
+		log_error("Failed to allocate %zu bytes for fragmented message", prefix + in_length + 1);
+		free(partial);
+		if (block) {
+			relay_client_free_block(block, pooled);
+		}
+		return false;
+	}
+	struct relay_packet_serial *msg = (void *) (block + prefix);
+	msg->header = ps->header;
+	memcpy(msg->header.type, frag->type, RELAY_TYPE_LENGTH);
+	relay_serialised_packet_set_data_length(&msg->header, length);
+	msg->data[length] = 0;
+	memcpy(partial->remote, ps->header.remote, RELAY_ENDPOINT_LENGTH);
+	partial->id = ntohl(frag->id);
+	partial->block = block;
+	partial->prefix = prefix;
+	partial->pooled = pooled;
+	partial->length = length;
+	partial->done = 0;
+	partial->next = self->partials;
+	self->partials = partial;
+	return true;
+}
+
+/*
+ * Adds a fragment to its message.  Once the message is complete, *out is set
+ * to it in a block allocated as the caller's prefix/pooled require.  Invalid
+ * fragments are dropped (with their message), returns false only if
+ * allocation fails.
+ */
+static bool relay_client_reassemble(struct relay_client *self, const struct relay_packet_serial *ps, size_t prefix, bool pooled, char **out)
 {
-	size_t data_length;
 	*out = NULL;
-	switch (relay_client_read_hdr(self, &data_length)) {
-	case rcarr_eof:
+	const size_t length = relay_serialised_packet_data_length(&ps->header);
+	if (length < sizeof(struct relay_fragment_hdr)) {
+		log_error("Dropping fragment with truncated header (%zu bytes)", length);
 		return true;
-	case rcarr_fail:
-		log_error("Failed to read packet header (%d)", errno);
+	}
+	const struct relay_fragment_hdr *frag = (const void *) ps->data;
+	const size_t chunk = length - sizeof(*frag);
+	const uint32_t id = ntohl(frag->id);
+	const size_t offset = ntohl(frag->offset);
+	struct relay_client_partial **link = &self->partials;
+	for (; *link; link = &(*link)->next) {
+		if ((*link)->id == id && memcmp((*link)->remote, ps->header.remote, RELAY_ENDPOINT_LENGTH) == 0) {
+			break;
+		}
+	}
+	if (!*link) {
+		if (offset != 0) {
+			log_debug("Dropping fragment of unknown message %u from '%.*s'", id, RELAY_ENDPOINT_LENGTH, ps->header.remote);
+			return true;
+		}
+		struct relay_client_partial *head = self->partials;
+		if (!relay_client_new_partial(self, ps, frag, prefix, pooled)) {
+			return false;
+		}
+		if (self->partials == head) {
+			return true;
+		}
+		link = &self->partials;
+	}
+	struct relay_client_partial *partial = *link;
+	if (offset != partial->done || chunk > partial->length - partial->done) {
+		log_error("Dropping message %u from '%.*s', fragment at %zu does not follow %zu", id, RELAY_ENDPOINT_LENGTH, ps->header.remote, offset, partial->done);
+		relay_client_drop_partial(link);
+		return true;
+	}
+	struct relay_packet_serial *msg = (void *) (partial->block + partial->prefix);
+	memcpy(msg->data + partial->done, frag + 1, chunk);
+	partial->done += chunk;
+	if (partial->done < partial->length) {
+		return true;
+	}
+	/* Complete: hand the block over, converting it if it was allocated for another kind of receive */
+	*link = partial->next;
+	if (partial->prefix == prefix && partial->pooled == pooled) {
+		*out = partial->block;
+	} else {
+		const size_t size = sizeof(*msg) + partial->length + 1;
+		*out = pooled ? relay_pool_alloc(self->pool, prefix + size) : malloc(prefix + size);
+		if (*out) {
+			memcpy(*out + prefix, msg, size);
+		} else {
+			log_error("Failed to allocate %zu bytes for packet", prefix + size);
+		}
+		relay_client_free_block(partial->block, partial->pooled);
+	}
+	free(partial);
+	return *out != NULL;
+}
+
+/* Receives the next message into a block, reassembling fragmented ones */
+static bool relay_client_recv_block(struct relay_client *self, size_t prefix, bool pooled, char **out)
+{
+	while (true) {
+		if (!relay_client_recv_raw_block(self, prefix, pooled, out)) {
+			return false;
+		}
+		if (!*out) {
+			return true;
+		}
+		if (!relay_client_reassembling(self, (void *) (*out + prefix))) {
+			break;
+		}
+		char *block = *out;
+		bool ok = relay_client_reassemble(self, (void *) (block + prefix), prefix, pooled, out);
+		relay_client_free_block(block, pooled);
+		if (!ok) {
+			return false;
+		}
+		if (*out) {
+			break;
+		}
+	}
+	const struct relay_packet_serial *ps = (void *) (*out + prefix);
+	stats_received(self, sizeof(*ps) + relay_serialised_packet_data_length(&ps->header));
+	return true;
+}
+
+static bool relay_client_recv_serialised_int(struct relay_client *self, struct relay_packet_serial **out, bool pooled)
+{
+	uint64_t start = stats_start(self);
+	char *block;
+	if (!relay_client_recv_block(self, 0, pooled, &block)) {
+		log_error("Failed to receive raw packet (%d)", errno);
+		*out = NULL;
 		return false;
-	case rcarr_success:
-		break;
 	}
+	if (block) {
+		stats_recv_latency(self, start);
+	}
+	*out = (void *) block;
+	return true;
+}
+
+static bool relay_client_recv_packet_int(struct relay_client *self, struct relay_packet **out, bool pooled)
+{
 	/*
 	 * Deserialised packet points to buffers in serialised packet, so
 	 * allocate them both at once with the deserialised one at the head, so
@@ -494,28 +1545,367 @@ bool relay_client_recv_packet(struct relay_client *self, struct relay_packet **o
 			struct relay_packet_serial ps;
 		};
 	} *tuple;
-	size_t in_length = sizeof(self->hdr) + data_length;
-	/* MTU/max-size check */
-	if (in_length > self->mtu) {
-		self->failed |= RCF_RECV_TOO_LARGE;
-		log_error("Attempted to receive packet larger (%zu) than client MTU (%zu)", in_length, self->mtu);
+	uint64_t start = stats_start(self);
+	char *block;
+	*out = NULL;
+	if (!relay_client_recv_block(self, offsetof(typeof(*tuple), ps), pooled, &block)) {
+		log_error("Failed to receive packet (%d)", errno);
 		return false;
 	}
-	/* Add extra byte for null-terminator */
-	size_t alloc_length = sizeof(*tuple) + data_length + 1;
-	tuple = malloc(alloc_length);
-	/* Add null-terminator to after received data block */
-	tuple->ps.data[data_length] = 0;
-	if (!relay_client_read_payload(self, &tuple->ps)) {
-		log_error("Failed to read packet payload (%d)", errno);
-		free(tuple);
-		return false;
+	if (!block) {
+		return true;
 	}
-	relay_deserialise_packet(&tuple->p, &tuple->ps, in_length);
+	tuple = (void *) block;
+	relay_deserialise_packet(&tuple->p, &tuple->ps, sizeof(tuple->ps) + ntohl(tuple->ps.header.length));
 	*out = &tuple->p;
+	stats_recv_latency(self, start);
+	return true;
+}
+
+bool relay_client_recv_serialised_packet(struct relay_client *self, struct relay_packet_serial **out)
+{
+	return relay_client_recv_serialised_int(self, out, false);
+}
+
+bool relay_client_recv_packet(struct relay_client *self, struct relay_packet **out)
+{
+	return relay_client_recv_packet_int(self, out, false);
+}
+
+/* Pooled receive */
+
+bool relay_client_enable_pool(struct relay_client *self)
+{
+	if (self->pool) {
+		return true;
+	}
+	struct relay_pool *pool = malloc(sizeof(*pool));
+	if (!pool || !relay_pool_init(pool)) {
+		log_error("Failed to create relay client packet pool");
+		free(pool);
+		return false;
+	}
+	self->pool = pool;
+	return true;
+}
+
+bool relay_client_recv_pooled_serialised_packet(struct relay_client *self, struct relay_packet_serial **out)
+{
+	return relay_client_recv_serialised_int(self, out, true);
+}
+
+bool relay_client_recv_pooled_packet(struct relay_client *self, struct relay_packet **out)
+{
+	return relay_client_recv_packet_int(self, out, true);
+}
+
+void relay_client_release_packet(struct relay_client *self, void *packet)
+{
+	(void) self;
+	relay_pool_release(packet);
+}
+
+void relay_client_get_pool_stats(struct relay_client *self, struct relay_pool_stats *out)
+{
+	if (self->pool) {
+		relay_pool_get_stats(self->pool, out);
+	} else {
+		memset(out, 0, sizeof(*out));
+	}
+}
+
+/* Statistics */
+
+bool relay_client_enable_stats(struct relay_client *self)
+{
+	if (self->stats) {
+		return true;
+	}
+	self->stats = calloc(1, sizeof(*self->stats));
+	if (!self->stats) {
+		log_error("Failed to allocate relay client stats");
+		return false;
+	}
 	return true;
 }
 
+void relay_client_get_stats(struct relay_client *self, struct relay_client_stats *out)
+{
+	struct relay_client_stats *stats = self->stats;
+	if (!stats) {
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+	out->packets_sent = get_stat(stats, packets_sent);
+	out->bytes_sent = get_stat(stats, bytes_sent);
+	out->packets_received = get_stat(stats, packets_received);
+	out->bytes_received = get_stat(stats, bytes_received);
+	out->write_calls = get_stat(stats, write_calls);
+	out->read_calls = get_stat(stats, read_calls);
+	out->eagain = get_stat(stats, eagain);
+	out->poll_waits = get_stat(stats, poll_waits);
+	out->blocked_ns = get_stat(stats, blocked_ns);
+	for (size_t i = 0; i < RELAY_CLIENT_HIST_BUCKETS; i++) {
+		out->send_latency.count[i] = get_stat(stats, send_latency.count[i]);
+		out->recv_latency.count[i] = get_stat(stats, recv_latency.count[i]);
+	}
+}
+
+/* Non-blocking I/O */
+
+/*
+ * Reads up to length bytes without blocking, from the receive buffer first.
+ * Returns rcarr_success only once all length bytes have been read, *got
+ * reports progress in every case.
+ */
+static enum rca_recv_result relay_client_try_read(struct relay_client *self, void *buf, size_t length, size_t *got)
+{
+	struct relay_client_buffer *rx = &self->rx;
+	*got = 0;
+	if (!self->adapter->try_recv) {
+		log_error("Relay client adapter does not support non-blocking receive");
+		return rcarr_fail;
+	}
+	while (*got < length) {
+		if (rx->tail > rx->head) {
+			size_t take = rx->tail - rx->head;
+			if (take > length - *got) {
+				take = length - *got;
+			}
+			memcpy(buf + *got, rx->buf + rx->head, take);
+			rx->head += take;
+			*got += take;
+			if (rx->head == rx->tail) {
+				rx->head = 0;
+				rx->tail = 0;
+			}
+			continue;
+		}
+		size_t received;
+		enum rca_recv_result res;
+		if (rx->buf && length - *got < rx->size) {
+			res = self->adapter->try_recv(self, rx->buf, rx->size, &received);
+			rx->tail = received;
+		} else {
+			res = self->adapter->try_recv(self, buf + *got, length - *got, &received);
+			*got += received;
+		}
+		if (res != rcarr_success) {
+			return res;
+		}
+	}
+	return rcarr_success;
+}
+
+/*
+ * Non-blocking counterpart of relay_client_recv_raw_block: the block is kept
+ * in rx_block between calls until the whole packet has arrived.
+ */
+static enum rca_recv_result relay_client_try_recv_raw_block(struct relay_client *self, size_t prefix, char **out)
+{
+	enum rca_recv_result res;
+	size_t got;
+	*out = NULL;
+	if (self->failed) {
+		log_error("Attempted to read from relay client while in failed state");
+		return rcarr_fail;
+	}
+	if (!self->has_header) {
+		res = relay_client_try_read(self, (char *) &self->hdr + self->hdr_done, sizeof(self->hdr) - self->hdr_done, &got);
+		self->hdr_done += got;
+		if (res != rcarr_success) {
+			return res;
+		}
+		self->has_header = true;
+		self->hdr_done = 0;
+	}
+	const size_t data_length = ntohl(self->hdr.length);
+	const size_t in_length = sizeof(self->hdr) + data_length;
+	if (!self->rx_block) {
+		/* MTU/max-size check */
+		if (in_length > self->mtu) {
+			self->failed |= RCF_RECV_TOO_LARGE;
+			log_error("Attempted to receive packet larger (%zu) than client MTU (%zu)", in_length, self->mtu);
+			return rcarr_fail;
+		}
+		/* Add extra byte for null-terminator */
+		self->rx_block = malloc(prefix + in_length + 1);
+		if (!self->rx_block) {
+			log_error("Failed to allocate %zu bytes for packet", prefix + in_length + 1);
+			return rcarr_fail;
+		}
+		self->rx_done = 0;
+	}
+	struct relay_packet_serial *ps = (void *) (self->rx_block + prefix);
+	res = relay_client_try_read(self, ps->data + self->rx_done, data_length - self->rx_done, &got);
+	self->rx_done += got;
+	if (res == rcarr_eof) {
+		log_error("Unexpected EOF");
+		return rcarr_fail;
+	} else if (res != rcarr_success) {
+		return res;
+	}
+	ps->data[data_length] = 0;
+	memcpy(&ps->header, &self->hdr, sizeof(self->hdr));
+	*out = self->rx_block;
+	self->rx_block = NULL;
+	self->has_header = false;
+	return rcarr_success;
+}
+
+/* Non-blocking counterpart of relay_client_recv_block */
+static enum rca_recv_result relay_client_try_recv_block(struct relay_client *self, size_t prefix, char **out)
+{
+	enum rca_recv_result res;
+	while ((res = relay_client_try_recv_raw_block(self, prefix, out)) == rcarr_success) {
+		if (!relay_client_reassembling(self, (void *) (*out + prefix))) {
+			break;
+		}
+		char *block = *out;
+		bool ok = relay_client_reassemble(self, (void *) (block + prefix), prefix, false, out);
+		free(block);
+		if (!ok) {
+			return rcarr_fail;
+		}
+		if (*out) {
+			break;
+		}
+	}
+	if (res == rcarr_success) {
+		const struct relay_packet_serial *ps = (void *) (*out + prefix);
+		stats_received(self, sizeof(*ps) + relay_serialised_packet_data_length(&ps->header));
+	}
+	return res;
+}
+
+enum rca_recv_result relay_client_try_recv(struct relay_client *self, struct relay_packet **out)
+{
+	/* Same layout as in relay_client_recv_packet_int */
+	struct {
+		struct relay_packet p;
+		union {
+			struct relay_packet_serial ps;
+		};
+	} *tuple;
+	uint64_t start = stats_start(self);
+	char *block;
+	*out = NULL;
+	enum rca_recv_result res = relay_client_try_recv_block(self, offsetof(typeof(*tuple), ps), &block);
+	if (res != rcarr_success) {
+		return res;
+	}
+	tuple = (void *) block;
+	relay_deserialise_packet(&tuple->p, &tuple->ps, sizeof(tuple->ps) + ntohl(tuple->ps.header.length));
+	*out = &tuple->p;
+	stats_recv_latency(self, start);
+	return rcarr_success;
+}
+
+enum rca_recv_result relay_client_try_recv_serialised_packet(struct relay_client *self, struct relay_packet_serial **out)
+{
+	uint64_t start = stats_start(self);
+	char *block;
+	enum rca_recv_result res = relay_client_try_recv_block(self, 0, &block);
+	*out = (void *) block;
+	if (res == rcarr_success) {
+		stats_recv_latency(self, start);
+	}
+	return res;
+}
+
+enum rca_recv_result relay_client_try_flush(struct relay_client *self)
+{
+	struct relay_client_buffer *tx = &self->tx;
+	if (!self->adapter->try_sendv) {
+		log_error("Relay client adapter does not support non-blocking send");
+		return rcarr_fail;
+	}
+	while (tx->tail > tx->head) {
+		struct iovec iov = { .iov_base = tx->buf + tx->head, .iov_len = tx->tail - tx->head };
+		size_t sent;
+		enum rca_recv_result res = self->adapter->try_sendv(self, &iov, 1, &sent);
+		if (res != rcarr_success) {
+			return res;
+		}
+		tx->head += sent;
+	}
+	tx->head = 0;
+	tx->tail = 0;
+	return rcarr_success;
+}
+
+enum rca_recv_result relay_client_try_send(struct relay_client *self, const struct relay_packet *packet)
+{
+	struct relay_client_buffer *tx = &self->tx;
+	if (self->failed) {
+		log_error("Attempted to write to relay client while in failed state");
+		return rcarr_fail;
+	}
+	uint64_t start = stats_start(self);
+	enum rca_recv_result res = relay_client_try_flush(self);
+	if (res != rcarr_success) {
+		return res;
+	}
+	size_t total_length = relay_serialised_packet_size(packet->length);
+	if (!relay_client_check_mtu(self, total_length)) {
+		return rcarr_fail;
+	}
+	struct relay_packet_serial_hdr hdr;
+	relay_serialise_packet_header(&hdr, packet);
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = packet->data, .iov_len = packet->length }
+	};
+	size_t sent;
+	size_t iovcnt = packet->length ? 2 : 1;
+	res = self->adapter->try_sendv(self, iov, iovcnt, &sent);
+	if (res == rcarr_fail) {
+		return rcarr_fail;
+	}
+	stats_sent(self, 1, total_length);
+	stats_send_latency(self, start);
+	if (sent == total_length) {
+		return rcarr_success;
+	}
+	/* Keep the rest, it goes out on the next try_flush/try_send */
+	size_t remaining = total_length - sent;
+	if (tx->size < remaining) {
+		char *buf = realloc(tx->buf, remaining);
+		if (!buf) {
+			log_error("Failed to allocate %zu bytes for pending output", remaining);
+			return rcarr_fail;
+		}
+		tx->buf = buf;
+		tx->size = remaining;
+	}
+	for (size_t i = 0; i < iovcnt; i++) {
+		size_t skip = sent < iov[i].iov_len ? sent : iov[i].iov_len;
+		memcpy(tx->buf + tx->tail, iov[i].iov_base + skip, iov[i].iov_len - skip);
+		tx->tail += iov[i].iov_len - skip;
+		sent -= skip;
+	}
+	return rcarr_success;
+}
+
+int relay_client_get_fd(struct relay_client *self)
+{
+	return self->adapter->get_fd ? self->adapter->get_fd(self) : -1;
+}
+
+short relay_client_poll_events(struct relay_client *self)
+{
+	return POLLIN | (self->tx.tail > self->tx.head ? POLLOUT : 0);
+}
+
+int relay_client_get_send_fd(struct relay_client *self, short *events)
+{
+	if (self->adapter->get_send_fd) {
+		return self->adapter->get_send_fd(self, events);
+	}
+	*events = POLLOUT;
+	return relay_client_get_fd(self);
+}
+
 bool relay_client_recv_data(struct relay_client *self, char *type, char *remote, char *local, char *buf, size_t buf_size, ssize_t *buf_length)
 {
 	struct relay_packet_serial *packet;
@@ -3,7 +3,9 @@
 #include <cstd/unix.h>
 #include <ctcp/socket.h>
 #include <ctcp/select.h>
+#include <sys/uio.h>
 #include "relay_packet.h"
+#include "relay_pool.h"
 
 /*
  * Why do we have separate "socket" and "file-descriptor" implementations, when
@@ -23,16 +25,99 @@ extern size_t relay_client_mtu;
 
 struct relay_client_adapter;
 
+/* Maximum number of packets gathered by a batch before it is sent */
+#define RELAY_CLIENT_BATCH_MAX 512
+
+struct relay_client_batch_entry {
+	struct relay_packet_serial_hdr hdr;
+	const void *data;
+	size_t length;
+};
+
+/* Packets gathered between batch_begin and flush (payloads are not copied) */
+struct relay_client_batch {
+	bool active;
+	size_t count;
+	struct relay_client_batch_entry *entries;
+	struct iovec *iov;
+};
+
+/* Byte buffer, used for buffered receive and for pending non-blocking output */
+struct relay_client_buffer {
+	char *buf;
+	size_t size;
+	/* Unconsumed data is buf[head..tail) */
+	size_t head;
+	size_t tail;
+};
+
+/*
+ * Log-linear latency histogram: each power of two is split into four
+ * sub-buckets, bucket b counts latencies (in nanoseconds) from
+ * relay_client_histogram_bucket_min(b) up to the next bucket's minimum.
+ */
+#define RELAY_CLIENT_HIST_SUB_BITS 2
+#define RELAY_CLIENT_HIST_BUCKETS (64 << RELAY_CLIENT_HIST_SUB_BITS)
+
+struct relay_client_histogram {
+	uint64_t count[RELAY_CLIENT_HIST_BUCKETS];
+};
+
+/* I/O counters, updated with relaxed atomics */
+struct relay_client_stats {
+	/* Whole packets sent/received and their serialised size (a fragmented message counts once) */
+	uint64_t packets_sent;
+	uint64_t bytes_sent;
+	uint64_t packets_received;
+	uint64_t bytes_received;
+	/* Syscalls made by the fd/socket adapters */
+	uint64_t write_calls;
+	uint64_t read_calls;
+	/* Syscalls which failed with EAGAIN */
+	uint64_t eagain;
+	/* Times a blocking call had to poll for readiness, and the time spent */
+	uint64_t poll_waits;
+	uint64_t blocked_ns;
+	/* Duration of each send/flush call, and of each receive which returned a packet */
+	struct relay_client_histogram send_latency;
+	struct relay_client_histogram recv_latency;
+};
+
+/* Maximum number of partly reassembled messages kept, the oldest is dropped */
+#define RELAY_CLIENT_PARTIALS_MAX 16
+
+struct relay_client_partial;
+
 struct relay_client {
 	/* Name of this endpoint */
 	char local[RELAY_ENDPOINT_LENGTH + 1];
 	/* Buffer for receiving packet header */
 	bool has_header;
 	struct relay_packet_serial_hdr hdr;
+	/* Non-blocking receive progress: header bytes, then partial packet */
+	size_t hdr_done;
+	char *rx_block;
+	size_t rx_done;
 	/* MTU (packet size limit) for this client */
 	size_t mtu;
 	/* Error state */
 	int failed;
+	/* Batched send state */
+	struct relay_client_batch batch;
+	/* Optional receive buffer */
+	struct relay_client_buffer rx;
+	/* Output left over from partial non-blocking sends */
+	struct relay_client_buffer tx;
+	/* Optional pool for packets from the recv_pooled functions */
+	struct relay_pool *pool;
+	/* Optional I/O counters, NULL unless enabled */
+	struct relay_client_stats *stats;
+	/* Payloads larger than this are sent fragmented (zero to never fragment) */
+	size_t fragment_size;
+	uint32_t fragment_id;
+	/* Incoming fragments are reassembled unless this is set */
+	bool no_reassembly;
+	struct relay_client_partial *partials;
 	/* Polymorphism (adapter class + adapter instance data) */
 	const struct relay_client_adapter *adapter;
 	void *data;
@@ -44,22 +129,50 @@ struct relay_client {
 enum rca_recv_result {
 	rcarr_success = 0,
 	rcarr_fail = 1,
-	rcarr_eof = 2
+	rcarr_eof = 2,
+	/* Non-blocking operation could not complete without waiting */
+	rcarr_again = 3
 };
 
 typedef bool relay_client_adapter_init(struct relay_client *self, const void *initargs);
 typedef void relay_client_adapter_destroy(struct relay_client *self);
 typedef bool relay_client_adapter_send(struct relay_client *self, const void *buf, size_t length);
+typedef bool relay_client_adapter_sendv(struct relay_client *self, const struct iovec *iov, size_t iovcnt);
 typedef enum rca_recv_result relay_client_adapter_recv(struct relay_client *self, void *buf, size_t length);
+typedef enum rca_recv_result relay_client_adapter_recv_some(struct relay_client *self, void *buf, size_t length, size_t *received);
+typedef enum rca_recv_result relay_client_adapter_try_recv(struct relay_client *self, void *buf, size_t length, size_t *received);
+typedef enum rca_recv_result relay_client_adapter_try_sendv(struct relay_client *self, const struct iovec *iov, size_t iovcnt, size_t *sent);
+typedef int relay_client_adapter_get_fd(struct relay_client *self);
+typedef int relay_client_adapter_get_send_fd(struct relay_client *self, short *events);
+typedef bool relay_client_adapter_cork(struct relay_client *self, bool cork);
+typedef bool relay_client_adapter_sync(struct relay_client *self);
 
 struct relay_client_adapter {
 	relay_client_adapter_init *init;
 	relay_client_adapter_destroy *destroy;
 	relay_client_adapter_send *send;
 	relay_client_adapter_recv *recv;
+	/* Optional scatter/gather send, falls back to one send per iovec */
+	relay_client_adapter_sendv *sendv;
+	/* Optional, receive at least one and up to length bytes */
+	relay_client_adapter_recv_some *recv_some;
+	/* Optional, non-blocking partial receive/send (rcarr_again if nothing moved) */
+	relay_client_adapter_try_recv *try_recv;
+	relay_client_adapter_try_sendv *try_sendv;
+	/* Optional, file descriptor to wait on for readiness */
+	relay_client_adapter_get_fd *get_fd;
+	/* Optional, descriptor and events to wait on for send space, if not POLLOUT on get_fd */
+	relay_client_adapter_get_send_fd *get_send_fd;
+	/* Optional, hold back partial frames while a batch is being sent */
+	relay_client_adapter_cork *cork;
+	/* Optional, flush data through to the underlying device */
+	relay_client_adapter_sync *sync;
 	size_t instdata_size;
 };
 
+/* For adapters: performs the AUTH handshake once the adapter can send/receive */
+bool relay_client_authenticate(struct relay_client *self);
+
 /* Fail bits */
 
 #define RCF_INIT 1
@@ -90,15 +203,86 @@ bool relay_client_send_text(struct relay_client *self, const char *type, const c
 /* Constructs a packet from the given type/endpoint/data and sends it */
 bool relay_client_send_packet(struct relay_client *self, const char *type, const char *remote, const void *data, const size_t length);
 
-/* Serialises a packet and sends it (sender name in packet is not altered) */
+/*
+ * Serialises a packet header and sends it along with the payload (sender name
+ * in packet is not altered).  The payload is not copied.
+ */
 bool relay_client_send_packet2(struct relay_client *self, const struct relay_packet *packet);
 
 /* Sends a serialised packet (sender name in packet is not altered) */
 bool relay_client_send_packet3(struct relay_client *self, const struct relay_packet_serial *packet, size_t total_length);
 
+/*
+ * For repeated sends to the same target: make a template once (local name is
+ * taken from the client), then each send only fills in the length.  A
+ * template is not modified by sending, so threads may share one.
+ */
+void relay_client_make_template(struct relay_client *self, struct relay_header_template *tpl, const char *type, const char *remote);
+bool relay_client_send_template(struct relay_client *self, const struct relay_header_template *tpl, const void *data, size_t length);
+
+/*
+ * Sends length bytes of file "fd" from "offset" as the payload of one packet.
+ * On fd/socket transports the payload goes by sendfile, otherwise (or where
+ * the file cannot be spliced) from a read-only mapping, so it is never copied
+ * through user-space buffers.  The file offset of fd is not changed.
+ */
+bool relay_client_send_file(struct relay_client *self, const struct relay_header_template *tpl, int fd, off_t offset, size_t length);
+
+
+/*
+ * Fragmentation (see RELAY_FRAGMENT_TYPE in relay_packet.h).
+ *
+ * Once a fragment size is set, send_packet/send_packet2/send_packet3,
+ * send_template and send_file split payloads larger than it into fragments, so that a large
+ * message does not hold up other traffic through the server for as long.
+ * Batched and non-blocking sends are never fragmented.  Only fragment
+ * messages to clients that reassemble them.
+ *
+ * Receiving clients reassemble fragments by default and return only whole
+ * messages.  Reassembly needs the fragments of each message in order, as the
+ * server forwards them, and keeps up to RELAY_CLIENT_PARTIALS_MAX messages
+ * in progress.  Disable it to receive the fragments as ordinary packets, e.g.
+ * to forward them.
+ */
+#define RELAY_CLIENT_FRAGMENT_SIZE_DEFAULT (64 << 10)
+
+void relay_client_set_fragment_size(struct relay_client *self, size_t size);
+void relay_client_set_reassembly(struct relay_client *self, bool enable);
+
+/*
+ * Batched sending.
+ *
+ * Packets appended between batch_begin and flush are gathered and sent with as
+ * few writes as possible (socket transports are corked meanwhile).  Payloads
+ * are not copied, so they must remain valid until flush returns.  Append sends
+ * the batch early once RELAY_CLIENT_BATCH_MAX packets are queued, and the
+ * other send functions send any queued packets first so ordering is kept.
+ */
+bool relay_client_batch_begin(struct relay_client *self);
+bool relay_client_batch_append(struct relay_client *self, const char *type, const char *remote, const void *data, const size_t length);
+bool relay_client_batch_append2(struct relay_client *self, const struct relay_packet *packet);
+bool relay_client_batch_append3(struct relay_client *self, const struct relay_packet_serial *packet);
+
+/*
+ * Sends any batched packets, ends the batch, then syncs the underlying
+ * transport.  Sends are not synced individually, call this when it matters.
+ */
+bool relay_client_flush(struct relay_client *self);
+
 
 /* Various ways to receive a packet */
 
+/*
+ * Enables a receive buffer of the given size (or disables it if size is zero).
+ *
+ * Reads from the adapter are then made in chunks of up to this size and as
+ * many packets as the chunk holds are parsed out of it without further
+ * reads.  Payloads too large for the buffer are read directly.  Requires
+ * adapter support for recv_some, returns false if the adapter lacks it or if
+ * disabling the buffer would discard data already received.
+ */
+bool relay_client_set_recv_buffer(struct relay_client *self, size_t size);
+
 /*
  * Receives a packet.
  *
@@ -109,6 +293,81 @@ bool relay_client_send_packet3(struct relay_client *self, const struct relay_pac
 bool relay_client_recv_packet(struct relay_client *self, struct relay_packet **out);
 bool relay_client_recv_serialised_packet(struct relay_client *self, struct relay_packet_serial **out);
 
+/*
+ * Creates a packet buffer pool owned by this client, used by the recv_pooled
+ * functions.  Every pooled packet must be released before the client is
+ * destroyed.
+ */
+bool relay_client_enable_pool(struct relay_client *self);
+
+/*
+ * As recv_packet/recv_serialised_packet, but packets must be returned with
+ * relay_client_release_packet instead of free.  Without a pool these still
+ * work, falling back to malloc.
+ */
+bool relay_client_recv_pooled_packet(struct relay_client *self, struct relay_packet **out);
+bool relay_client_recv_pooled_serialised_packet(struct relay_client *self, struct relay_packet_serial **out);
+
+/* Returns a packet from one of the recv_pooled functions (NULL is ignored) */
+void relay_client_release_packet(struct relay_client *self, void *packet);
+
+/* Pool hit/miss counters, zeroed if the client has no pool */
+void relay_client_get_pool_stats(struct relay_client *self, struct relay_pool_stats *out);
+
+/*
+ * Starts collecting I/O counters and latency histograms for this client.
+ *
+ * Call before the client is shared with other threads.  Afterwards
+ * get_stats may be called from any thread, e.g. by a monitoring thread, while
+ * the client is in use.  Syscall, EAGAIN and poll counters are only kept by
+ * the fd and socket adapters.
+ */
+bool relay_client_enable_stats(struct relay_client *self);
+
+/* Snapshot of the counters, zeroed if stats are not enabled */
+void relay_client_get_stats(struct relay_client *self, struct relay_client_stats *out);
+
+/* Histogram helpers: smallest latency counted by a bucket, and percentile (0-100) */
+uint64_t relay_client_histogram_bucket_min(size_t bucket);
+uint64_t relay_client_histogram_percentile(const struct relay_client_histogram *hist, double percentile);
+
+/*
+ * Non-blocking operation, for use from an application's own event loop.
+ *
+ * try_recv (and try_recv_serialised_packet) returns rcarr_success with a
+ * packet (free it with free), or
+ * rcarr_again if no complete packet is available yet, in which case the
+ * progress made so far is kept in the client.  Keep calling it until it
+ * returns rcarr_again before waiting on the fd again, as complete packets may
+ * already be buffered in the client.  Once try_recv has returned rcarr_again,
+ * finish that packet with try_recv rather than the blocking functions.
+ *
+ * try_send returns rcarr_success once the packet has been accepted: anything
+ * the transport would not take immediately is copied into the client and
+ * written by later try_send/try_flush calls (or first by any blocking send).
+ * It returns rcarr_again without accepting the packet while earlier output is
+ * still pending.  try_flush returns rcarr_success once nothing is pending.
+ *
+ * For non-socket file descriptors, the descriptor must be set to O_NONBLOCK.
+ */
+enum rca_recv_result relay_client_try_recv(struct relay_client *self, struct relay_packet **out);
+enum rca_recv_result relay_client_try_recv_serialised_packet(struct relay_client *self, struct relay_packet_serial **out);
+enum rca_recv_result relay_client_try_send(struct relay_client *self, const struct relay_packet *packet);
+enum rca_recv_result relay_client_try_flush(struct relay_client *self);
+
+/* File descriptor to wait on, or -1 if the adapter does not provide one */
+int relay_client_get_fd(struct relay_client *self);
+
+/* Poll events the client is waiting for: POLLIN, plus POLLOUT while output is pending */
+short relay_client_poll_events(struct relay_client *self);
+
+/*
+ * File descriptor to wait on while output is pending, with the events to wait
+ * for in *events.  Usually get_fd and POLLOUT, but adapters which signal space
+ * differently (e.g. shared memory) return their own.
+ */
+int relay_client_get_send_fd(struct relay_client *self, short *events);
+
 /*
  * Uses recv_packet, explodes packet - any of type/endpoint/buf may be NULL.
  *
@@ -6,12 +6,84 @@
 /* Bit 30 instead of 31 for interop with JavaScript/Java */
 #define FOREIGN_BIT (1UL << 30)
 
+/* Fill a fixed-width header field, zero-padded (NULL gives an empty field) */
+static void fill_field(char *out, const char *in, size_t size)
+{
+	if (in) {
+		strncpy(out, in, size);
+	} else {
+		memset(out, 0, size);
+	}
+}
+
 struct relay_packet_serial *relay_make_serialised_packet(const char *type, const char *remote, const char *local, const char *data, ssize_t length, size_t *out_size)
 {
-	/* TODO: Optimised version which builds relay_packet_serial directly */
-	struct relay_packet packet;
-	relay_make_packet(&packet, type, remote, local, (char *) data, length);
-	return relay_serialise_packet(NULL, &packet, out_size);
+	if (length < 0) {
+		length = data == NULL ? 0 : strlen(data);
+	}
+	size_t out_len = relay_serialised_packet_size(length);
+	struct relay_packet_serial *out = malloc(out_len);
+	if (!out) {
+		return NULL;
+	}
+	struct relay_header_template tpl;
+	relay_header_template_init(&tpl, type, remote, local);
+	relay_header_template_apply(&tpl, &out->header, length);
+	if (length) {
+		memcpy(out->data, data, length);
+	}
+	*out_size = out_len;
+	return out;
+}
+
+void relay_header_template_init(struct relay_header_template *tpl, const char *type, const char *remote, const char *local)
+{
+	fill_field(tpl->header.type, type, RELAY_TYPE_LENGTH);
+	fill_field(tpl->header.remote, remote, RELAY_ENDPOINT_LENGTH);
+	fill_field(tpl->header.local, local, RELAY_ENDPOINT_LENGTH);
+	tpl->header.length = 0;
+}
+
+void relay_header_template_apply(const struct relay_header_template *tpl, struct relay_packet_serial_hdr *out, size_t length)
+{
+	*out = tpl->header;
+	out->length = htonl(length);
+}
+
+void relay_fragmenter_init(struct relay_fragmenter *it, const struct relay_packet_serial_hdr *hdr, uint32_t id, const void *data, size_t fragment_size)
+{
+	it->hdr = *hdr;
+	memcpy(it->hdr.type, RELAY_FRAGMENT_TYPE, RELAY_TYPE_LENGTH);
+	memcpy(it->frag.type, hdr->type, RELAY_TYPE_LENGTH);
+	it->length = relay_serialised_packet_data_length(hdr);
+	it->frag.id = htonl(id);
+	it->frag.total_length = htonl(it->length);
+	it->data = data;
+	it->fragment_size = fragment_size;
+	it->offset = 0;
+}
+
+size_t relay_fragmenter_next(struct relay_fragmenter *it, struct iovec iov[3])
+{
+	if (it->offset >= it->length) {
+		return 0;
+	}
+	size_t chunk = it->length - it->offset;
+	if (chunk > it->fragment_size) {
+		chunk = it->fragment_size;
+	}
+	relay_serialised_packet_set_data_length(&it->hdr, sizeof(it->frag) + chunk);
+	it->frag.offset = htonl(it->offset);
+	iov[0] = (struct iovec) { .iov_base = &it->hdr, .iov_len = sizeof(it->hdr) };
+	iov[1] = (struct iovec) { .iov_base = &it->frag, .iov_len = sizeof(it->frag) };
+	iov[2] = (struct iovec) { .iov_base = (void *) (it->data + it->offset), .iov_len = chunk };
+	it->offset += chunk;
+	return 3;
+}
+
+bool relay_is_fragment(const struct relay_packet_serial_hdr *hdr)
+{
+	return memcmp(hdr->type, RELAY_FRAGMENT_TYPE, RELAY_TYPE_LENGTH) == 0;
 }
 
 void relay_make_packet(struct relay_packet *out, const char *type, const char *remote, const char *local, char *data, ssize_t length)
@@ -45,6 +117,26 @@ size_t relay_serialised_packet_size(size_t in_size)
 	return sizeof(struct relay_packet_serial_hdr) + in_size;
 }
 
+size_t relay_serialised_packet_data_length(const struct relay_packet_serial_hdr *hdr)
+{
+	return ntohl(hdr->length) & ~FOREIGN_BIT;
+}
+
+void relay_serialised_packet_set_data_length(struct relay_packet_serial_hdr *hdr, size_t length)
+{
+	hdr->length = htonl(length | (ntohl(hdr->length) & FOREIGN_BIT));
+}
+
+void relay_serialise_packet_header(struct relay_packet_serial_hdr *out, const struct relay_packet *in)
+{
+	strncpy(out->type, in->type, RELAY_TYPE_LENGTH);
+	strncpy(out->remote, in->remote, RELAY_ENDPOINT_LENGTH);
+	strncpy(out->local, in->local, RELAY_ENDPOINT_LENGTH);
+
+	size_t lenfield = in->length | (in->foreign ? FOREIGN_BIT : 0);
+	out->length = htonl(lenfield);
+}
+
 struct relay_packet_serial *relay_serialise_packet(struct relay_packet_serial *out, const struct relay_packet *in, size_t *out_size)
 {
 	size_t out_len = relay_serialised_packet_size(in->length);
@@ -53,12 +145,7 @@ struct relay_packet_serial *relay_serialise_packet(struct relay_packet_serial *o
 		out = malloc(out_len);
 	}
 
-	strncpy(out->header.type, in->type, RELAY_TYPE_LENGTH);
-	strncpy(out->header.remote, in->remote, RELAY_ENDPOINT_LENGTH);
-	strncpy(out->header.local, in->local, RELAY_ENDPOINT_LENGTH);
-
-	size_t lenfield = in->length | (in->foreign ? FOREIGN_BIT : 0);
-	out->header.length = htonl(lenfield);
+	relay_serialise_packet_header(&out->header, in);
 	memcpy(out+1, in->data, in->length);
 	*out_size = out_len;
 
@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 #define RELAY_TYPE_LENGTH 4
 #define RELAY_ENDPOINT_LENGTH 16
@@ -31,6 +32,62 @@ struct __attribute__((__packed__)) relay_packet_serial {
 	char data[];
 };
 
+/*
+ * Pre-serialised header for sending many packets with the same type and
+ * endpoints: the fields are padded once, and each packet only needs its
+ * length filled in.
+ */
+struct relay_header_template {
+	struct relay_packet_serial_hdr header;
+};
+
+void relay_header_template_init(struct relay_header_template *tpl, const char *type, const char *remote, const char *local);
+void relay_header_template_apply(const struct relay_header_template *tpl, struct relay_packet_serial_hdr *out, size_t length);
+
+/*
+ * Fragmentation (see PROTOCOL.md): a large message is sent as packets of the
+ * reserved type RELAY_FRAGMENT_TYPE, with the same endpoints as the message.
+ * Each fragment's payload is a relay_fragment_hdr followed by the slice of the
+ * message payload starting at "offset".  Fragments of one message are sent in
+ * order, fragments of different messages may be interleaved.
+ */
+#define RELAY_FRAGMENT_TYPE "FRAG"
+
+/* Wire-format, integers are big-endian */
+struct __attribute__((__packed__)) relay_fragment_hdr {
+	/* Type of the original message */
+	char type[RELAY_TYPE_LENGTH];
+	/* Identifies the message among those in flight from the same sender */
+	uint32_t id;
+	/* Length of the original message payload */
+	uint32_t total_length;
+	/* Offset of this fragment within that payload */
+	uint32_t offset;
+};
+
+/* Splits one message into fragments, the payload is not copied */
+struct relay_fragmenter {
+	struct relay_packet_serial_hdr hdr;
+	struct relay_fragment_hdr frag;
+	const char *data;
+	size_t length;
+	size_t fragment_size;
+	size_t offset;
+};
+
+/* "hdr" is the header the message would have been sent with unfragmented */
+void relay_fragmenter_init(struct relay_fragmenter *it, const struct relay_packet_serial_hdr *hdr, uint32_t id, const void *data, size_t fragment_size);
+
+/*
+ * Fills iov with the next fragment (outer header, fragment header, payload
+ * slice) and returns the iovec count, or zero once the message is done.  The
+ * headers live in the fragmenter, so send each fragment before the next call.
+ */
+size_t relay_fragmenter_next(struct relay_fragmenter *it, struct iovec iov[3]);
+
+/* True if a serialised header is that of a fragment */
+bool relay_is_fragment(const struct relay_packet_serial_hdr *hdr);
+
 /* Serialise data (relay_make_packet+relay_serialise_packet) */
 struct relay_packet_serial *relay_make_serialised_packet(const char *type, const char *remote, const char *local, const char *data, ssize_t length, size_t *out_size);
 
@@ -44,6 +101,15 @@ size_t relay_explode_serialised_packet(struct relay_packet_serial *packet, char
 /* Number of bytes required for serialised packet */
 size_t relay_serialised_packet_size(size_t in_size);
 
+/* Payload length from a serialised header (excluding flags) */
+size_t relay_serialised_packet_data_length(const struct relay_packet_serial_hdr *hdr);
+
+/* Set the payload length in a serialised header, keeping its flags */
+void relay_serialised_packet_set_data_length(struct relay_packet_serial_hdr *hdr, size_t length);
+
+/* Serialise only the header of a packet (payload is not touched) */
+void relay_serialise_packet_header(struct relay_packet_serial_hdr *out, const struct relay_packet *in);
+
 /* If out is NULL, mallocs serialised packet.  In either case, original can be freed after */
 struct relay_packet_serial *relay_serialise_packet(struct relay_packet_serial *out, const struct relay_packet *in, size_t *out_size);
 
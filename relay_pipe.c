@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <cstd/std.h>
 #include <cstd/unix.h>
 #include <sys/eventfd.h>
@@ -7,6 +8,475 @@
 #define max2(a,b) ((a)>(b)?(a):(b))
 #define max3(a,b,c) max2((a),max2((b),(c)))
 
+/* Input receive buffer, so draining a pipe does not cost a read per packet */
+#define PIPE_RECV_BUFFER 65536
+
+/* Pass a batch of packets through the tap(s) and forward those accepted in one write, then free them */
+static bool pipe_forward(struct relay_pipe *inst, struct relay_packet **packets, size_t count)
+{
+	uint64_t keep = 0;
+	if (inst->batch_tap) {
+		keep = inst->batch_tap(packets, count, inst->misc);
+	} else {
+		for (size_t i = 0; i < count; i++) {
+			if (!inst->tap || inst->tap(&packets[i], inst->misc)) {
+				keep |= UINT64_C(1) << i;
+			}
+		}
+	}
+	bool ok = true;
+	if (keep) {
+		ok = relay_client_batch_begin(&inst->writer);
+		for (size_t i = 0; ok && i < count; i++) {
+			if (keep & (UINT64_C(1) << i)) {
+				ok = relay_client_batch_append2(&inst->writer, packets[i]);
+			}
+		}
+		ok = relay_client_flush(&inst->writer) && ok;
+		if (!ok) {
+			inst->failed |= RPI_THREAD_FAILED;
+		}
+	}
+	log_debug("Pipe accepted %d of %zu packets", __builtin_popcountll(keep), count);
+	for (size_t i = 0; i < count; i++) {
+		free(packets[i]);
+	}
+	return ok;
+}
+
+/*
+ * Forward readable packets in batches until the input would block, or until
+ * max_batches have been sent.  Returns rcarr_success if there may be more.
+ */
+static enum rca_recv_result pipe_drain(struct relay_pipe *inst, size_t max_batches)
+{
+	for (size_t batch = 0; batch < max_batches; batch++) {
+		struct relay_packet *packets[RELAY_PIPE_BATCH_MAX];
+		size_t count = 0;
+		enum rca_recv_result res;
+		while ((res = relay_client_try_recv(&inst->reader, &packets[count])) == rcarr_success) {
+			if (++count == RELAY_PIPE_BATCH_MAX) {
+				break;
+			}
+		}
+		if (count && !pipe_forward(inst, packets, count)) {
+			return rcarr_fail;
+		}
+		if (res == rcarr_eof) {
+			log_debug("Pipe input closed");
+		} else if (res == rcarr_fail) {
+			log_debug("Pipe failed to receive packet");
+		}
+		if (res != rcarr_success) {
+			return res;
+		}
+	}
+	return rcarr_success;
+}
+
+/* Largest amount moved per splice, and the kernel pipe size requested */
+#define SPLICE_CHUNK (1 << 20)
+
+/* Forward serialised packets until the input would block, false once the pipe has finished */
+static bool pipe_pass(struct relay_pipe *inst)
+{
+	while (true) {
+		struct relay_packet_serial *packets[RELAY_PIPE_BATCH_MAX];
+		size_t count = 0;
+		enum rca_recv_result res;
+		while ((res = relay_client_try_recv_serialised_packet(&inst->reader, &packets[count])) == rcarr_success) {
+			if (++count == RELAY_PIPE_BATCH_MAX) {
+				break;
+			}
+		}
+		if (count) {
+			bool ok = relay_client_batch_begin(&inst->writer);
+			for (size_t i = 0; i < count; i++) {
+				if (!inst->header_tap || inst->header_tap(&packets[i]->header, inst->misc)) {
+					ok = ok && relay_client_batch_append3(&inst->writer, packets[i]);
+				}
+			}
+			ok = relay_client_flush(&inst->writer) && ok;
+			for (size_t i = 0; i < count; i++) {
+				free(packets[i]);
+			}
+			if (!ok) {
+				inst->failed |= RPI_THREAD_FAILED;
+				return false;
+			}
+		}
+		if (res != rcarr_success) {
+			return res == rcarr_again;
+		}
+	}
+}
+
+/* Copy bytes out of the kernel pipe with read/write, for outputs which splice() refuses */
+static bool pipe_copy_out(struct relay_pipe *inst, size_t bytes)
+{
+	char buf[PIPE_RECV_BUFFER];
+	while (bytes > 0) {
+		ssize_t got = read(inst->splice[0], buf, bytes < sizeof(buf) ? bytes : sizeof(buf));
+		if (got == -1 && errno == EINTR) {
+			continue;
+		} else if (got <= 0) {
+			log_debug("Pipe failed to read from splice pipe (%d)", errno);
+			inst->failed |= RPI_THREAD_FAILED;
+			return false;
+		}
+		bytes -= got;
+		for (ssize_t done = 0; done < got; ) {
+			ssize_t wrote = write(inst->fd_out, buf + done, got - done);
+			if (wrote == -1 && (errno == EAGAIN || errno == EINTR)) {
+				struct pollfd pfd = { .fd = inst->fd_out, .events = POLLOUT };
+				poll(&pfd, 1, -1);
+				continue;
+			} else if (wrote <= 0) {
+				log_debug("Pipe failed to write output (%d)", errno);
+				inst->failed |= RPI_THREAD_FAILED;
+				return false;
+			}
+			done += wrote;
+		}
+	}
+	return true;
+}
+
+/* Move whatever is readable on the input to the output, false once the pipe has finished */
+static bool pipe_splice(struct relay_pipe *inst)
+{
+	ssize_t bytes = splice(inst->fd_in, NULL, inst->splice[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (bytes == 0) {
+		return false;
+	} else if (bytes == -1) {
+		if (errno == EAGAIN || errno == EINTR) {
+			return true;
+		}
+		if (!inst->spliced && (errno == EINVAL || errno == ENOSYS)) {
+			/* Nothing has been consumed yet, so the stream is still at a packet boundary */
+			log_debug("Pipe cannot splice, falling back to copying");
+			close(inst->splice[0]);
+			close(inst->splice[1]);
+			inst->splice[0] = inst->splice[1] = -1;
+			if (!relay_client_set_recv_buffer(&inst->reader, PIPE_RECV_BUFFER)) {
+				inst->failed |= RPI_THREAD_FAILED;
+				return false;
+			}
+			return pipe_pass(inst);
+		}
+		log_debug("Pipe failed to splice input (%d)", errno);
+		return false;
+	}
+	inst->spliced = true;
+	while (bytes > 0) {
+		if (inst->copy_out) {
+			return pipe_copy_out(inst, bytes);
+		}
+		ssize_t moved = splice(inst->splice[0], NULL, inst->fd_out, NULL, bytes, SPLICE_F_MOVE);
+		if (moved == -1 && (errno == EAGAIN || errno == EINTR)) {
+			struct pollfd pfd = { .fd = inst->fd_out, .events = POLLOUT };
+			poll(&pfd, 1, -1);
+			continue;
+		} else if (moved == -1 && (errno == EINVAL || errno == ENOSYS)) {
+			/* The input has already gone into the kernel pipe, so keep splicing in and copy out */
+			log_debug("Pipe cannot splice to output, copying out of the splice pipe");
+			inst->copy_out = true;
+			continue;
+		} else if (moved <= 0) {
+			inst->failed |= RPI_THREAD_FAILED;
+			return false;
+		}
+		bytes -= moved;
+	}
+	return true;
+}
+
+/* Pipeline */
+
+/* Polls of a queue before going to sleep on its eventfd */
+#define QUEUE_SPIN_LIMIT 100
+
+static bool queue_init(struct relay_pipe_queue *queue, const struct relay_pipe_pipeline *config)
+{
+	memset(queue, 0, sizeof(*queue));
+	queue->size = 1;
+	while (queue->size < config->depth) {
+		queue->size <<= 1;
+	}
+	queue->overflow = config->overflow;
+	queue->slots = calloc(queue->size, sizeof(*queue->slots));
+	queue->fd_space = eventfd(0, EFD_NONBLOCK);
+	queue->fd_data = eventfd(0, EFD_NONBLOCK);
+	return queue->slots && queue->fd_space != -1 && queue->fd_data != -1;
+}
+
+static void queue_destroy(struct relay_pipe_queue *queue)
+{
+	struct relay_packet *packet;
+	for (uint64_t i = queue->tail; i != queue->head; i++) {
+		packet = queue->slots[i & (queue->size - 1)];
+		free(packet);
+	}
+	free(queue->slots);
+	queue->slots = NULL;
+	if (queue->fd_space != -1) {
+		close(queue->fd_space);
+	}
+	if (queue->fd_data != -1) {
+		close(queue->fd_data);
+	}
+}
+
+size_t relay_pipe_queue_length(const struct relay_pipe_queue *queue)
+{
+	uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+	return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+static void queue_signal(int fd)
+{
+	uint64_t n = 1;
+	if (write(fd, &n, sizeof(n))) {
+	}
+}
+
+/* Wake the other side if it has said that it is sleeping */
+static void queue_wake(uint32_t *waiting, int fd)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+		__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+		queue_signal(fd);
+	}
+}
+
+static bool queue_has_space(struct relay_pipe_queue *queue)
+{
+	return relay_pipe_queue_length(queue) < queue->size || __atomic_load_n(&queue->stopping, __ATOMIC_ACQUIRE);
+}
+
+static bool queue_has_data(struct relay_pipe_queue *queue)
+{
+	return relay_pipe_queue_length(queue) > 0 || __atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE) || __atomic_load_n(&queue->stopping, __ATOMIC_ACQUIRE);
+}
+
+/* Spin, then flag that we are sleeping, re-check and sleep until ready() */
+static void queue_wait(struct relay_pipe_queue *queue, bool (*ready)(struct relay_pipe_queue *), uint32_t *waiting, int fd)
+{
+	for (int i = 0; i < QUEUE_SPIN_LIMIT; i++) {
+		if (ready(queue)) {
+			return;
+		}
+	}
+	while (!ready(queue)) {
+		__atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (ready(queue)) {
+			break;
+		}
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		poll(&pfd, 1, -1);
+		uint64_t n;
+		if (read(fd, &n, sizeof(n))) {
+		}
+	}
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
+
+/* Takes ownership of the packet, false if the pipe is stopping */
+static bool queue_push(struct relay_pipe_queue *queue, struct relay_packet *packet)
+{
+	const uint64_t head = queue->head;
+	while (true) {
+		uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&queue->stopping, __ATOMIC_ACQUIRE)) {
+			free(packet);
+			return false;
+		}
+		if (head - tail < queue->size) {
+			break;
+		}
+		if (queue->overflow == rpo_drop_newest) {
+			__atomic_fetch_add(&queue->dropped, 1, __ATOMIC_RELAXED);
+			free(packet);
+			return true;
+		} else if (queue->overflow == rpo_drop_oldest) {
+			/* Claim the oldest packet from under the consumer */
+			struct relay_packet *oldest = __atomic_load_n(&queue->slots[tail & (queue->size - 1)], __ATOMIC_RELAXED);
+			if (__atomic_compare_exchange_n(&queue->tail, &tail, tail + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				__atomic_fetch_add(&queue->dropped, 1, __ATOMIC_RELAXED);
+				free(oldest);
+			}
+		} else {
+			queue_wait(queue, queue_has_space, &queue->producer_waiting, queue->fd_space);
+		}
+	}
+	__atomic_store_n(&queue->slots[head & (queue->size - 1)], packet, __ATOMIC_RELAXED);
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+	queue_wake(&queue->consumer_waiting, queue->fd_data);
+	return true;
+}
+
+/* Returns NULL once the queue is closed and empty (or stopping), or if empty and not waiting */
+static struct relay_packet *queue_pop(struct relay_pipe_queue *queue, bool wait)
+{
+	while (true) {
+		if (__atomic_load_n(&queue->stopping, __ATOMIC_ACQUIRE)) {
+			return NULL;
+		}
+		uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+		if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+			/* Not dereferenced unless the claim succeeds, as the producer may drop it */
+			struct relay_packet *packet = __atomic_load_n(&queue->slots[tail & (queue->size - 1)], __ATOMIC_RELAXED);
+			if (__atomic_compare_exchange_n(&queue->tail, &tail, tail + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				queue_wake(&queue->producer_waiting, queue->fd_space);
+				return packet;
+			}
+			continue;
+		}
+		if (__atomic_load_n(&queue->closed, __ATOMIC_ACQUIRE)) {
+			/* Check for packets pushed just before closing */
+			if (relay_pipe_queue_length(queue) > 0) {
+				continue;
+			}
+			return NULL;
+		}
+		if (!wait) {
+			return NULL;
+		}
+		queue_wait(queue, queue_has_data, &queue->consumer_waiting, queue->fd_data);
+	}
+}
+
+static void queue_close(struct relay_pipe_queue *queue, bool stop)
+{
+	__atomic_store_n(stop ? &queue->stopping : &queue->closed, true, __ATOMIC_RELEASE);
+	queue_signal(queue->fd_data);
+	queue_signal(queue->fd_space);
+}
+
+/* Reader stage: queue readable packets, false once input has finished */
+static bool pipeline_read(struct relay_pipe *inst)
+{
+	while (true) {
+		struct relay_packet *packet;
+		switch (relay_client_try_recv(&inst->reader, &packet)) {
+		case rcarr_success:
+			if (!queue_push(&inst->queue[0], packet)) {
+				return false;
+			}
+			break;
+		case rcarr_again:
+			return true;
+		case rcarr_eof:
+			log_debug("Pipe input closed");
+			return false;
+		default:
+			log_debug("Pipe failed to receive packet");
+			return false;
+		}
+	}
+}
+
+static void *pipeline_tap_thread(struct relay_pipe *inst)
+{
+	struct relay_packet *packet;
+	while ((packet = queue_pop(&inst->queue[0], true))) {
+		if (!inst->tap(&packet, inst->misc)) {
+			free(packet);
+		} else if (!queue_push(&inst->queue[1], packet)) {
+			break;
+		}
+	}
+	queue_close(&inst->queue[1], false);
+	return NULL;
+}
+
+static void *pipeline_send_thread(struct relay_pipe *inst)
+{
+	struct relay_pipe_queue *queue = &inst->queue[inst->nqueues - 1];
+	struct relay_packet *packets[RELAY_PIPE_BATCH_MAX];
+	while ((packets[0] = queue_pop(queue, true))) {
+		/* Write whatever else is already queued along with it */
+		size_t count = 1;
+		while (count < RELAY_PIPE_BATCH_MAX && (packets[count] = queue_pop(queue, false))) {
+			count++;
+		}
+		bool ok = relay_client_batch_begin(&inst->writer);
+		for (size_t i = 0; i < count; i++) {
+			ok = ok && relay_client_batch_append2(&inst->writer, packets[i]);
+		}
+		ok = relay_client_flush(&inst->writer) && ok;
+		for (size_t i = 0; i < count; i++) {
+			free(packets[i]);
+		}
+		if (!ok) {
+			inst->failed |= RPI_THREAD_FAILED;
+			/* Release anything upstream which is waiting on us */
+			for (size_t i = 0; i < inst->nqueues; i++) {
+				queue_close(&inst->queue[i], true);
+			}
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Start the tap and writer stages, the reader runs on the pipe's own thread */
+static bool pipeline_start(struct relay_pipe *inst, const struct relay_pipe_pipeline *config)
+{
+	size_t nqueues = inst->tap ? 2 : 1;
+	for (inst->nqueues = 0; inst->nqueues < nqueues; inst->nqueues++) {
+		if (!queue_init(&inst->queue[inst->nqueues], config)) {
+			queue_destroy(&inst->queue[inst->nqueues]);
+			goto fail;
+		}
+	}
+	if (pthread_create(&inst->sender, NULL, (void*(*)(void*)) pipeline_send_thread, inst)) {
+		goto fail;
+	}
+	if (inst->tap && pthread_create(&inst->tapper, NULL, (void*(*)(void*)) pipeline_tap_thread, inst)) {
+		queue_close(&inst->queue[1], true);
+		pthread_join(inst->sender, NULL);
+		goto fail;
+	}
+	return true;
+fail:
+	for (size_t i = 0; i < inst->nqueues; i++) {
+		queue_destroy(&inst->queue[i]);
+	}
+	inst->nqueues = 0;
+	return false;
+}
+
+static void pipeline_stop(struct relay_pipe *inst)
+{
+	for (size_t i = 0; i < inst->nqueues; i++) {
+		queue_close(&inst->queue[i], true);
+	}
+	if (inst->tap) {
+		pthread_join(inst->tapper, NULL);
+	}
+	pthread_join(inst->sender, NULL);
+	for (size_t i = 0; i < inst->nqueues; i++) {
+		queue_destroy(&inst->queue[i]);
+	}
+	inst->nqueues = 0;
+}
+
+/* Serve one wakeup on a standalone pipe, false once the pipe has finished */
+static bool pipe_step(struct relay_pipe *inst)
+{
+	if (inst->forward) {
+		return inst->splice[0] != -1 ? pipe_splice(inst) : pipe_pass(inst);
+	}
+	if (inst->nqueues) {
+		return pipeline_read(inst);
+	}
+	enum rca_recv_result res = pipe_drain(inst, SIZE_MAX);
+	return res == rcarr_success || res == rcarr_again;
+}
+
 static void *pipe_thread(struct relay_pipe *inst)
 {
 	struct epoll_event epev[2];
@@ -22,7 +492,7 @@ static void *pipe_thread(struct relay_pipe *inst)
 		}
 
 		bool exiting = false;
-		for (size_t i = 0; i < sizeof(epev)/sizeof(epev[0]); i++) {
+		for (int i = 0; i < nfds; i++) {
 			if (epev[i].data.fd == inst->fd_end) {
 				log_debug("Pipe stopping due to exit signal");
 				exiting = true;
@@ -32,38 +502,50 @@ static void *pipe_thread(struct relay_pipe *inst)
 			break;
 		}
 
-		struct relay_packet *packet;
-		if (!relay_client_recv_packet(&inst->reader, &packet)) {
-			log_debug("Pipe failed to receive packet");
-			break;
-		}
-		if (!packet) {
+		if (!pipe_step(inst)) {
 			break;
 		}
-		if (!inst->tap || inst->tap(&packet, inst->misc)) {
-			log_debug("Pipe accepted a packet");
-			if (!relay_client_send_packet2(&inst->writer, packet)) {
-				inst->failed |= RPI_THREAD_FAILED;
-				break;
-			}
-		} else {
-			log_debug("Pipe rejected a packet");
-		}
-		free(packet);
+	}
+	if (inst->nqueues) {
+		/* Let the later stages finish what has been queued */
+		queue_close(&inst->queue[0], false);
 	}
 	log_debug("Pipe thread exited");
 
 	return NULL;
 }
 
-bool relay_pipe_init(struct relay_pipe *inst, int fd_in, int fd_out, bool owns, relay_pipe_tap *tap, void *misc)
+/* Make the input non-blocking, remembering its flags for relay_pipe_destroy */
+static bool pipe_set_nonblock(struct relay_pipe *inst)
+{
+	int flags = fcntl(inst->fd_in, F_GETFL);
+	if (flags == -1 || fcntl(inst->fd_in, F_SETFL, flags | O_NONBLOCK) == -1) {
+		return false;
+	}
+	inst->fd_in_flags = flags;
+	return true;
+}
+
+/* How a standalone pipe handles packets */
+struct pipe_mode {
+	bool forward;
+	relay_pipe_tap *tap;
+	relay_pipe_batch_tap *batch_tap;
+	relay_pipe_header_tap *header_tap;
+	const struct relay_pipe_pipeline *pipeline;
+};
+
+static bool pipe_init(struct relay_pipe *inst, int fd_in, int fd_out, bool owns, const struct pipe_mode *mode, void *misc)
 {
 	memset(inst, 0, sizeof(*inst));
 
 	inst->misc = misc;
+	inst->forward = mode->forward;
+	inst->splice[0] = inst->splice[1] = -1;
 
 	inst->fd_in = fd_in;
 	inst->fd_out = fd_out;
+	inst->fd_in_flags = -1;
 
 	inst->fd_end = eventfd(0, 0);
 	if (inst->fd_end == -1) {
@@ -88,11 +570,32 @@ bool relay_pipe_init(struct relay_pipe *inst, int fd_in, int fd_out, bool owns,
 		inst->failed |= RPI_OPEN_INPUT_FAILED;
 		goto fail;
 	}
+	/* Fragments are forwarded as they are */
+	relay_client_set_reassembly(&inst->reader, false);
 	if (!relay_client_init_fd(&inst->writer, NULL, fd_out, owns, false)) {
 		inst->failed |= RPI_OPEN_OUTPUT_FAILED;
 		goto fail;
 	}
-	inst->tap = tap;
+	inst->tap = mode->tap;
+	inst->batch_tap = mode->batch_tap;
+	inst->header_tap = mode->header_tap;
+
+	if (inst->forward && !inst->header_tap && pipe(inst->splice) == 0) {
+		/* Best effort: a larger pipe means fewer splices */
+		fcntl(inst->splice[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+	}
+
+	/* Drained with try_recv, or spliced without blocking */
+	if (!pipe_set_nonblock(inst) ||
+			(inst->splice[0] == -1 && !relay_client_set_recv_buffer(&inst->reader, PIPE_RECV_BUFFER))) {
+		inst->failed |= RPI_OPEN_INPUT_FAILED;
+		goto fail;
+	}
+
+	if (mode->pipeline && !pipeline_start(inst, mode->pipeline)) {
+		inst->failed |= RPI_THREAD_FAILED;
+		goto fail;
+	}
 
 	if (pthread_create(&inst->piper, NULL, (void*(*)(void*)) pipe_thread, inst)) {
 		inst->failed |= RPI_THREAD_FAILED;
@@ -106,15 +609,291 @@ fail:
 	return false;
 }
 
-void relay_pipe_destroy(struct relay_pipe *inst)
+bool relay_pipe_init(struct relay_pipe *inst, int fd_in, int fd_out, bool owns, relay_pipe_tap *tap, void *misc)
+{
+	const struct pipe_mode mode = { .tap = tap };
+	return pipe_init(inst, fd_in, fd_out, owns, &mode, misc);
+}
+
+bool relay_pipe_init_batch(struct relay_pipe *inst, int fd_in, int fd_out, bool owns, relay_pipe_batch_tap *tap, void *misc)
+{
+	const struct pipe_mode mode = { .batch_tap = tap };
+	return pipe_init(inst, fd_in, fd_out, owns, &mode, misc);
+}
+
+bool relay_pipe_init_pipeline(struct relay_pipe *inst, int fd_in, int fd_out, bool owns, relay_pipe_tap *tap, void *misc, const struct relay_pipe_pipeline *config)
+{
+	const struct pipe_mode mode = { .tap = tap, .pipeline = config };
+	return pipe_init(inst, fd_in, fd_out, owns, &mode, misc);
+}
+
+bool relay_pipe_init_forward(struct relay_pipe *inst, int fd_in, int fd_out, bool owns, relay_pipe_header_tap *tap, void *misc)
+{
+	const struct pipe_mode mode = { .forward = true, .header_tap = tap };
+	return pipe_init(inst, fd_in, fd_out, owns, &mode, misc);
+}
+
+/* Hub */
+
+/* Epoll events per wait, and batches per pipe per event (for fairness) */
+#define HUB_EVENTS 64
+#define HUB_BURST 1
+
+static void hub_wake(struct relay_pipe_hub_loop *loop)
 {
-	/* Notify thread of closing */
 	uint64_t n = 1;
-	if (write(inst->fd_end, &n, sizeof(n))) {
+	if (write(loop->fd_wake, &n, sizeof(n))) {
+	}
+}
+
+/*
+ * Forward up to a burst from a pipe.  Packets left in the reader's buffer do
+ * not make the fd readable again, so a pipe which may have more is put on
+ * the next list to be served again on the next iteration.
+ */
+static void hub_service(struct relay_pipe_hub_loop *loop, struct relay_pipe *inst, struct relay_pipe **next)
+{
+	enum rca_recv_result res = pipe_drain(inst, HUB_BURST);
+	if (res == rcarr_success) {
+		if (!inst->hub_queued) {
+			inst->hub_queued = true;
+			inst->hub_next = *next;
+			*next = inst;
+		}
+	} else if (res != rcarr_again) {
+		epoll_ctl(loop->ep, EPOLL_CTL_DEL, inst->fd_in, NULL);
+	}
+}
+
+static void *hub_thread(struct relay_pipe_hub_loop *loop)
+{
+	struct epoll_event epev[HUB_EVENTS];
+	log_debug("Hub thread created");
+	bool stopping = false;
+	while (!stopping) {
+		pthread_mutex_lock(&loop->lock);
+		struct relay_pipe *ready = loop->ready;
+		loop->ready = NULL;
+		for (struct relay_pipe *inst = ready; inst; inst = inst->hub_next) {
+			inst->hub_queued = false;
+		}
+		pthread_mutex_unlock(&loop->lock);
+		/* Don't sleep while pipes are ready */
+		int nfds = epoll_wait(loop->ep, epev, HUB_EVENTS, ready ? 0 : -1);
+		if (nfds == -1 && errno != EINTR) {
+			log_debug("Hub stopping due to error %d", errno);
+			break;
+		}
+		struct relay_pipe *next = NULL;
+		while (ready) {
+			struct relay_pipe *inst = ready;
+			ready = inst->hub_next;
+			hub_service(loop, inst, &next);
+		}
+		for (int i = 0; i < nfds; i++) {
+			struct relay_pipe *inst = epev[i].data.ptr;
+			if (!inst) {
+				uint64_t n;
+				if (read(loop->fd_wake, &n, sizeof(n))) {
+				}
+			} else {
+				hub_service(loop, inst, &next);
+			}
+		}
+		/* Pipes removed before this point can no longer be touched */
+		pthread_mutex_lock(&loop->lock);
+		while (next) {
+			struct relay_pipe *inst = next;
+			next = inst->hub_next;
+			if (inst->hub_detached) {
+				inst->hub_queued = false;
+			} else {
+				inst->hub_next = loop->ready;
+				loop->ready = inst;
+			}
+		}
+		loop->iteration++;
+		stopping = loop->stopping;
+		pthread_cond_broadcast(&loop->iterated);
+		pthread_mutex_unlock(&loop->lock);
+	}
+	pthread_mutex_lock(&loop->lock);
+	loop->stopping = true;
+	pthread_cond_broadcast(&loop->iterated);
+	pthread_mutex_unlock(&loop->lock);
+	log_debug("Hub thread exited");
+
+	return NULL;
+}
+
+/* Unregister a pipe and wait until its loop has finished any iteration which may be using it */
+static void hub_detach(struct relay_pipe *inst)
+{
+	struct relay_pipe_hub_loop *loop = inst->loop;
+	epoll_ctl(loop->ep, EPOLL_CTL_DEL, inst->fd_in, NULL);
+	pthread_mutex_lock(&loop->lock);
+	/* Off the ready list, and kept off it by the iteration in progress */
+	inst->hub_detached = true;
+	for (struct relay_pipe **p = &loop->ready; *p; p = &(*p)->hub_next) {
+		if (*p == inst) {
+			*p = inst->hub_next;
+			break;
+		}
+	}
+	uint64_t iteration = loop->iteration;
+	hub_wake(loop);
+	while (loop->iteration == iteration && !loop->stopping) {
+		pthread_cond_wait(&loop->iterated, &loop->lock);
+	}
+	pthread_mutex_unlock(&loop->lock);
+	inst->loop = NULL;
+}
+
+static bool hub_loop_init(struct relay_pipe_hub_loop *loop)
+{
+	memset(loop, 0, sizeof(*loop));
+	loop->ep = epoll_create1(0);
+	loop->fd_wake = eventfd(0, EFD_NONBLOCK);
+	if (loop->ep == -1 || loop->fd_wake == -1) {
+		goto fail;
+	}
+	struct epoll_event epev = { .events = EPOLLIN, .data = { .ptr = NULL } };
+	if (epoll_ctl(loop->ep, EPOLL_CTL_ADD, loop->fd_wake, &epev) == -1) {
+		goto fail;
+	}
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_cond_init(&loop->iterated, NULL);
+	if (pthread_create(&loop->thread, NULL, (void*(*)(void*)) hub_thread, loop)) {
+		pthread_mutex_destroy(&loop->lock);
+		pthread_cond_destroy(&loop->iterated);
+		goto fail;
+	}
+	return true;
+fail:
+	log_error("Failed to create hub loop (%s)", strerror(errno));
+	if (loop->ep != -1) {
+		close(loop->ep);
+	}
+	if (loop->fd_wake != -1) {
+		close(loop->fd_wake);
+	}
+	return false;
+}
+
+static void hub_loop_destroy(struct relay_pipe_hub_loop *loop)
+{
+	pthread_mutex_lock(&loop->lock);
+	loop->stopping = true;
+	pthread_mutex_unlock(&loop->lock);
+	hub_wake(loop);
+	pthread_join(loop->thread, NULL);
+	pthread_mutex_destroy(&loop->lock);
+	pthread_cond_destroy(&loop->iterated);
+	close(loop->ep);
+	close(loop->fd_wake);
+}
+
+bool relay_pipe_hub_init(struct relay_pipe_hub *hub, size_t nloops)
+{
+	memset(hub, 0, sizeof(*hub));
+	if (nloops == 0) {
+		nloops = 1;
+	}
+	hub->loops = calloc(nloops, sizeof(*hub->loops));
+	if (!hub->loops) {
+		return false;
+	}
+	for (; hub->nloops < nloops; hub->nloops++) {
+		if (!hub_loop_init(&hub->loops[hub->nloops])) {
+			relay_pipe_hub_destroy(hub);
+			return false;
+		}
+	}
+	return true;
+}
+
+void relay_pipe_hub_destroy(struct relay_pipe_hub *hub)
+{
+	for (size_t i = 0; i < hub->nloops; i++) {
+		hub_loop_destroy(&hub->loops[i]);
+	}
+	free(hub->loops);
+	memset(hub, 0, sizeof(*hub));
+}
+
+bool relay_pipe_hub_add(struct relay_pipe_hub *hub, struct relay_pipe *inst, int fd_in, int fd_out, bool owns, relay_pipe_tap *tap, void *misc)
+{
+	memset(inst, 0, sizeof(*inst));
+
+	inst->misc = misc;
+
+	inst->fd_in = fd_in;
+	inst->fd_out = fd_out;
+	inst->fd_in_flags = -1;
+	inst->fd_end = -1;
+	inst->ep = -1;
+
+	/* Spread pipes over the loops */
+	inst->loop = &hub->loops[__atomic_fetch_add(&hub->next, 1, __ATOMIC_RELAXED) % hub->nloops];
+
+	if (!pipe_set_nonblock(inst)) {
+		inst->failed |= RPI_OPEN_INPUT_FAILED;
+		goto fail;
+	}
+	if (!relay_client_init_fd(&inst->reader, NULL, fd_in, owns, false) ||
+			!relay_client_set_recv_buffer(&inst->reader, PIPE_RECV_BUFFER)) {
+		inst->failed |= RPI_OPEN_INPUT_FAILED;
+		goto fail;
+	}
+	relay_client_set_reassembly(&inst->reader, false);
+	if (!relay_client_init_fd(&inst->writer, NULL, fd_out, owns, false)) {
+		inst->failed |= RPI_OPEN_OUTPUT_FAILED;
+		goto fail;
+	}
+	inst->tap = tap;
+
+	struct epoll_event epev = { .events = EPOLLIN, .data = { .ptr = inst } };
+	if (epoll_ctl(inst->loop->ep, EPOLL_CTL_ADD, fd_in, &epev) == -1) {
+		goto fail;
+	}
+
+	return true;
+fail:
+	inst->failed |= RPI_INIT_FAILED;
+	relay_pipe_destroy(inst);
+	return false;
+}
+
+void relay_pipe_destroy(struct relay_pipe *inst)
+{
+	if (inst->loop) {
+		hub_detach(inst);
+	} else {
+		/* Notify thread(s) of closing */
+		uint64_t n = 1;
+		if (write(inst->fd_end, &n, sizeof(n))) {
+		}
+		for (size_t i = 0; i < inst->nqueues; i++) {
+			queue_close(&inst->queue[i], true);
+		}
+		/* Wait for thread(s) to close */
+		pthread_join(inst->piper, NULL);
+		if (inst->nqueues) {
+			pipeline_stop(inst);
+		}
 	}
-	/* Wait for thread to close */
-	pthread_join(inst->piper, NULL);
 	/* Clean up */
+	if (inst->fd_in_flags != -1) {
+		fcntl(inst->fd_in, F_SETFL, inst->fd_in_flags);
+		inst->fd_in_flags = -1;
+	}
+	if (inst->forward) {
+		for (size_t i = 0; i < 2; i++) {
+			if (inst->splice[i] != -1) {
+				close(inst->splice[i]);
+			}
+		}
+	}
 	relay_client_destroy(&inst->reader);
 	relay_client_destroy(&inst->writer);
 }
@@ -5,21 +5,102 @@
 /*
  * Pipes packets from one FD to another FD, applying a filter/map function to
  * each packet, if a function was provided.
+ *
+ * Fragments (RELAY_FRAGMENT_TYPE) are not reassembled, taps see them as they
+ * are.
  */
 
 typedef bool relay_pipe_tap(struct relay_packet **packet, void *misc);
 
+/*
+ * Filter applied to up to RELAY_PIPE_BATCH_MAX packets at once, returning a
+ * mask of the packets to keep (bit i for packets[i]).  Packets may be edited
+ * or replaced in place as with relay_pipe_tap.
+ */
+#define RELAY_PIPE_BATCH_MAX 64
+
+typedef uint64_t relay_pipe_batch_tap(struct relay_packet **packets, size_t count, void *misc);
+
+/*
+ * Filter for forwarding pipes, which sees only the serialised header.  It may
+ * edit the type/endpoint fields but must not change the length.
+ */
+typedef bool relay_pipe_header_tap(struct relay_packet_serial_hdr *header, void *misc);
+
+struct relay_pipe_hub_loop;
+
+/* What a pipeline stage does with a packet when the next queue is full */
+enum relay_pipe_overflow {
+	rpo_block = 0,
+	rpo_drop_oldest = 1,
+	rpo_drop_newest = 2
+};
+
+struct relay_pipe_pipeline {
+	/* Packets per queue, rounded up to a power of two */
+	size_t depth;
+	enum relay_pipe_overflow overflow;
+};
+
+/*
+ * Bounded single-producer/single-consumer queue of packets between pipeline
+ * stages.  With rpo_drop_oldest the producer may also advance the tail, so
+ * the consumer claims packets with a CAS.
+ */
+struct relay_pipe_queue {
+	struct relay_packet **slots;
+	size_t size;
+	enum relay_pipe_overflow overflow;
+	/* Producer side */
+	uint64_t head __attribute__((aligned(64)));
+	uint32_t producer_waiting;
+	int fd_space;
+	/* Consumer side */
+	uint64_t tail __attribute__((aligned(64)));
+	uint32_t consumer_waiting;
+	int fd_data;
+	/* Producer has finished, or the pipe is being destroyed */
+	bool closed __attribute__((aligned(64)));
+	bool stopping;
+	/* Packets discarded due to overflow */
+	uint64_t dropped;
+};
+
+/* Number of packets currently queued */
+size_t relay_pipe_queue_length(const struct relay_pipe_queue *queue);
+
 struct relay_pipe {
 	struct relay_client reader;
 	struct relay_client writer;
 	int fd_in;
 	int fd_out;
+	/* Flags of fd_in before it was made non-blocking, restored on destroy (-1 if unchanged) */
+	int fd_in_flags;
 	int fd_end;
 	int ep;
 	relay_pipe_tap *tap;
+	relay_pipe_batch_tap *batch_tap;
+	relay_pipe_header_tap *header_tap;
+	/* Forwarding mode: serialised pass-through, or splice if no tap */
+	bool forward;
+	bool spliced;
+	/* Output refused splice, so spliced input is copied out with read/write */
+	bool copy_out;
+	int splice[2];
 	pthread_t piper;
+	/* Pipeline mode: reader -> [tap ->] writer threads, joined by queues */
+	size_t nqueues;
+	struct relay_pipe_queue queue[2];
+	pthread_t tapper;
+	pthread_t sender;
 	int failed;
 	void *misc;
+	/* Set if the pipe is served by a hub rather than its own thread */
+	struct relay_pipe_hub_loop *loop;
+	/* Hub: next pipe on the loop's ready list, and state guarded by the loop's lock */
+	struct relay_pipe *hub_next;
+	bool hub_queued;
+	bool hub_detached;
 };
 
 #define RPI_INIT_FAILED 1
@@ -27,5 +108,64 @@ struct relay_pipe {
 #define RPI_OPEN_OUTPUT_FAILED 4
 #define RPI_THREAD_FAILED 8
 
+/*
+ * The input fd is made non-blocking while the pipe runs (relay_pipe_destroy
+ * restores its flags), and everything readable on it is forwarded before the
+ * pipe waits again, with accepted packets written out together in batches.
+ */
 bool relay_pipe_init(struct relay_pipe *inst, int fd_in, int fd_out, bool owns, relay_pipe_tap *tap, void *misc);
+bool relay_pipe_init_batch(struct relay_pipe *inst, int fd_in, int fd_out, bool owns, relay_pipe_batch_tap *tap, void *misc);
 void relay_pipe_destroy(struct relay_pipe *inst);
+
+/*
+ * As relay_pipe_init, but reading, the tap (if any) and writing each run on
+ * their own thread, so a slow output or a slow tap does not stall the input.
+ * Queue lengths and drop counts can be read from inst->queue[0..nqueues).
+ */
+bool relay_pipe_init_pipeline(struct relay_pipe *inst, int fd_in, int fd_out, bool owns, relay_pipe_tap *tap, void *misc, const struct relay_pipe_pipeline *config);
+
+/*
+ * As relay_pipe_init, but packets are forwarded without being deserialised.
+ * With no tap, the byte stream is moved with splice() through a kernel pipe
+ * where the fds support it, falling back to copying serialised packets.
+ */
+bool relay_pipe_init_forward(struct relay_pipe *inst, int fd_in, int fd_out, bool owns, relay_pipe_header_tap *tap, void *misc);
+
+/*
+ * Serves any number of pipes from a fixed number of epoll threads, rather
+ * than one thread per pipe.  The pipe's input is made non-blocking (until
+ * relay_pipe_destroy) and is read with try_recv, so a partial packet on one
+ * pipe does not hold up the others; output is written with blocking sends as
+ * with a standalone pipe.
+ *
+ * Pipes added to a hub are destroyed with relay_pipe_destroy as usual, which
+ * returns once the hub can no longer touch the pipe (so not from a tap).
+ * Destroy all of a hub's pipes before destroying the hub.
+ */
+
+struct relay_pipe_hub_loop {
+	int ep;
+	int fd_wake;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t iterated;
+	/* Completed epoll iterations, for removal barriers */
+	uint64_t iteration;
+	bool stopping;
+	/*
+	 * Pipes which may have more input than their fd shows (e.g. packets
+	 * already in the reader's buffer), served again without waiting
+	 */
+	struct relay_pipe *ready;
+};
+
+struct relay_pipe_hub {
+	size_t nloops;
+	struct relay_pipe_hub_loop *loops;
+	size_t next;
+};
+
+bool relay_pipe_hub_init(struct relay_pipe_hub *hub, size_t nloops);
+void relay_pipe_hub_destroy(struct relay_pipe_hub *hub);
+
+bool relay_pipe_hub_add(struct relay_pipe_hub *hub, struct relay_pipe *inst, int fd_in, int fd_out, bool owns, relay_pipe_tap *tap, void *misc);
@@ -0,0 +1,216 @@
+#include "relay_pool.h"
+
+struct relay_pool_block {
+	/* Owning pool, NULL if block was allocated without one */
+	struct relay_pool *pool;
+	/* Size class, or -1 if block is not pooled */
+	int class;
+	/* Link in shared free list */
+	struct relay_pool_block *next;
+	char data[] __attribute__((aligned(16)));
+};
+
+struct relay_pool_cache {
+	struct relay_pool *pool;
+	struct relay_pool_cache *prev;
+	struct relay_pool_cache *next;
+	size_t count[RELAY_POOL_CLASSES];
+	struct relay_pool_block *blocks[RELAY_POOL_CLASSES][RELAY_POOL_CACHE_SIZE];
+};
+
+#define count_stat(self, name) __atomic_fetch_add(&(self)->stats.name, 1, __ATOMIC_RELAXED)
+
+static size_t class_size(int class)
+{
+	return (size_t) 1 << (class + RELAY_POOL_MIN_SHIFT);
+}
+
+static int size_class(size_t size)
+{
+	for (int class = 0; class < RELAY_POOL_CLASSES; class++) {
+		if (size <= class_size(class)) {
+			return class;
+		}
+	}
+	return -1;
+}
+
+/* Move blocks from a thread cache to the shared lists, caller holds lock */
+static void cache_spill(struct relay_pool_cache *cache, int class, size_t keep)
+{
+	struct relay_pool *pool = cache->pool;
+	while (cache->count[class] > keep) {
+		struct relay_pool_block *block = cache->blocks[class][--cache->count[class]];
+		block->next = pool->free[class];
+		pool->free[class] = block;
+	}
+}
+
+/* Thread-exit destructor, hands cached blocks back to the pool */
+static void cache_exit(void *arg)
+{
+	struct relay_pool_cache *cache = arg;
+	struct relay_pool *pool = cache->pool;
+	pthread_mutex_lock(&pool->lock);
+	for (int class = 0; class < RELAY_POOL_CLASSES; class++) {
+		cache_spill(cache, class, 0);
+	}
+	if (cache->prev) {
+		cache->prev->next = cache->next;
+	} else {
+		pool->caches = cache->next;
+	}
+	if (cache->next) {
+		cache->next->prev = cache->prev;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	free(cache);
+}
+
+static struct relay_pool_cache *get_cache(struct relay_pool *self)
+{
+	struct relay_pool_cache *cache = pthread_getspecific(self->key);
+	if (cache) {
+		return cache;
+	}
+	cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		return NULL;
+	}
+	cache->pool = self;
+	pthread_mutex_lock(&self->lock);
+	cache->next = self->caches;
+	if (self->caches) {
+		self->caches->prev = cache;
+	}
+	self->caches = cache;
+	pthread_mutex_unlock(&self->lock);
+	if (pthread_setspecific(self->key, cache)) {
+		cache_exit(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+bool relay_pool_init(struct relay_pool *self)
+{
+	memset(self, 0, sizeof(*self));
+	if (pthread_key_create(&self->key, cache_exit)) {
+		log_error("Failed to create pool thread key");
+		return false;
+	}
+	if (pthread_mutex_init(&self->lock, NULL)) {
+		pthread_key_delete(self->key);
+		return false;
+	}
+	return true;
+}
+
+static void free_list(struct relay_pool_block *block)
+{
+	while (block) {
+		struct relay_pool_block *next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+void relay_pool_destroy(struct relay_pool *self)
+{
+	pthread_key_delete(self->key);
+	while (self->caches) {
+		struct relay_pool_cache *cache = self->caches;
+		for (int class = 0; class < RELAY_POOL_CLASSES; class++) {
+			for (size_t i = 0; i < cache->count[class]; i++) {
+				free(cache->blocks[class][i]);
+			}
+		}
+		self->caches = cache->next;
+		free(cache);
+	}
+	for (int class = 0; class < RELAY_POOL_CLASSES; class++) {
+		free_list(self->free[class]);
+	}
+	pthread_mutex_destroy(&self->lock);
+}
+
+static void *alloc_block(struct relay_pool *pool, int class, size_t size)
+{
+	struct relay_pool_block *block = malloc(sizeof(*block) + size);
+	if (!block) {
+		log_error("Failed to allocate %zu byte packet buffer", size);
+		return NULL;
+	}
+	block->pool = pool;
+	block->class = class;
+	block->next = NULL;
+	return block->data;
+}
+
+void *relay_pool_alloc(struct relay_pool *self, size_t size)
+{
+	if (!self) {
+		return alloc_block(NULL, -1, size);
+	}
+	int class = size_class(size);
+	if (class < 0) {
+		count_stat(self, misses);
+		count_stat(self, oversize);
+		return alloc_block(self, -1, size);
+	}
+	struct relay_pool_cache *cache = get_cache(self);
+	if (!cache) {
+		count_stat(self, misses);
+		return alloc_block(self, -1, size);
+	}
+	if (cache->count[class] == 0) {
+		/* Refill half of the thread cache from the shared list */
+		pthread_mutex_lock(&self->lock);
+		while (cache->count[class] < RELAY_POOL_CACHE_SIZE / 2 && self->free[class]) {
+			struct relay_pool_block *block = self->free[class];
+			self->free[class] = block->next;
+			cache->blocks[class][cache->count[class]++] = block;
+		}
+		pthread_mutex_unlock(&self->lock);
+	}
+	if (cache->count[class] == 0) {
+		count_stat(self, misses);
+		return alloc_block(self, class, class_size(class));
+	}
+	count_stat(self, hits);
+	return cache->blocks[class][--cache->count[class]]->data;
+}
+
+void relay_pool_release(void *ptr)
+{
+	if (!ptr) {
+		return;
+	}
+	struct relay_pool_block *block = ptr - offsetof(struct relay_pool_block, data);
+	struct relay_pool *pool = block->pool;
+	if (!pool) {
+		free(block);
+		return;
+	}
+	count_stat(pool, releases);
+	struct relay_pool_cache *cache = block->class < 0 ? NULL : get_cache(pool);
+	if (!cache) {
+		free(block);
+		return;
+	}
+	int class = block->class;
+	if (cache->count[class] == RELAY_POOL_CACHE_SIZE) {
+		pthread_mutex_lock(&pool->lock);
+		cache_spill(cache, class, RELAY_POOL_CACHE_SIZE / 2);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	cache->blocks[class][cache->count[class]++] = block;
+}
+
+void relay_pool_get_stats(struct relay_pool *self, struct relay_pool_stats *out)
+{
+	out->hits = __atomic_load_n(&self->stats.hits, __ATOMIC_RELAXED);
+	out->misses = __atomic_load_n(&self->stats.misses, __ATOMIC_RELAXED);
+	out->oversize = __atomic_load_n(&self->stats.oversize, __ATOMIC_RELAXED);
+	out->releases = __atomic_load_n(&self->stats.releases, __ATOMIC_RELAXED);
+}
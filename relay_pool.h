@@ -0,0 +1,59 @@
+#pragma once
+#include <cstd/std.h>
+
+/*
+ * Packet buffer pool.
+ *
+ * Blocks are grouped into power-of-two size classes.  Each thread keeps a
+ * small cache of free blocks per class, backed by shared free lists, so
+ * allocating and releasing on the hot path takes no lock.  Requests larger
+ * than the largest class bypass the pool and go straight to malloc.
+ *
+ * Every block carries a header identifying its pool and class, so a block may
+ * be released from any thread.  All blocks must be released before the pool
+ * is destroyed.  Each pool uses one pthread key.
+ */
+
+#define RELAY_POOL_MIN_SHIFT 6
+#define RELAY_POOL_MAX_SHIFT 20
+#define RELAY_POOL_CLASSES (RELAY_POOL_MAX_SHIFT - RELAY_POOL_MIN_SHIFT + 1)
+
+/* Free blocks cached per thread per class before half are returned to the shared list */
+#define RELAY_POOL_CACHE_SIZE 32
+
+struct relay_pool_block;
+struct relay_pool_cache;
+
+/* Counters, updated with relaxed atomics */
+struct relay_pool_stats {
+	/* Allocations served from a free list */
+	uint64_t hits;
+	/* Allocations which had to call malloc */
+	uint64_t misses;
+	/* Misses which were larger than the largest size class */
+	uint64_t oversize;
+	/* Blocks released */
+	uint64_t releases;
+};
+
+struct relay_pool {
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	/* Shared free lists, refill and overflow for the per-thread caches */
+	struct relay_pool_block *free[RELAY_POOL_CLASSES];
+	/* Every thread cache, so that they can be reclaimed with the pool */
+	struct relay_pool_cache *caches;
+	struct relay_pool_stats stats;
+};
+
+bool relay_pool_init(struct relay_pool *self);
+void relay_pool_destroy(struct relay_pool *self);
+
+/* Allocate a block of at least size bytes, pool may be NULL to use malloc */
+void *relay_pool_alloc(struct relay_pool *self, size_t size);
+
+/* Return a block from relay_pool_alloc to its pool (NULL is ignored) */
+void relay_pool_release(void *ptr);
+
+/* Snapshot of the pool counters */
+void relay_pool_get_stats(struct relay_pool *self, struct relay_pool_stats *out);
@@ -0,0 +1,248 @@
+#if defined prog_relay_recv
+
+/*
+ * Receives packets and writes their payloads to STDOUT (or one file per
+ * packet with -o), then reports throughput and packet sizes on exit.
+ *  -t <type>:   only keep packets of this type
+ *  -r <remote>: only keep packets from this endpoint
+ *  -o <prefix>: write each payload to <prefix>.<sequence> instead
+ *  -n <count>:  exit after this many packets have been kept
+ *  -e:          exit after an empty packet (as ends a relay_send -c stream)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "relay_packet.h"
+#include "relay_client.h"
+
+/* Payloads are gathered until this much is pending, larger ones go straight out */
+#define OUTPUT_BUFFER (1 << 20)
+
+#define RECV_BUFFER (1 << 20)
+
+/* Packet size histogram: bucket n counts payloads of up to 2^n bytes */
+#define SIZE_BUCKETS 32
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig)
+{
+	(void) sig;
+	stopping = 1;
+}
+
+struct output {
+	char *buf;
+	size_t length;
+};
+
+static bool write_all(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct iovec vec[2];
+	memcpy(vec, iov, iovcnt * sizeof(*iov));
+	struct iovec *v = vec;
+	while (iovcnt > 0) {
+		ssize_t bytes = writev(fd, v, iovcnt);
+		if (bytes == -1 && errno == EINTR) {
+			continue;
+		} else if (bytes == -1) {
+			return false;
+		}
+		while (iovcnt > 0 && (size_t) bytes >= v->iov_len) {
+			bytes -= v->iov_len;
+			v++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			v->iov_base += bytes;
+			v->iov_len -= bytes;
+		}
+	}
+	return true;
+}
+
+static bool output_flush(struct output *out)
+{
+	struct iovec iov = { .iov_base = out->buf, .iov_len = out->length };
+	out->length = 0;
+	return iov.iov_len == 0 || write_all(STDOUT_FILENO, &iov, 1);
+}
+
+static bool output_write(struct output *out, const void *data, size_t length)
+{
+	if (out->length + length <= OUTPUT_BUFFER) {
+		memcpy(out->buf + out->length, data, length);
+		out->length += length;
+		return true;
+	}
+	/* Pending output and this payload leave in one write */
+	struct iovec iov[2] = {
+		{ .iov_base = out->buf, .iov_len = out->length },
+		{ .iov_base = (void *) data, .iov_len = length }
+	};
+	out->length = 0;
+	return write_all(STDOUT_FILENO, iov, 2);
+}
+
+static bool write_file(const char *prefix, size_t seq, const void *data, size_t length)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s.%06zu", prefix, seq);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to create %s (errno=%d)\n", path, errno);
+		return false;
+	}
+	struct iovec iov = { .iov_base = (void *) data, .iov_len = length };
+	bool ok = write_all(fd, &iov, 1);
+	if (close(fd) == -1) {
+		ok = false;
+	}
+	if (!ok) {
+		fprintf(stderr, "Failed to write %s (errno=%d)\n", path, errno);
+	}
+	return ok;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t size_bucket(size_t length)
+{
+	size_t bucket = 0;
+	while (bucket < SIZE_BUCKETS - 1 && ((size_t) 1 << bucket) < length) {
+		bucket++;
+	}
+	return bucket;
+}
+
+static void report(size_t packets, size_t skipped, uint64_t bytes, double elapsed, const uint64_t *sizes)
+{
+	if (elapsed <= 0) {
+		elapsed = 1e-9;
+	}
+	fprintf(stderr, "%zu packets (%zu filtered out), %lu bytes in %.3f s: %.0f msgs/s, %.2f MB/s\n",
+		packets, skipped, bytes, elapsed, packets / elapsed, bytes / elapsed / 1e6);
+	for (size_t i = 0; i < SIZE_BUCKETS; i++) {
+		if (sizes[i]) {
+			fprintf(stderr, "  <= %10zu B: %lu\n", (size_t) 1 << i, sizes[i]);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const char *type = NULL;
+	const char *remote = NULL;
+	const char *prefix = NULL;
+	size_t limit = 0;
+	bool stop_on_empty = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:r:o:n:e")) != -1) {
+		switch (opt) {
+		case 't': type = optarg; break;
+		case 'r': remote = optarg; break;
+		case 'o': prefix = optarg; break;
+		case 'n': limit = strtoul(optarg, NULL, 10); break;
+		case 'e': stop_on_empty = true; break;
+		default: goto syntax;
+		}
+	}
+	if (argc - optind < 3) {
+syntax:
+		fprintf(stderr, "Syntax: %s [-t <type>] [-r <remote>] [-o <prefix>] [-n <count>] [-e] <addr> <port> <local>\n", argv[0]);
+		return 1;
+	}
+	argv += optind - 1;
+	const char *addr = argv[1];
+	const char *port = argv[2];
+	const char *local = argv[3];
+	if (strlen(local) > RELAY_ENDPOINT_LENGTH) {
+		fprintf(stderr, "Local endpoint name is too long\n");
+		return 1;
+	}
+	/* Interrupt the blocking receive so that we still report */
+	struct sigaction sa = { .sa_handler = on_signal };
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	struct relay_client client;
+	if (!relay_client_init_socket(&client, local, addr, port) != 0) {
+		fprintf(stderr, "Failed to connect to %s:%s\n", addr, port);
+		return 2;
+	}
+	struct output out = { .buf = malloc(OUTPUT_BUFFER) };
+	if (!out.buf || !relay_client_set_recv_buffer(&client, RECV_BUFFER) || !relay_client_enable_pool(&client)) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		return 3;
+	}
+	int ret = 0;
+	size_t packets = 0;
+	size_t skipped = 0;
+	uint64_t bytes = 0;
+	uint64_t sizes[SIZE_BUCKETS] = { 0 };
+	/* Timing starts once the first data is ready to read */
+	struct pollfd pfd = { .fd = relay_client_get_fd(&client), .events = POLLIN };
+	while (!stopping && poll(&pfd, 1, -1) == -1 && errno == EINTR) {
+	}
+	const double start = now_s();
+	double end = start;
+	while (!stopping && (limit == 0 || packets < limit)) {
+		struct relay_packet *p;
+		if (!relay_client_recv_pooled_packet(&client, &p)) {
+			if (!stopping) {
+				fprintf(stderr, "Receive failed\n");
+				ret = 4;
+			}
+			break;
+		}
+		if (!p) {
+			break;
+		}
+		if ((type && strcmp(p->type, type) != 0) || (remote && strcmp(p->remote, remote) != 0)) {
+			skipped++;
+			relay_client_release_packet(&client, p);
+			continue;
+		}
+		end = now_s();
+		const bool last = stop_on_empty && p->length == 0;
+		bool ok = prefix ?
+			write_file(prefix, packets, p->data, p->length) :
+			output_write(&out, p->data, p->length);
+		packets++;
+		bytes += p->length;
+		sizes[size_bucket(p->length)]++;
+		relay_client_release_packet(&client, p);
+		if (!ok) {
+			if (!prefix) {
+				fprintf(stderr, "Failed to write output (errno=%d)\n", errno);
+			}
+			ret = 3;
+			break;
+		}
+		if (last) {
+			break;
+		}
+	}
+	if (!output_flush(&out) && ret == 0) {
+		fprintf(stderr, "Failed to write output (errno=%d)\n", errno);
+		ret = 3;
+	}
+	report(packets, skipped, bytes, end - start, sizes);
+	relay_client_destroy(&client);
+	free(out.buf);
+	return ret;
+}
+#endif
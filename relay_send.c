@@ -1,6 +1,12 @@
 #if defined prog_relay_send
 
-/* Sends STDIN as a single message */
+/*
+ * Sends STDIN as a single message, or:
+ *  -f <file>: sends a regular file as one message without copying it
+ *  -c <size>: streams STDIN as it arrives in packets of up to size bytes,
+ *             keeping up to -n of them in flight, then an empty packet at EOF
+ *  -F <size>: sends payloads larger than size as fragments (see PROTOCOL.md)
+ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -9,16 +15,253 @@
 #include <signal.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include "relay_packet.h"
 #include "relay_client.h"
 
+#define DEFAULT_IN_FLIGHT 4
+
+/* Chunks filled by the main thread and sent by the sender thread */
+struct stream {
+	struct relay_client *client;
+	struct relay_header_template tpl;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **chunks;
+	size_t *lengths;
+	size_t count;
+	/* Chunks filled and chunks sent so far (slot is index % count) */
+	size_t filled;
+	size_t sent;
+	bool eof;
+	bool failed;
+};
+
+static void *stream_sender(void *arg)
+{
+	struct stream *s = arg;
+	pthread_mutex_lock(&s->lock);
+	while (true) {
+		while (s->sent == s->filled && !s->eof) {
+			pthread_cond_wait(&s->cond, &s->lock);
+		}
+		if (s->sent == s->filled) {
+			break;
+		}
+		const size_t slot = s->sent % s->count;
+		pthread_mutex_unlock(&s->lock);
+		bool ok = relay_client_send_template(s->client, &s->tpl, s->chunks[slot], s->lengths[slot]);
+		pthread_mutex_lock(&s->lock);
+		s->sent++;
+		pthread_cond_signal(&s->cond);
+		if (!ok) {
+			s->failed = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/* Fills a chunk until it is full, EOF, or no more input is ready right now */
+static ssize_t fill_chunk(char *buf, size_t size)
+{
+	size_t length = 0;
+	while (length < size) {
+		ssize_t in = read(STDIN_FILENO, buf + length, size - length);
+		if (in == -1 && errno == EINTR) {
+			continue;
+		} else if (in == -1) {
+			return -1;
+		} else if (in == 0) {
+			break;
+		}
+		length += in;
+		struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+		if (poll(&pfd, 1, 0) == 0) {
+			break;
+		}
+	}
+	return length;
+}
+
+static int send_stream(struct relay_client *client, const char *type, const char *remote, size_t chunk_size, size_t in_flight, size_t *total)
+{
+	struct stream s = {
+		.client = client,
+		.chunks = calloc(in_flight, sizeof(*s.chunks)),
+		.lengths = calloc(in_flight, sizeof(*s.lengths)),
+		.count = in_flight
+	};
+	if (!s.chunks || !s.lengths) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		return 3;
+	}
+	for (size_t i = 0; i < in_flight; i++) {
+		if (!(s.chunks[i] = malloc(chunk_size))) {
+			fprintf(stderr, "Failed to allocate buffers\n");
+			return 3;
+		}
+	}
+	relay_client_make_template(client, &s.tpl, type, remote);
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.cond, NULL);
+	pthread_t sender;
+	if (pthread_create(&sender, NULL, stream_sender, &s)) {
+		fprintf(stderr, "Failed to start sender thread\n");
+		return 3;
+	}
+	int ret = 0;
+	*total = 0;
+	pthread_mutex_lock(&s.lock);
+	while (!s.failed) {
+		while (s.filled - s.sent == s.count && !s.failed) {
+			pthread_cond_wait(&s.cond, &s.lock);
+		}
+		if (s.failed) {
+			break;
+		}
+		const size_t slot = s.filled % s.count;
+		pthread_mutex_unlock(&s.lock);
+		ssize_t length = fill_chunk(s.chunks[slot], chunk_size);
+		pthread_mutex_lock(&s.lock);
+		if (length == -1) {
+			fprintf(stderr, "Failed to read data (errno=%d)\n", errno);
+			ret = 3;
+			break;
+		}
+		/* The empty chunk at EOF marks the end of the stream */
+		s.lengths[slot] = length;
+		s.filled++;
+		*total += length;
+		pthread_cond_signal(&s.cond);
+		if (length == 0) {
+			break;
+		}
+	}
+	s.eof = true;
+	pthread_cond_signal(&s.cond);
+	pthread_mutex_unlock(&s.lock);
+	pthread_join(sender, NULL);
+	if (s.failed && ret == 0) {
+		fprintf(stderr, "Send failed\n");
+		ret = 4;
+	}
+	pthread_cond_destroy(&s.cond);
+	pthread_mutex_destroy(&s.lock);
+	for (size_t i = 0; i < in_flight; i++) {
+		free(s.chunks[i]);
+	}
+	free(s.chunks);
+	free(s.lengths);
+	return ret;
+}
+
+static int send_file(struct relay_client *client, const char *type, const char *remote, int fd, size_t *total)
+{
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Not a regular file\n");
+		return 3;
+	}
+	/* Send from the current offset, as reading it would */
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+	if (offset == -1 || offset > st.st_size) {
+		offset = 0;
+	}
+	*total = st.st_size - offset;
+	struct relay_header_template tpl;
+	relay_client_make_template(client, &tpl, type, remote);
+	if (!relay_client_send_file(client, &tpl, fd, offset, *total)) {
+		fprintf(stderr, "Send failed\n");
+		return 4;
+	}
+	return 0;
+}
+
+static int send_buffered(struct relay_client *client, const char *type, const char *remote, size_t *total)
+{
+	size_t length = 0;;
+	size_t capacity = 16 << 20;
+	char *buf = malloc(capacity);
+	ssize_t in;
+	while ((in = read(STDIN_FILENO, buf + length, capacity - length))) {
+		if (in == -1) {
+			fprintf(stderr, "Failed to read data (errno=%d)\n", errno);
+			return 3;
+		}
+		length += in;
+		if (length == capacity) {
+			capacity += (capacity >> 1);
+			buf = realloc(buf, capacity);
+		}
+	}
+	*total = length;
+	bool ok = relay_client_send_packet(client, type, remote, buf, length);
+	free(buf);
+	if (!ok) {
+		fprintf(stderr, "Send failed\n");
+		return 4;
+	}
+	return 0;
+}
+
+/* Size with optional k/M suffix */
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t size = strtoul(s, &end, 10);
+	switch (*end) {
+	case 'k': case 'K': size <<= 10; end++; break;
+	case 'm': case 'M': size <<= 20; end++; break;
+	}
+	return *end ? 0 : size;
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc < 6) {
-		fprintf(stderr, "Syntax: %s <addr> <port> <local> <remote> <type>\n", argv[0]);
+	size_t chunk_size = 0;
+	size_t in_flight = DEFAULT_IN_FLIGHT;
+	const char *file = NULL;
+	size_t fragment_size = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:n:f:F:")) != -1) {
+		switch (opt) {
+		case 'c':
+			if (!(chunk_size = parse_size(optarg))) {
+				fprintf(stderr, "Invalid chunk size: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			if (!(in_flight = parse_size(optarg))) {
+				fprintf(stderr, "Invalid number of chunks in flight: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'F':
+			if (!(fragment_size = parse_size(optarg))) {
+				fprintf(stderr, "Invalid fragment size: %s\n", optarg);
+				return 1;
+			}
+			break;
+		default:
+			goto syntax;
+		}
+	}
+	if (argc - optind < 5 || (file && chunk_size)) {
+syntax:
+		fprintf(stderr, "Syntax: %s [-c <chunk-size> [-n <in-flight>] | -f <file>] [-F <fragment-size>] <addr> <port> <local> <remote> <type>\n", argv[0]);
 		return 1;
 	}
+	argv += optind - 1;
 	const char *addr = argv[1];
 	const char *port = argv[2];
 	const char *local = argv[3];
@@ -40,33 +283,38 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Packet type name is too long\n");
 		return 1;
 	}
+	int fd = -1;
+	if (file && (fd = open(file, O_RDONLY)) == -1) {
+		fprintf(stderr, "Failed to open %s (errno=%d)\n", file, errno);
+		return 3;
+	}
+	/* Redirected regular files go without copying even without -f */
+	struct stat st;
+	if (!file && !chunk_size && fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+		fd = STDIN_FILENO;
+	}
 	struct relay_client client;
 	if (!relay_client_init_socket(&client, local, addr, port) != 0) {
 		fprintf(stderr, "Failed to connect to %s:%s\n", addr, port);
 		return 2;
 	}
-	size_t length = 0;;
-	size_t capacity = 16 << 20;
-	char *buf = malloc(capacity);
-	ssize_t in;
-	while ((in = read(STDIN_FILENO, buf + length, capacity - length))) {
-		if (in == -1) {
-			fprintf(stderr, "Failed to read data (errno=%d)\n", errno);
-			return 3;
-		}
-		length += in;
-		if (length == capacity) {
-			capacity += (capacity >> 1);
-			buf = realloc(buf, capacity);
-		}
+	relay_client_set_fragment_size(&client, fragment_size);
+	size_t length;
+	int ret;
+	if (chunk_size) {
+		ret = send_stream(&client, type, remote, chunk_size, in_flight, &length);
+	} else if (fd != -1) {
+		ret = send_file(&client, type, remote, fd, &length);
+	} else {
+		ret = send_buffered(&client, type, remote, &length);
 	}
-	if (!relay_client_send_packet(&client, type, remote, buf, length)) {
-		fprintf(stderr, "Send failed\n");
-		relay_client_destroy(&client);
-		return 4;
+	if (ret == 0) {
+		fprintf(stderr, "%zu bytes sent to %s\n", length, remote);
 	}
-	fprintf(stderr, "%zu bytes sent to %s\n", length, remote);
 	relay_client_destroy(&client);
-	return 0;
+	if (file) {
+		close(fd);
+	}
+	return ret;
 }
 #endif
@@ -0,0 +1,395 @@
+#include <cstd/unix.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include "relay_shared.h"
+
+/* Most packets written per gathered write */
+#define WRITE_BATCH 64
+
+/* Polls of the queue before the writer goes to sleep */
+#define SPIN_LIMIT 200
+
+struct relay_shared_node {
+	struct relay_shared_node *next;
+	uint64_t enqueued_ns;
+	struct relay_packet_serial packet;
+};
+
+#define add_stat(self, name, n) __atomic_fetch_add(&(self)->stats.name, (n), __ATOMIC_RELAXED)
+#define get_stat(self, name) __atomic_load_n(&(self)->stats.name, __ATOMIC_RELAXED)
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void signal_fd(int fd)
+{
+	uint64_t n = 1;
+	if (write(fd, &n, sizeof(n))) {
+	}
+}
+
+static void set_failed(struct relay_shared *self, int bit)
+{
+	__atomic_fetch_or(&self->failed, bit, __ATOMIC_RELAXED);
+}
+
+/* Vyukov's intrusive MPSC queue */
+
+static void queue_push(struct relay_shared *self, struct relay_shared_node *node)
+{
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	struct relay_shared_node *prev = __atomic_exchange_n(&self->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/* Writer only.  NULL if empty, or if a producer is part way through a push */
+static struct relay_shared_node *queue_pop(struct relay_shared *self)
+{
+	struct relay_shared_node *tail = self->tail;
+	struct relay_shared_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (tail == self->stub) {
+		if (!next) {
+			return NULL;
+		}
+		self->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next) {
+		self->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&self->head, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	/* Last node: put the stub behind it so that it can be taken */
+	queue_push(self, self->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		self->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+/* Sending */
+
+static bool queue_full(struct relay_shared *self)
+{
+	return get_stat(self, depth) >= self->limit;
+}
+
+/* Wait while the queue is at its limit, false if the send should not go ahead */
+static bool wait_for_room(struct relay_shared *self)
+{
+	if (!queue_full(self)) {
+		return true;
+	}
+	add_stat(self, full, 1);
+	if (self->full_policy == rsfp_fail) {
+		errno = EAGAIN;
+		return false;
+	}
+	pthread_mutex_lock(&self->full_lock);
+	__atomic_fetch_add(&self->producers_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	/* A write failure also wakes us, as the writer keeps discarding */
+	while (queue_full(self) && !(__atomic_load_n(&self->failed, __ATOMIC_RELAXED) & RSF_WRITE_FAILED)) {
+		pthread_cond_wait(&self->not_full, &self->full_lock);
+	}
+	__atomic_fetch_sub(&self->producers_waiting, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&self->full_lock);
+	return true;
+}
+
+static bool enqueue(struct relay_shared *self, const struct relay_packet_serial_hdr *hdr, const void *data, size_t length)
+{
+	if (__atomic_load_n(&self->failed, __ATOMIC_RELAXED) & RSF_WRITE_FAILED) {
+		log_error("Attempted to send on shared relay client after a write failure");
+		return false;
+	}
+	if (self->limit && !wait_for_room(self)) {
+		return false;
+	}
+	struct relay_shared_node *node = relay_pool_alloc(&self->pool, sizeof(*node) + length);
+	if (!node) {
+		log_error("Failed to allocate %zu bytes for packet", sizeof(*node) + length);
+		return false;
+	}
+	node->packet.header = *hdr;
+	if (length) {
+		memcpy(node->packet.data, data, length);
+	}
+	node->enqueued_ns = now_ns();
+	queue_push(self, node);
+	/* Depth is raised after the push, so the writer never waits on a non-empty queue */
+	uint64_t depth = add_stat(self, depth, 1) + 1;
+	uint64_t max = get_stat(self, max_depth);
+	while (depth > max && !__atomic_compare_exchange_n(&self->stats.max_depth, &max, depth, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+	add_stat(self, enqueued, 1);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&self->writer_waiting, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&self->writer_waiting, 0, __ATOMIC_RELAXED);
+		signal_fd(self->fd_wake);
+	}
+	return true;
+}
+
+bool relay_shared_send(struct relay_shared *self, const char *type, const char *remote, const void *data, size_t length)
+{
+	struct relay_header_template tpl;
+	relay_client_make_template(self->client, &tpl, type, remote);
+	return relay_shared_send_template(self, &tpl, data, length);
+}
+
+bool relay_shared_send2(struct relay_shared *self, const struct relay_packet *packet)
+{
+	struct relay_packet_serial_hdr hdr;
+	relay_serialise_packet_header(&hdr, packet);
+	return enqueue(self, &hdr, packet->data, packet->length);
+}
+
+bool relay_shared_send_template(struct relay_shared *self, const struct relay_header_template *tpl, const void *data, size_t length)
+{
+	struct relay_packet_serial_hdr hdr;
+	relay_header_template_apply(tpl, &hdr, length);
+	return enqueue(self, &hdr, data, length);
+}
+
+/* Writer */
+
+static bool writer_ready(struct relay_shared *self)
+{
+	return get_stat(self, depth) > 0 || __atomic_load_n(&self->stopping, __ATOMIC_ACQUIRE);
+}
+
+static void writer_wait(struct relay_shared *self)
+{
+	for (int i = 0; i < SPIN_LIMIT; i++) {
+		if (writer_ready(self)) {
+			return;
+		}
+	}
+	while (!writer_ready(self)) {
+		__atomic_store_n(&self->writer_waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (writer_ready(self)) {
+			break;
+		}
+		struct pollfd pfd = { .fd = self->fd_wake, .events = POLLIN };
+		poll(&pfd, 1, -1);
+		uint64_t n;
+		if (read(self->fd_wake, &n, sizeof(n))) {
+		}
+	}
+	__atomic_store_n(&self->writer_waiting, 0, __ATOMIC_RELAXED);
+}
+
+static void record_latency(struct relay_shared *self, uint64_t latency)
+{
+	add_stat(self, latency_total_ns, latency);
+	uint64_t max = get_stat(self, latency_max_ns);
+	while (latency > max && !__atomic_compare_exchange_n(&self->stats.latency_max_ns, &max, latency, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+	int bucket = latency ? 63 - __builtin_clzll(latency) : 0;
+	if (bucket > 31) {
+		bucket = 31;
+	}
+	add_stat(self, latency_log2_ns[bucket], 1);
+}
+
+static void *writer_thread(struct relay_shared *self)
+{
+	struct relay_client *client = self->client;
+	struct relay_shared_node *nodes[WRITE_BATCH];
+	while (true) {
+		writer_wait(self);
+		size_t count = 0;
+		while (count < WRITE_BATCH && (nodes[count] = queue_pop(self))) {
+			count++;
+		}
+		if (count == 0) {
+			if (__atomic_load_n(&self->stopping, __ATOMIC_ACQUIRE) && get_stat(self, depth) == 0) {
+				break;
+			}
+			/* A producer is mid-push */
+			sched_yield();
+			continue;
+		}
+		/* After a failure, queued packets are discarded */
+		if (!(__atomic_load_n(&self->failed, __ATOMIC_RELAXED) & RSF_WRITE_FAILED)) {
+			bool ok = relay_client_batch_begin(client);
+			for (size_t i = 0; i < count; i++) {
+				ok = ok && relay_client_batch_append3(client, &nodes[i]->packet);
+			}
+			ok = relay_client_flush(client) && ok;
+			if (!ok) {
+				log_error("Shared relay client failed to write");
+				set_failed(self, RSF_WRITE_FAILED);
+			} else {
+				add_stat(self, written, count);
+			}
+		}
+		uint64_t now = now_ns();
+		for (size_t i = 0; i < count; i++) {
+			record_latency(self, now - nodes[i]->enqueued_ns);
+			relay_pool_release(nodes[i]);
+		}
+		add_stat(self, depth, -count);
+		/* Pairs with the fence in wait_for_room */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&self->producers_waiting, __ATOMIC_RELAXED)) {
+			pthread_mutex_lock(&self->full_lock);
+			pthread_cond_broadcast(&self->not_full);
+			pthread_mutex_unlock(&self->full_lock);
+		}
+	}
+	return NULL;
+}
+
+/* Receiver */
+
+static void *receiver_thread(struct relay_shared *self)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = relay_client_get_fd(self->client), .events = POLLIN },
+		{ .fd = self->fd_end, .events = POLLIN }
+	};
+	while (true) {
+		if (poll(pfd, 2, -1) == -1 && errno != EINTR) {
+			set_failed(self, RSF_RECV_FAILED);
+			break;
+		}
+		if (pfd[1].revents) {
+			break;
+		}
+		enum rca_recv_result res;
+		struct relay_packet *packet;
+		while ((res = relay_client_try_recv(self->client, &packet)) == rcarr_success) {
+			add_stat(self, received, 1);
+			self->dispatch(packet, self->misc);
+		}
+		if (res == rcarr_eof) {
+			log_debug("Shared relay client input closed");
+			break;
+		} else if (res == rcarr_fail) {
+			set_failed(self, RSF_RECV_FAILED);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* The client outlives us, so hand its fd back as it was given */
+static void restore_flags(struct relay_shared *self)
+{
+	if (self->fd_flags != -1) {
+		fcntl(relay_client_get_fd(self->client), F_SETFL, self->fd_flags);
+		self->fd_flags = -1;
+	}
+}
+
+bool relay_shared_init(struct relay_shared *self, struct relay_client *client, relay_shared_dispatch *dispatch, void *misc)
+{
+	memset(self, 0, sizeof(*self));
+	self->client = client;
+	self->dispatch = dispatch;
+	self->misc = misc;
+	self->fd_wake = -1;
+	self->fd_end = -1;
+	self->fd_flags = -1;
+	if (dispatch) {
+		int fd = relay_client_get_fd(client);
+		int flags = fd == -1 ? -1 : fcntl(fd, F_GETFL);
+		if (!client->adapter->try_recv || flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+			log_error("Relay client adapter does not support non-blocking receive");
+			return false;
+		}
+		self->fd_flags = flags;
+	}
+	if (!relay_pool_init(&self->pool)) {
+		restore_flags(self);
+		return false;
+	}
+	pthread_mutex_init(&self->full_lock, NULL);
+	pthread_cond_init(&self->not_full, NULL);
+	self->stub = calloc(1, sizeof(*self->stub));
+	self->head = self->stub;
+	self->tail = self->stub;
+	self->fd_wake = eventfd(0, EFD_NONBLOCK);
+	self->fd_end = eventfd(0, 0);
+	if (!self->stub || self->fd_wake == -1 || self->fd_end == -1) {
+		log_error("Failed to initialise shared relay client (%s)", strerror(errno));
+		goto fail;
+	}
+	if (pthread_create(&self->writer, NULL, (void*(*)(void*)) writer_thread, self)) {
+		log_error("Failed to start shared relay client writer");
+		goto fail;
+	}
+	if (dispatch && pthread_create(&self->receiver, NULL, (void*(*)(void*)) receiver_thread, self)) {
+		log_error("Failed to start shared relay client receiver");
+		__atomic_store_n(&self->stopping, true, __ATOMIC_RELEASE);
+		signal_fd(self->fd_wake);
+		pthread_join(self->writer, NULL);
+		goto fail;
+	}
+	return true;
+fail:
+	free(self->stub);
+	if (self->fd_wake != -1) {
+		close(self->fd_wake);
+	}
+	if (self->fd_end != -1) {
+		close(self->fd_end);
+	}
+	relay_pool_destroy(&self->pool);
+	pthread_mutex_destroy(&self->full_lock);
+	pthread_cond_destroy(&self->not_full);
+	restore_flags(self);
+	return false;
+}
+
+void relay_shared_destroy(struct relay_shared *self)
+{
+	__atomic_store_n(&self->stopping, true, __ATOMIC_RELEASE);
+	signal_fd(self->fd_wake);
+	pthread_join(self->writer, NULL);
+	if (self->dispatch) {
+		signal_fd(self->fd_end);
+		pthread_join(self->receiver, NULL);
+	}
+	free(self->stub);
+	close(self->fd_wake);
+	close(self->fd_end);
+	relay_pool_destroy(&self->pool);
+	pthread_mutex_destroy(&self->full_lock);
+	pthread_cond_destroy(&self->not_full);
+	restore_flags(self);
+}
+
+void relay_shared_set_limit(struct relay_shared *self, size_t max_depth, enum relay_shared_full_policy policy)
+{
+	self->limit = max_depth;
+	self->full_policy = policy;
+}
+
+void relay_shared_get_stats(struct relay_shared *self, struct relay_shared_stats *out)
+{
+	out->enqueued = get_stat(self, enqueued);
+	out->written = get_stat(self, written);
+	out->depth = get_stat(self, depth);
+	out->max_depth = get_stat(self, max_depth);
+	out->full = get_stat(self, full);
+	out->latency_total_ns = get_stat(self, latency_total_ns);
+	out->latency_max_ns = get_stat(self, latency_max_ns);
+	for (size_t i = 0; i < sizeof(out->latency_log2_ns)/sizeof(out->latency_log2_ns[0]); i++) {
+		out->latency_log2_ns[i] = get_stat(self, latency_log2_ns[i]);
+	}
+	out->received = get_stat(self, received);
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <cstd/std.h>
+#include "relay_client.h"
+#include "relay_pool.h"
+
+/*
+ * Shares one relay client (and so one server session) between threads.
+ *
+ * Any thread may send: packets are serialised into a copy and pushed onto a
+ * lock-free multi-producer queue, which a writer thread drains with gathered
+ * writes.  If a dispatch function is given, a receive thread calls it for
+ * every incoming packet (the function owns the packet and frees it with
+ * free).  Receiving needs an adapter with get_fd and try_recv.
+ *
+ * Sends return once the packet is queued; a write failure is reported
+ * through failed and by later sends returning false.
+ *
+ * The queue is unbounded unless a limit is set with relay_shared_set_limit,
+ * so without one, producers which outpace the connection must throttle
+ * themselves or the queue (and its latency) grows without bound.
+ */
+
+typedef void relay_shared_dispatch(struct relay_packet *packet, void *misc);
+
+/* What a send does when the queue is at its limit */
+enum relay_shared_full_policy {
+	/* Wait for the writer to make room */
+	rsfp_block = 0,
+	/* Return false with errno EAGAIN, queueing nothing */
+	rsfp_fail = 1
+};
+
+struct relay_shared_node;
+
+/* Counters, updated with relaxed atomics */
+struct relay_shared_stats {
+	uint64_t enqueued;
+	uint64_t written;
+	/* Packets queued but not yet written */
+	uint64_t depth;
+	uint64_t max_depth;
+	/* Sends which found the queue at its limit */
+	uint64_t full;
+	/* Time from enqueue to the write completing */
+	uint64_t latency_total_ns;
+	uint64_t latency_max_ns;
+	/* Count of latencies in [2^i, 2^(i+1)) ns */
+	uint64_t latency_log2_ns[32];
+	uint64_t received;
+};
+
+#define RSF_WRITE_FAILED 1
+#define RSF_RECV_FAILED 2
+
+struct relay_shared {
+	struct relay_client *client;
+	relay_shared_dispatch *dispatch;
+	void *misc;
+	struct relay_pool pool;
+	/* Producers swap themselves in at head, the writer consumes from tail */
+	struct relay_shared_node *head __attribute__((aligned(64)));
+	struct relay_shared_node *tail __attribute__((aligned(64)));
+	struct relay_shared_node *stub;
+	uint32_t writer_waiting;
+	/* Queue limit (0 for none), and producers blocked on it */
+	uint64_t limit;
+	enum relay_shared_full_policy full_policy;
+	uint32_t producers_waiting;
+	pthread_mutex_t full_lock;
+	pthread_cond_t not_full;
+	int fd_wake;
+	int fd_end;
+	/* Flags of the client's fd before it was made non-blocking, restored on destroy (-1 if unchanged) */
+	int fd_flags;
+	bool stopping;
+	pthread_t writer;
+	pthread_t receiver;
+	int failed;
+	struct relay_shared_stats stats;
+};
+
+/* Client must already be initialised, and is not destroyed with the shared client */
+bool relay_shared_init(struct relay_shared *self, struct relay_client *client, relay_shared_dispatch *dispatch, void *misc);
+/* Writes everything already queued, then stops both threads */
+void relay_shared_destroy(struct relay_shared *self);
+
+/*
+ * Limits the queue to max_depth packets (0 for no limit).  The limit may be
+ * overshot by one packet per producer racing for the last place.  Call before
+ * the shared client is used by other threads.
+ */
+void relay_shared_set_limit(struct relay_shared *self, size_t max_depth, enum relay_shared_full_policy policy);
+
+bool relay_shared_send(struct relay_shared *self, const char *type, const char *remote, const void *data, size_t length);
+bool relay_shared_send2(struct relay_shared *self, const struct relay_packet *packet);
+bool relay_shared_send_template(struct relay_shared *self, const struct relay_header_template *tpl, const void *data, size_t length);
+
+void relay_shared_get_stats(struct relay_shared *self, struct relay_shared_stats *out);
@@ -0,0 +1,415 @@
+#include <cstd/unix.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include "relay_shm.h"
+
+/* Polls of the ring before going to sleep on the eventfd */
+#define SPIN_LIMIT 200
+
+#if defined __x86_64__ || defined __i386__
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* Ring header, producer and consumer fields on separate cache lines */
+struct shm_ring {
+	/* Total bytes written, and producer state */
+	uint64_t head __attribute__((aligned(64)));
+	uint32_t producer_waiting;
+	uint32_t producer_closed;
+	/* Total bytes consumed, and consumer state */
+	uint64_t tail __attribute__((aligned(64)));
+	uint32_t consumer_waiting;
+	uint32_t consumer_closed;
+	char data[] __attribute__((aligned(64)));
+};
+
+struct rca_shm_data {
+	void *segment;
+	size_t segment_size;
+	size_t ring_size;
+	struct shm_ring *tx;
+	struct shm_ring *rx;
+	/* Eventfds: our data/space and the peer's data/space */
+	int tx_data;
+	int tx_space;
+	int rx_data;
+	int rx_space;
+};
+
+static size_t ring_stride(size_t ring_size)
+{
+	return sizeof(struct shm_ring) + ring_size;
+}
+
+bool relay_shm_channel_create(struct relay_shm_channel *channel, size_t ring_size)
+{
+	memset(channel, 0, sizeof(*channel));
+	channel->memfd = -1;
+	for (size_t i = 0; i < RELAY_SHM_EVENTS; i++) {
+		channel->efd[i] = -1;
+	}
+	if (ring_size == 0 || (ring_size & (ring_size - 1))) {
+		log_error("Shared-memory ring size must be a power of two (got %zu)", ring_size);
+		return false;
+	}
+	channel->ring_size = ring_size;
+	channel->memfd = syscall(SYS_memfd_create, "relay_shm", MFD_CLOEXEC);
+	if (channel->memfd == -1 || ftruncate(channel->memfd, 2 * ring_stride(ring_size)) == -1) {
+		log_error("Failed to create shared-memory segment (%s)", strerror(errno));
+		goto fail;
+	}
+	for (size_t i = 0; i < RELAY_SHM_EVENTS; i++) {
+		channel->efd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (channel->efd[i] == -1) {
+			log_error("Failed to create eventfd (%s)", strerror(errno));
+			goto fail;
+		}
+	}
+	return true;
+fail:
+	relay_shm_channel_close(channel);
+	return false;
+}
+
+void relay_shm_channel_close(struct relay_shm_channel *channel)
+{
+	if (channel->memfd != -1) {
+		close(channel->memfd);
+		channel->memfd = -1;
+	}
+	for (size_t i = 0; i < RELAY_SHM_EVENTS; i++) {
+		if (channel->efd[i] != -1) {
+			close(channel->efd[i]);
+			channel->efd[i] = -1;
+		}
+	}
+}
+
+/* Wakeups */
+
+static void signal_fd(int fd)
+{
+	uint64_t n = 1;
+	if (write(fd, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+		log_error("Failed to signal eventfd (%s)", strerror(errno));
+	}
+}
+
+static void clear_fd(int fd)
+{
+	uint64_t n;
+	if (read(fd, &n, sizeof(n)) == -1 && errno != EAGAIN) {
+		log_error("Failed to clear eventfd (%s)", strerror(errno));
+	}
+}
+
+/* Wake the other side if it has said that it is sleeping */
+static void wake(uint32_t *waiting, int fd)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+		__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+		signal_fd(fd);
+	}
+}
+
+static size_t ring_used(struct shm_ring *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static bool can_read(struct rca_shm_data *this)
+{
+	return ring_used(this->rx) > 0 || __atomic_load_n(&this->rx->producer_closed, __ATOMIC_ACQUIRE);
+}
+
+static bool can_write(struct rca_shm_data *this)
+{
+	return ring_used(this->tx) < this->ring_size || __atomic_load_n(&this->tx->consumer_closed, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Wait until ready() holds: spin first, then flag that we are sleeping,
+ * re-check (the other side checks the flag after each update), and sleep.
+ */
+static bool wait_for(struct rca_shm_data *this, bool (*ready)(struct rca_shm_data *), uint32_t *waiting, int fd)
+{
+	for (int i = 0; i < SPIN_LIMIT; i++) {
+		if (ready(this)) {
+			return true;
+		}
+		cpu_relax();
+	}
+	while (!ready(this)) {
+		__atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (ready(this)) {
+			break;
+		}
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+			log_error("Failed to wait on eventfd (%s)", strerror(errno));
+			return false;
+		}
+		clear_fd(fd);
+	}
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* Ring I/O, returns bytes moved (zero if ring is empty/full) */
+
+static size_t ring_write(struct rca_shm_data *this, const void *buf, size_t length)
+{
+	struct shm_ring *ring = this->tx;
+	uint64_t head = ring->head;
+	size_t space = this->ring_size - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+	if (length > space) {
+		length = space;
+	}
+	size_t offset = head & (this->ring_size - 1);
+	size_t first = this->ring_size - offset;
+	if (first > length) {
+		first = length;
+	}
+	memcpy(ring->data + offset, buf, first);
+	memcpy(ring->data, buf + first, length - first);
+	__atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+	if (length) {
+		wake(&ring->consumer_waiting, this->tx_data);
+	}
+	return length;
+}
+
+static size_t ring_read(struct rca_shm_data *this, void *buf, size_t length)
+{
+	struct shm_ring *ring = this->rx;
+	uint64_t tail = ring->tail;
+	size_t used = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+	if (length > used) {
+		length = used;
+	}
+	size_t offset = tail & (this->ring_size - 1);
+	size_t first = this->ring_size - offset;
+	if (first > length) {
+		first = length;
+	}
+	memcpy(buf, ring->data + offset, first);
+	memcpy(buf + first, ring->data, length - first);
+	__atomic_store_n(&ring->tail, tail + length, __ATOMIC_RELEASE);
+	if (length) {
+		wake(&ring->producer_waiting, this->rx_space);
+	}
+	return length;
+}
+
+/* Adapter */
+
+static bool rca_shm_init(struct relay_client *self, const void *initargs)
+{
+	struct rca_shm_data *this = self->data;
+	const struct relay_client_shm_data *args = initargs;
+	const struct relay_shm_channel *channel = args->channel;
+	this->tx_data = this->tx_space = this->rx_data = this->rx_space = -1;
+	if (args->side != 0 && args->side != 1) {
+		log_error("Invalid shared-memory channel side %d", args->side);
+		return false;
+	}
+	this->ring_size = channel->ring_size;
+	this->segment_size = 2 * ring_stride(channel->ring_size);
+	this->segment = mmap(NULL, this->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, channel->memfd, 0);
+	if (this->segment == MAP_FAILED) {
+		this->segment = NULL;
+		log_error("Failed to map shared-memory segment (%s)", strerror(errno));
+		return false;
+	}
+	int tx = args->side;
+	int rx = 1 - tx;
+	this->tx = this->segment + tx * ring_stride(channel->ring_size);
+	this->rx = this->segment + rx * ring_stride(channel->ring_size);
+	this->tx_data = dup(channel->efd[2 * tx]);
+	this->tx_space = dup(channel->efd[2 * tx + 1]);
+	this->rx_data = dup(channel->efd[2 * rx]);
+	this->rx_space = dup(channel->efd[2 * rx + 1]);
+	if (this->tx_data == -1 || this->tx_space == -1 || this->rx_data == -1 || this->rx_space == -1) {
+		log_error("Failed to duplicate eventfds (%s)", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static void rca_shm_destroy(struct relay_client *self)
+{
+	struct rca_shm_data *this = self->data;
+	if (this->segment) {
+		/* Tell the peer that we are gone, waking it if it is waiting on us */
+		__atomic_store_n(&this->tx->producer_closed, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&this->rx->consumer_closed, 1, __ATOMIC_RELEASE);
+		signal_fd(this->tx_data);
+		signal_fd(this->rx_space);
+		munmap(this->segment, this->segment_size);
+	}
+	int fds[] = { this->tx_data, this->tx_space, this->rx_data, this->rx_space };
+	for (size_t i = 0; i < sizeof(fds)/sizeof(fds[0]); i++) {
+		if (fds[i] != -1) {
+			close(fds[i]);
+		}
+	}
+}
+
+static bool rca_shm_send(struct relay_client *self, const void *buf, size_t length)
+{
+	struct rca_shm_data *this = self->data;
+	for (size_t done = 0; done < length; ) {
+		if (!wait_for(this, can_write, &this->tx->producer_waiting, this->tx_space)) {
+			return false;
+		}
+		if (__atomic_load_n(&this->tx->consumer_closed, __ATOMIC_ACQUIRE)) {
+			log_error("Shared-memory peer has closed");
+			errno = EPIPE;
+			return false;
+		}
+		done += ring_write(this, buf + done, length - done);
+	}
+	return true;
+}
+
+static bool rca_shm_sendv(struct relay_client *self, const struct iovec *iov, size_t iovcnt)
+{
+	for (size_t i = 0; i < iovcnt; i++) {
+		if (!rca_shm_send(self, iov[i].iov_base, iov[i].iov_len)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static enum rca_recv_result rca_shm_recv_some(struct relay_client *self, void *buf, size_t length, size_t *received)
+{
+	struct rca_shm_data *this = self->data;
+	if (!wait_for(this, can_read, &this->rx->consumer_waiting, this->rx_data)) {
+		return rcarr_fail;
+	}
+	*received = ring_read(this, buf, length);
+	/* Producer closed and everything it wrote has been read */
+	return *received ? rcarr_success : rcarr_eof;
+}
+
+static enum rca_recv_result rca_shm_recv(struct relay_client *self, void *buf, size_t length)
+{
+	for (size_t done = 0; done < length; ) {
+		size_t received;
+		enum rca_recv_result res = rca_shm_recv_some(self, buf + done, length - done, &received);
+		if (res != rcarr_success) {
+			return res;
+		}
+		done += received;
+	}
+	return rcarr_success;
+}
+
+static enum rca_recv_result rca_shm_try_recv(struct relay_client *self, void *buf, size_t length, size_t *received)
+{
+	struct rca_shm_data *this = self->data;
+	*received = ring_read(this, buf, length);
+	if (*received) {
+		return rcarr_success;
+	}
+	if (__atomic_load_n(&this->rx->producer_closed, __ATOMIC_ACQUIRE)) {
+		/* Re-read in case data landed between the read and the close */
+		*received = ring_read(this, buf, length);
+		return *received ? rcarr_success : rcarr_eof;
+	}
+	/* Ask the producer to signal our fd, the caller will wait on it */
+	clear_fd(this->rx_data);
+	__atomic_store_n(&this->rx->consumer_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	*received = ring_read(this, buf, length);
+	return *received ? rcarr_success : rcarr_again;
+}
+
+/* Writes as much of the vector as fits, after skipping its first skip bytes */
+static size_t ring_writev(struct rca_shm_data *this, const struct iovec *iov, size_t iovcnt, size_t skip)
+{
+	size_t sent = 0;
+	for (size_t i = 0; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		size_t length = iov[i].iov_len - skip;
+		size_t written = ring_write(this, iov[i].iov_base + skip, length);
+		sent += written;
+		skip = 0;
+		if (written < length) {
+			break;
+		}
+	}
+	return sent;
+}
+
+static enum rca_recv_result rca_shm_try_sendv(struct relay_client *self, const struct iovec *iov, size_t iovcnt, size_t *sent)
+{
+	struct rca_shm_data *this = self->data;
+	*sent = 0;
+	if (__atomic_load_n(&this->tx->consumer_closed, __ATOMIC_ACQUIRE)) {
+		errno = EPIPE;
+		return rcarr_fail;
+	}
+	size_t total = 0;
+	for (size_t i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	*sent = ring_writev(this, iov, iovcnt, 0);
+	if (*sent == total) {
+		return rcarr_success;
+	}
+	/* Ring is full, ask the consumer to signal our fd, the caller will wait on it */
+	clear_fd(this->tx_space);
+	__atomic_store_n(&this->tx->producer_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	*sent += ring_writev(this, iov, iovcnt, *sent);
+	return *sent ? rcarr_success : rcarr_again;
+}
+
+/* Becomes readable when the peer has written data after try_recv returned rcarr_again */
+static int rca_shm_get_fd(struct relay_client *self)
+{
+	struct rca_shm_data *this = self->data;
+	return this->rx_data;
+}
+
+/* Becomes readable when the peer has made space after try_sendv could not send everything */
+static int rca_shm_get_send_fd(struct relay_client *self, short *events)
+{
+	struct rca_shm_data *this = self->data;
+	*events = POLLIN;
+	return this->tx_space;
+}
+
+const struct relay_client_adapter relay_client_shm_adapter = {
+	.init = rca_shm_init,
+	.destroy = rca_shm_destroy,
+	.send = rca_shm_send,
+	.recv = rca_shm_recv,
+	.sendv = rca_shm_sendv,
+	.recv_some = rca_shm_recv_some,
+	.try_recv = rca_shm_try_recv,
+	.try_sendv = rca_shm_try_sendv,
+	.get_fd = rca_shm_get_fd,
+	.get_send_fd = rca_shm_get_send_fd,
+	.instdata_size = sizeof(struct rca_shm_data)
+};
+
+bool relay_client_init_shm(struct relay_client *self, const char *local, const struct relay_shm_channel *channel, int side)
+{
+	struct relay_client_shm_data args = {
+		.channel = channel,
+		.side = side
+	};
+	return relay_client_init(self, local, &relay_client_shm_adapter, &args);
+}
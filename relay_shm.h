@@ -0,0 +1,45 @@
+#pragma once
+#include <cstd/std.h>
+#include "relay_client.h"
+
+/*
+ * Shared-memory adapter for endpoints on the same host.
+ *
+ * A channel is a memfd segment holding two lock-free single-producer/single-
+ * consumer byte rings, one per direction, carrying the usual serialised
+ * packet stream.  Eventfds are only used to wake a side which went to sleep
+ * waiting for data or for space, so a busy channel hands off packets without
+ * syscalls.
+ *
+ * Create a channel, then hand it to both endpoints (share it across fork or
+ * pass its descriptors over a unix socket) and init one client on each side.
+ * Each client duplicates the descriptors it needs, so the channel may be
+ * closed once both clients are initialised.  No authentication is done.
+ *
+ * For the non-blocking functions, relay_client_get_fd becomes readable when
+ * data arrives, and relay_client_get_send_fd gives a second descriptor which
+ * becomes readable (POLLIN, not POLLOUT) when the peer makes space.
+ */
+
+#define RELAY_SHM_EVENTS 4
+
+struct relay_shm_channel {
+	int memfd;
+	/* Size of each ring in bytes, power of two */
+	size_t ring_size;
+	/* Data-available and space-available eventfds for each ring */
+	int efd[RELAY_SHM_EVENTS];
+};
+
+bool relay_shm_channel_create(struct relay_shm_channel *channel, size_t ring_size);
+void relay_shm_channel_close(struct relay_shm_channel *channel);
+
+struct relay_client_shm_data {
+	const struct relay_shm_channel *channel;
+	/* Which end of the channel this is, 0 or 1 */
+	int side;
+};
+
+extern const struct relay_client_adapter relay_client_shm_adapter;
+
+bool relay_client_init_shm(struct relay_client *self, const char *local, const struct relay_shm_channel *channel, int side);
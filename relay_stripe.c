@@ -0,0 +1,222 @@
+#include <limits.h>
+#include <cstd/unix.h>
+#include <linux/sockios.h>
+#include "relay_stripe.h"
+
+/* Choosing a stripe */
+
+static size_t pick_least_queued(struct relay_stripe *self)
+{
+	size_t best = 0;
+	int best_queued = INT_MAX;
+	for (size_t i = 0; i < self->count; i++) {
+		int queued = 0;
+		/* Not a socket: treat as empty */
+		if (ioctl(relay_client_get_fd(&self->clients[i]), SIOCOUTQ, &queued) == -1) {
+			queued = 0;
+		}
+		if (queued < best_queued) {
+			best = i;
+			best_queued = queued;
+		}
+	}
+	return best;
+}
+
+/* FNV-1a over the fixed-width type and remote fields */
+static size_t pick_pinned(struct relay_stripe *self, const struct relay_packet *packet)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < RELAY_TYPE_LENGTH && packet->type[i]; i++) {
+		hash = (hash ^ (uint8_t) packet->type[i]) * 16777619u;
+	}
+	for (size_t i = 0; i < RELAY_ENDPOINT_LENGTH && packet->remote[i]; i++) {
+		hash = (hash ^ (uint8_t) packet->remote[i]) * 16777619u;
+	}
+	return hash % self->count;
+}
+
+static struct relay_client *pick(struct relay_stripe *self, const struct relay_packet *packet)
+{
+	size_t index;
+	switch (self->policy) {
+	case rsp_least_queued:
+		index = pick_least_queued(self);
+		break;
+	case rsp_pinned:
+		index = pick_pinned(self, packet);
+		break;
+	default:
+		index = self->next_send++ % self->count;
+		break;
+	}
+	return &self->clients[index];
+}
+
+/* Sending */
+
+bool relay_stripe_send_packet(struct relay_stripe *self, const char *type, const char *remote, const void *data, size_t length)
+{
+	struct relay_packet p;
+	relay_make_packet(&p, type, remote, self->local, (char *) data, length);
+	return relay_stripe_send_packet2(self, &p);
+}
+
+bool relay_stripe_send_packet2(struct relay_stripe *self, const struct relay_packet *packet)
+{
+	return relay_client_send_packet2(pick(self, packet), packet);
+}
+
+/* Receiving */
+
+/* Most duplicates discarded from one stripe per call, so that none starves the rest */
+#define DISCARD_BATCH 64
+
+static void stripe_closed(struct relay_stripe *self, size_t i)
+{
+	log_debug("Stripe %zu reached EOF", i);
+	self->closed[i] = true;
+	epoll_ctl(self->ep, EPOLL_CTL_DEL, relay_client_get_fd(&self->clients[i]), NULL);
+}
+
+/* Read and drop the other stripes' copies of incoming packets */
+static void discard_duplicates(struct relay_stripe *self)
+{
+	for (size_t i = 1; i < self->count; i++) {
+		for (size_t n = 0; !self->closed[i] && n < DISCARD_BATCH; n++) {
+			struct relay_packet *p;
+			enum rca_recv_result res = relay_client_try_recv(&self->clients[i], &p);
+			if (res == rcarr_success) {
+				free(p);
+			} else if (res == rcarr_again) {
+				break;
+			} else {
+				stripe_closed(self, i);
+			}
+		}
+	}
+}
+
+enum rca_recv_result relay_stripe_try_recv(struct relay_stripe *self, struct relay_packet **out)
+{
+	*out = NULL;
+	discard_duplicates(self);
+	if (self->closed[0]) {
+		return rcarr_eof;
+	}
+	enum rca_recv_result res = relay_client_try_recv(&self->clients[0], out);
+	if (res == rcarr_eof) {
+		stripe_closed(self, 0);
+	}
+	return res;
+}
+
+bool relay_stripe_recv_packet(struct relay_stripe *self, struct relay_packet **out)
+{
+	while (true) {
+		switch (relay_stripe_try_recv(self, out)) {
+		case rcarr_success:
+			return true;
+		case rcarr_eof:
+			*out = NULL;
+			return true;
+		case rcarr_again:
+			break;
+		default:
+			return false;
+		}
+		struct epoll_event epev;
+		if (epoll_wait(self->ep, &epev, 1, -1) == -1 && errno != EINTR) {
+			log_error("Failed to wait for stripes (%s)", strerror(errno));
+			return false;
+		}
+	}
+}
+
+int relay_stripe_get_fd(struct relay_stripe *self)
+{
+	return self->ep;
+}
+
+/* Lifecycle */
+
+bool relay_stripe_init(struct relay_stripe *self, size_t count, enum relay_stripe_policy policy, struct relay_client *clients)
+{
+	memset(self, 0, sizeof(*self));
+	self->count = count;
+	self->clients = clients;
+	self->policy = policy;
+	self->closed = calloc(count, sizeof(*self->closed));
+	self->fd_flags = malloc(count * sizeof(*self->fd_flags));
+	self->ep = epoll_create1(0);
+	if (count == 0 || !self->closed || !self->fd_flags || self->ep == -1) {
+		log_error("Failed to initialise striped client");
+		goto fail;
+	}
+	for (size_t i = 0; i < count; i++) {
+		self->fd_flags[i] = -1;
+	}
+	strcpy(self->local, clients[0].local);
+	for (size_t i = 0; i < count; i++) {
+		if (strcmp(clients[i].local, self->local) != 0) {
+			log_error("Stripe %zu is \"%s\", not \"%s\"", i, clients[i].local, self->local);
+			goto fail;
+		}
+		/* Stripes are read with try_recv */
+		int fd = relay_client_get_fd(&clients[i]);
+		int flags = fd == -1 ? -1 : fcntl(fd, F_GETFL);
+		struct epoll_event epev = { .events = EPOLLIN, .data = { .u64 = i } };
+		if (!clients[i].adapter->try_recv || flags == -1 ||
+				fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+			log_error("Stripe %zu does not support non-blocking receive", i);
+			goto fail;
+		}
+		self->fd_flags[i] = flags;
+		if (epoll_ctl(self->ep, EPOLL_CTL_ADD, fd, &epev) == -1) {
+			log_error("Failed to watch stripe %zu (%s)", i, strerror(errno));
+			goto fail;
+		}
+	}
+	return true;
+fail:
+	relay_stripe_destroy(self);
+	return false;
+}
+
+bool relay_stripe_init_socket(struct relay_stripe *self, size_t count, enum relay_stripe_policy policy, const char *local, const char *addr, const char *port)
+{
+	struct relay_client *clients = calloc(count, sizeof(*clients));
+	if (!clients) {
+		return false;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (!relay_client_init_socket(&clients[i], local, addr, port)) {
+			log_error("Failed to connect stripe %zu of %zu", i, count);
+			while (i--) {
+				relay_client_destroy(&clients[i]);
+			}
+			free(clients);
+			return false;
+		}
+	}
+	return relay_stripe_init(self, count, policy, clients);
+}
+
+void relay_stripe_destroy(struct relay_stripe *self)
+{
+	for (size_t i = 0; i < self->count; i++) {
+		/* Hand the fd back as it was given to us */
+		if (self->fd_flags && self->fd_flags[i] != -1) {
+			fcntl(relay_client_get_fd(&self->clients[i]), F_SETFL, self->fd_flags[i]);
+		}
+		relay_client_destroy(&self->clients[i]);
+	}
+	free(self->clients);
+	free(self->closed);
+	free(self->fd_flags);
+	if (self->ep != -1) {
+		close(self->ep);
+	}
+	memset(self, 0, sizeof(*self));
+	self->ep = -1;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstd/std.h>
+#include "relay_client.h"
+
+/*
+ * One logical client over several connections under the same local name.
+ *
+ * Outgoing packets are spread over the stripes according to the policy;
+ * only rsp_pinned keeps packets to the same (type, remote) in order, as it
+ * always uses the same stripe for them.
+ *
+ * The server delivers every packet for a name to each session with that name,
+ * so each stripe receives its own copy of all incoming traffic.  Only the
+ * first stripe's packets are returned (in order); the others' copies are read
+ * and discarded so that they do not back up in the server.  Striping therefore
+ * spreads outgoing traffic only, and incoming traffic costs count times the
+ * bandwidth.
+ *
+ * As with relay_client, one thread may send while another receives, but
+ * sends (or receives) must not be made from several threads at once.
+ */
+
+enum relay_stripe_policy {
+	/* Each stripe in turn */
+	rsp_round_robin = 0,
+	/* Stripe with the least unsent data in its socket send queue */
+	rsp_least_queued = 1,
+	/* Stripe chosen by hash of type and remote */
+	rsp_pinned = 2
+};
+
+struct relay_stripe {
+	/* Name shared by all stripes */
+	char local[RELAY_ENDPOINT_LENGTH + 1];
+	size_t count;
+	struct relay_client *clients;
+	/* Stripes which have reached EOF */
+	bool *closed;
+	/* Flags of each stripe's fd before it was made non-blocking, restored on destroy (-1 if unchanged) */
+	int *fd_flags;
+	enum relay_stripe_policy policy;
+	size_t next_send;
+	int ep;
+};
+
+/* Connects and authenticates count stripes */
+bool relay_stripe_init_socket(struct relay_stripe *self, size_t count, enum relay_stripe_policy policy, const char *local, const char *addr, const char *port);
+/*
+ * Stripes over a malloc'd array of initialised (authenticated) clients, all
+ * with the same name, which the stripe then owns and frees, even if this fails.
+ */
+bool relay_stripe_init(struct relay_stripe *self, size_t count, enum relay_stripe_policy policy, struct relay_client *clients);
+void relay_stripe_destroy(struct relay_stripe *self);
+
+bool relay_stripe_send_packet(struct relay_stripe *self, const char *type, const char *remote, const void *data, size_t length);
+bool relay_stripe_send_packet2(struct relay_stripe *self, const struct relay_packet *packet);
+
+/* Blocking receive, out is NULL once the first stripe is at EOF */
+bool relay_stripe_recv_packet(struct relay_stripe *self, struct relay_packet **out);
+/* Non-blocking receive, rcarr_eof once the first stripe is at EOF */
+enum rca_recv_result relay_stripe_try_recv(struct relay_stripe *self, struct relay_packet **out);
+/* Readable when any stripe may have data (to receive or discard), for use with poll/epoll */
+int relay_stripe_get_fd(struct relay_stripe *self);
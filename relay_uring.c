@@ -0,0 +1,759 @@
+#include <cstd/unix.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "relay_uring.h"
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+/* Multishot receives into provided buffers arrived in Linux 6.0 */
+#if defined IORING_RECV_MULTISHOT
+#define HAVE_URING
+#endif
+#endif
+
+#if defined HAVE_URING
+
+/* Number of times to check the completion queue before sleeping in the kernel */
+#define SQPOLL_SPIN 1000
+
+/* Size of each send staging buffer, larger sends go from the caller's memory */
+#define TX_STAGE_SIZE (64 << 10)
+
+/* Buffers provided to the kernel for multishot receives (a power of two) */
+#define RX_BUFFERS 16
+#define RX_BUFFER_SIZE (16 << 10)
+#define RX_GROUP 0
+
+struct uring {
+	int fd;
+	bool sqpoll;
+	/* Entries added to the submission queue since the last io_uring_enter */
+	unsigned queued;
+	/* Submission queue */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_flags;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	/* Completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Mappings */
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+};
+
+struct rca_uring_data {
+	int fd;
+	bool owns_fd;
+	bool is_socket;
+	struct uring tx;
+	struct uring rx;
+	/*
+	 * Sending: appends are copied into stage[cur] while the previous send is
+	 * in flight, so at most one send is outstanding and they complete in order
+	 */
+	char *stage[2];
+	int cur;
+	size_t staged;
+	bool corked;
+	bool tx_busy;
+	bool tx_failed;
+	/* Remainder of the send in flight, advanced after short writes */
+	struct iovec *tx_iov;
+	size_t tx_iovcnt;
+	struct iovec tx_one;
+	struct msghdr tx_msg;
+	/* Receiving: a multishot recv fills provided buffers ahead of the reader */
+	bool multishot;
+	bool armed;
+	bool rx_eof;
+	struct io_uring_buf_ring *buf_ring;
+	char *rx_bufs;
+	/* Provided buffer being consumed, -1 if none */
+	int rx_bid;
+	size_t rx_off;
+	size_t rx_len;
+};
+
+static bool uring_init(struct uring *r, bool sqpoll, unsigned entries, unsigned cq_entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = cq_entries;
+	if (sqpoll) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 100;
+	}
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd == -1) {
+		return false;
+	}
+	r->sqpoll = sqpoll;
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_size > r->sq_size) {
+			r->sq_size = r->cq_size;
+		}
+		r->cq_size = r->sq_size;
+	}
+	r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		return false;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			return false;
+		}
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		return false;
+	}
+	r->sq_head = r->sq_ptr + p.sq_off.head;
+	r->sq_tail = r->sq_ptr + p.sq_off.tail;
+	r->sq_mask = r->sq_ptr + p.sq_off.ring_mask;
+	r->sq_flags = r->sq_ptr + p.sq_off.flags;
+	r->sq_array = r->sq_ptr + p.sq_off.array;
+	r->cq_head = r->cq_ptr + p.cq_off.head;
+	r->cq_tail = r->cq_ptr + p.cq_off.tail;
+	r->cq_mask = r->cq_ptr + p.cq_off.ring_mask;
+	r->cqes = r->cq_ptr + p.cq_off.cqes;
+	return true;
+}
+
+static void uring_destroy(struct uring *r)
+{
+	if (r->sqes) {
+		munmap(r->sqes, r->sqes_size);
+	}
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr) {
+		munmap(r->cq_ptr, r->cq_size);
+	}
+	if (r->sq_ptr) {
+		munmap(r->sq_ptr, r->sq_size);
+	}
+	if (r->fd > 0) {
+		close(r->fd);
+	}
+	memset(r, 0, sizeof(*r));
+}
+
+/* Next submission entry, zeroed, to be filled in then passed to uring_queue */
+static struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	unsigned idx = *r->sq_tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	return sqe;
+}
+
+/* Publishes the entry from uring_sqe, the kernel sees it at the next uring_enter */
+static void uring_queue(struct uring *r)
+{
+	__atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+}
+
+/* Submits queued entries, and if wait is set also waits for a completion */
+static int uring_enter(struct uring *r, bool wait)
+{
+	unsigned to_submit = r->queued;
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	r->queued = 0;
+	if (r->sqpoll) {
+		/* The kernel thread picks up new entries unless it has gone idle */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (to_submit && (__atomic_load_n(r->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)) {
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		}
+		to_submit = 0;
+	}
+	if (!to_submit && !flags) {
+		return 0;
+	}
+	while (syscall(__NR_io_uring_enter, r->fd, to_submit, wait ? 1 : 0, flags, NULL, 0) == -1) {
+		if (errno != EINTR) {
+			return -errno;
+		}
+		/* Interrupted while waiting, the entries were already submitted */
+		to_submit = 0;
+		flags &= ~IORING_ENTER_SQ_WAKEUP;
+	}
+	return 0;
+}
+
+static bool uring_reap(struct uring *r, struct io_uring_cqe *cqe)
+{
+	unsigned head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+	*cqe = r->cqes[head & *r->cq_mask];
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Submits queued entries and takes the next completion, waiting if there is none (-errno on failure) */
+static int uring_wait(struct uring *r, struct io_uring_cqe *cqe)
+{
+	if (r->sqpoll) {
+		int res = uring_enter(r, false);
+		if (res < 0) {
+			return res;
+		}
+		for (int i = 0; i < SQPOLL_SPIN; i++) {
+			if (uring_reap(r, cqe)) {
+				return 0;
+			}
+		}
+	} else if (!r->queued && uring_reap(r, cqe)) {
+		return 0;
+	}
+	/* One syscall both submits and waits */
+	while (!uring_reap(r, cqe)) {
+		int res = uring_enter(r, true);
+		if (res < 0) {
+			return res;
+		}
+	}
+	return 0;
+}
+
+/* Waits for readiness on a non-blocking fd, returns the poll result or -errno */
+static int uring_poll(struct uring *r, int fd, short events)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll_events = events;
+	uring_queue(r);
+	struct io_uring_cqe cqe;
+	int res = uring_wait(r, &cqe);
+	return res < 0 ? res : cqe.res;
+}
+
+/* Sending */
+
+/* Queues the send described by tx_iov, and submits it unless corked */
+static bool tx_submit(struct rca_uring_data *this)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&this->tx);
+	sqe->fd = this->fd;
+	if (this->is_socket) {
+		this->tx_msg = (struct msghdr) { .msg_iov = this->tx_iov, .msg_iovlen = this->tx_iovcnt };
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->addr = (uintptr_t) &this->tx_msg;
+		sqe->msg_flags = MSG_WAITALL;
+	} else {
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->addr = (uintptr_t) this->tx_iov;
+		sqe->len = this->tx_iovcnt;
+		/* Current file position */
+		sqe->off = (uint64_t) -1;
+	}
+	uring_queue(&this->tx);
+	this->tx_busy = true;
+	int res = this->corked ? 0 : uring_enter(&this->tx, false);
+	if (res < 0) {
+		log_error("Failed to submit send on fd (%s)", strerror(-res));
+		this->tx_failed = true;
+		return false;
+	}
+	return true;
+}
+
+/* Drops done bytes from the front of the send in flight */
+static void tx_advance(struct rca_uring_data *this, size_t done)
+{
+	while (this->tx_iovcnt > 0 && done >= this->tx_iov->iov_len) {
+		done -= this->tx_iov->iov_len;
+		this->tx_iov++;
+		this->tx_iovcnt--;
+	}
+	if (this->tx_iovcnt > 0) {
+		this->tx_iov->iov_base += done;
+		this->tx_iov->iov_len -= done;
+	}
+}
+
+/*
+ * Completes the send in flight, resubmitting the remainder after short writes.
+ * If block is false, only reaps a completion which has already arrived.
+ */
+static bool tx_reap(struct rca_uring_data *this, bool block)
+{
+	while (this->tx_busy) {
+		struct io_uring_cqe cqe;
+		if (block) {
+			int res = uring_wait(&this->tx, &cqe);
+			if (res < 0) {
+				log_error("Failed to wait for send on fd (%s)", strerror(-res));
+				this->tx_failed = true;
+				return false;
+			}
+		} else if (!uring_reap(&this->tx, &cqe)) {
+			return true;
+		}
+		this->tx_busy = false;
+		if (cqe.res == -EAGAIN) {
+			int res = uring_poll(&this->tx, this->fd, POLLOUT);
+			if (res < 0) {
+				log_error("Failed to wait for POLLOUT on fd (%s)", strerror(-res));
+				this->tx_failed = true;
+				return false;
+			}
+		} else if (cqe.res < 0) {
+			log_error("Failed to send on fd (%s)", strerror(-cqe.res));
+			this->tx_failed = true;
+			return false;
+		} else {
+			tx_advance(this, cqe.res);
+			if (this->tx_iovcnt == 0) {
+				return true;
+			}
+		}
+		if (!tx_submit(this)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Submits the staged appends once the previous send has completed */
+static bool tx_flush(struct rca_uring_data *this)
+{
+	if (this->staged == 0) {
+		return true;
+	}
+	if (!tx_reap(this, true)) {
+		return false;
+	}
+	this->tx_one = (struct iovec) { .iov_base = this->stage[this->cur], .iov_len = this->staged };
+	this->tx_iov = &this->tx_one;
+	this->tx_iovcnt = 1;
+	this->cur ^= 1;
+	this->staged = 0;
+	return tx_submit(this);
+}
+
+/* Sends everything, and waits until the kernel has all of it */
+static bool tx_drain(struct rca_uring_data *this)
+{
+	if (!tx_flush(this)) {
+		return false;
+	}
+	int res = uring_enter(&this->tx, false);
+	if (res < 0) {
+		log_error("Failed to submit send on fd (%s)", strerror(-res));
+		this->tx_failed = true;
+		return false;
+	}
+	return tx_reap(this, true);
+}
+
+/* Receiving */
+
+/* Hands a buffer (back) to the kernel for multishot receives */
+static void rx_provide(struct rca_uring_data *this, int bid)
+{
+	struct io_uring_buf_ring *br = this->buf_ring;
+	unsigned short tail = br->tail;
+	struct io_uring_buf *buf = &br->bufs[tail & (RX_BUFFERS - 1)];
+	buf->addr = (uintptr_t) (this->rx_bufs + (size_t) bid * RX_BUFFER_SIZE);
+	buf->len = RX_BUFFER_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Registers the provided buffers, false if the kernel does not support them */
+static bool rx_setup(struct rca_uring_data *this)
+{
+	size_t ring_size = RX_BUFFERS * sizeof(struct io_uring_buf);
+	void *br = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (br == MAP_FAILED) {
+		return false;
+	}
+	char *bufs = malloc(RX_BUFFERS * RX_BUFFER_SIZE);
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t) br,
+		.ring_entries = RX_BUFFERS,
+		.bgid = RX_GROUP
+	};
+	if (!bufs || syscall(__NR_io_uring_register, this->rx.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+		log_debug("Provided buffers unavailable (%s), using single reads", strerror(errno));
+		munmap(br, ring_size);
+		free(bufs);
+		return false;
+	}
+	this->buf_ring = br;
+	this->rx_bufs = bufs;
+	for (int bid = 0; bid < RX_BUFFERS; bid++) {
+		rx_provide(this, bid);
+	}
+	return true;
+}
+
+/* One read of up to length bytes into buf, returns bytes read or -errno */
+static int rx_read(struct rca_uring_data *this, void *buf, size_t length)
+{
+	while (true) {
+		struct io_uring_sqe *sqe = uring_sqe(&this->rx);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = this->fd;
+		sqe->addr = (uintptr_t) buf;
+		sqe->len = length;
+		/* Current file position */
+		sqe->off = (uint64_t) -1;
+		uring_queue(&this->rx);
+		struct io_uring_cqe cqe;
+		int res = uring_wait(&this->rx, &cqe);
+		if (res < 0) {
+			return res;
+		}
+		if (cqe.res == -EAGAIN) {
+			if ((res = uring_poll(&this->rx, this->fd, POLLIN)) < 0) {
+				return res;
+			}
+			continue;
+		}
+		return cqe.res;
+	}
+}
+
+/*
+ * Copies up to length received bytes into buf, from what the multishot recv
+ * has already buffered if anything, returns bytes copied, 0 at EOF, or -errno
+ */
+static int rx_multishot(struct rca_uring_data *this, void *buf, size_t length)
+{
+	while (this->rx_bid == -1) {
+		if (this->rx_eof) {
+			return 0;
+		}
+		if (!this->armed) {
+			struct io_uring_sqe *sqe = uring_sqe(&this->rx);
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = this->fd;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = RX_GROUP;
+			uring_queue(&this->rx);
+			this->armed = true;
+		}
+		struct io_uring_cqe cqe;
+		int res = uring_wait(&this->rx, &cqe);
+		if (res < 0) {
+			return res;
+		}
+		if (!(cqe.flags & IORING_CQE_F_MORE)) {
+			this->armed = false;
+		}
+		if (cqe.res == -ENOBUFS) {
+			/* Every buffer was filled before we got to them, re-arm */
+			continue;
+		} else if (cqe.res == -EAGAIN) {
+			if ((res = uring_poll(&this->rx, this->fd, POLLIN)) < 0) {
+				return res;
+			}
+			continue;
+		} else if (cqe.res == -EINVAL && !this->armed) {
+			log_debug("Multishot receive unsupported, using single reads");
+			this->multishot = false;
+			return rx_read(this, buf, length);
+		} else if (cqe.res < 0) {
+			return cqe.res;
+		} else if (cqe.res == 0) {
+			this->rx_eof = true;
+			return 0;
+		} else if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+			return -EIO;
+		}
+		this->rx_bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+		this->rx_off = 0;
+		this->rx_len = cqe.res;
+	}
+	size_t count = this->rx_len - this->rx_off;
+	if (count > length) {
+		count = length;
+	}
+	memcpy(buf, this->rx_bufs + (size_t) this->rx_bid * RX_BUFFER_SIZE + this->rx_off, count);
+	this->rx_off += count;
+	if (this->rx_off == this->rx_len) {
+		rx_provide(this, this->rx_bid);
+		this->rx_bid = -1;
+	}
+	return count;
+}
+
+static int rx_some(struct rca_uring_data *this, void *buf, size_t length)
+{
+	return this->multishot ? rx_multishot(this, buf, length) : rx_read(this, buf, length);
+}
+
+/* Adapter */
+
+/* Switches to the fd adapter, leaving the client as it was if that cannot be allocated */
+static bool use_fd_adapter(struct relay_client *self, const struct relay_client_uring_data *args)
+{
+	const struct relay_client_fd_data fdargs = {
+		.fd = args->fd,
+		.owns = args->owns,
+		.auth_needed = args->auth_needed
+	};
+	void *data = calloc(1, relay_client_fd_adapter.instdata_size);
+	if (!data) {
+		log_error("Failed to allocate fd adapter");
+		return false;
+	}
+	free(self->data);
+	self->adapter = &relay_client_fd_adapter;
+	self->data = data;
+	return self->adapter->init(self, &fdargs);
+}
+
+static bool rca_uring_init(struct relay_client *self, const void *initargs)
+{
+	struct rca_uring_data *this = self->data;
+	const struct relay_client_uring_data *args = initargs;
+	this->fd = args->fd;
+	this->owns_fd = args->owns;
+	this->rx_bid = -1;
+	if (!uring_init(&this->tx, args->sqpoll, 4, 8) || !uring_init(&this->rx, args->sqpoll, 4, 2 * RX_BUFFERS)) {
+		log_debug("io_uring unavailable (%s), falling back to fd adapter", strerror(errno));
+		uring_destroy(&this->tx);
+		uring_destroy(&this->rx);
+		/* On failure the client keeps this adapter, whose destroy closes the fd if owned */
+		return use_fd_adapter(self, args);
+	}
+	this->stage[0] = malloc(2 * TX_STAGE_SIZE);
+	if (!this->stage[0]) {
+		log_error("Failed to allocate send buffers");
+		return false;
+	}
+	this->stage[1] = this->stage[0] + TX_STAGE_SIZE;
+	struct stat ss;
+	if (fstat(this->fd, &ss) == 0 && S_ISSOCK(ss.st_mode)) {
+		log_debug("Configuring socket interface");
+		this->is_socket = true;
+		setsockopt_nodelay(this->fd);
+		setsockopt_keepalive(this->fd);
+		this->multishot = rx_setup(this);
+	}
+	if (args->auth_needed && !relay_client_authenticate(self)) {
+		log_error("Failed to authenticate with fd#%d (%s)", this->fd, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static void rca_uring_destroy(struct relay_client *self)
+{
+	struct rca_uring_data *this = self->data;
+	/* The staging buffers must outlive the sends from them */
+	if (this->tx.fd > 0 && !this->tx_failed) {
+		tx_drain(this);
+	}
+	uring_destroy(&this->tx);
+	uring_destroy(&this->rx);
+	if (this->buf_ring) {
+		munmap(this->buf_ring, RX_BUFFERS * sizeof(struct io_uring_buf));
+	}
+	free(this->rx_bufs);
+	free(this->stage[0]);
+	if (this->owns_fd) {
+		close(this->fd);
+	}
+}
+
+/*
+ * Small sends are copied into a staging buffer and submitted without waiting,
+ * so the caller carries on while the kernel sends; while corked they collect
+ * until the stage is full or the client is uncorked.  Larger sends go straight
+ * from the caller's buffers, which must then be waited for.
+ */
+static bool rca_uring_sendv(struct relay_client *self, const struct iovec *iov, size_t iovcnt)
+{
+	struct rca_uring_data *this = self->data;
+	if (this->tx_failed || !tx_reap(this, false)) {
+		return false;
+	}
+	size_t total = 0;
+	for (size_t i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+	}
+	if (this->staged + total > TX_STAGE_SIZE && !tx_flush(this)) {
+		return false;
+	}
+	if (total > TX_STAGE_SIZE) {
+		struct iovec vec[iovcnt];
+		memcpy(vec, iov, sizeof(vec));
+		if (!tx_reap(this, true)) {
+			return false;
+		}
+		this->tx_iov = vec;
+		this->tx_iovcnt = iovcnt;
+		tx_advance(this, 0);
+		return tx_submit(this) && tx_reap(this, true);
+	}
+	for (size_t i = 0; i < iovcnt; i++) {
+		memcpy(this->stage[this->cur] + this->staged, iov[i].iov_base, iov[i].iov_len);
+		this->staged += iov[i].iov_len;
+	}
+	return this->corked || tx_flush(this);
+}
+
+static bool rca_uring_send(struct relay_client *self, const void *buf, size_t length)
+{
+	struct iovec iov = { .iov_base = (void *) buf, .iov_len = length };
+	return rca_uring_sendv(self, &iov, 1);
+}
+
+static enum rca_recv_result rca_uring_recv(struct relay_client *self, void *buf, size_t length)
+{
+	struct rca_uring_data *this = self->data;
+	for (size_t done = 0; done < length; ) {
+		int res = rx_some(this, buf + done, length - done);
+		if (res < 0) {
+			log_error("Failed to read %zu bytes on fd (%s)", length, strerror(-res));
+			return rcarr_fail;
+		} else if (res == 0) {
+			log_debug("EOF fd=%d read_len=%zu", this->fd, length);
+			return rcarr_eof;
+		}
+		done += res;
+	}
+	return rcarr_success;
+}
+
+static enum rca_recv_result rca_uring_recv_some(struct relay_client *self, void *buf, size_t length, size_t *received)
+{
+	struct rca_uring_data *this = self->data;
+	int res = rx_some(this, buf, length);
+	if (res < 0) {
+		log_error("Failed to read up to %zu bytes on fd (%s)", length, strerror(-res));
+		return rcarr_fail;
+	} else if (res == 0) {
+		return rcarr_eof;
+	}
+	*received = res;
+	return rcarr_success;
+}
+
+static int rca_uring_get_fd(struct relay_client *self)
+{
+	struct rca_uring_data *this = self->data;
+	return this->fd;
+}
+
+static bool rca_uring_cork(struct relay_client *self, bool cork)
+{
+	struct rca_uring_data *this = self->data;
+	if (this->tx_failed) {
+		return false;
+	}
+	this->corked = cork;
+	if (cork) {
+		return true;
+	}
+	/* Submit everything collected while corked in one go */
+	if (!tx_flush(this)) {
+		return false;
+	}
+	int res = uring_enter(&this->tx, false);
+	if (res < 0) {
+		log_error("Failed to submit send on fd (%s)", strerror(-res));
+		this->tx_failed = true;
+		return false;
+	}
+	return true;
+}
+
+static bool rca_uring_sync(struct relay_client *self)
+{
+	struct rca_uring_data *this = self->data;
+	if (this->tx_failed || !tx_drain(this)) {
+		return false;
+	}
+	return fsync(this->fd) == 0 || errno == EINVAL;
+}
+
+const struct relay_client_adapter relay_client_uring_adapter = {
+	.init = rca_uring_init,
+	.destroy = rca_uring_destroy,
+	.send = rca_uring_send,
+	.recv = rca_uring_recv,
+	.sendv = rca_uring_sendv,
+	.recv_some = rca_uring_recv_some,
+	.get_fd = rca_uring_get_fd,
+	.cork = rca_uring_cork,
+	.sync = rca_uring_sync,
+	.instdata_size = sizeof(struct rca_uring_data)
+};
+
+#else
+
+/* No io_uring headers, always use the fd adapter */
+struct rca_uring_data {
+	int fd;
+};
+
+static bool rca_uring_init(struct relay_client *self, const void *initargs)
+{
+	const struct relay_client_uring_data *args = initargs;
+	const struct relay_client_fd_data fdargs = {
+		.fd = args->fd,
+		.owns = args->owns,
+		.auth_needed = args->auth_needed
+	};
+	/* On failure the client keeps this adapter, whose destroy does nothing */
+	void *data = calloc(1, relay_client_fd_adapter.instdata_size);
+	if (!data) {
+		log_error("Failed to allocate fd adapter");
+		return false;
+	}
+	free(self->data);
+	self->adapter = &relay_client_fd_adapter;
+	self->data = data;
+	return self->adapter->init(self, &fdargs);
+}
+
+static void rca_uring_destroy(struct relay_client *self)
+{
+	(void) self;
+}
+
+const struct relay_client_adapter relay_client_uring_adapter = {
+	.init = rca_uring_init,
+	.destroy = rca_uring_destroy,
+	.instdata_size = sizeof(struct rca_uring_data)
+};
+
+#endif
+
+bool relay_client_init_uring(struct relay_client *self, const char *local, int fd, bool owns, bool auth_needed)
+{
+	struct relay_client_uring_data args = {
+		.fd = fd,
+		.owns = owns,
+		.auth_needed = auth_needed,
+		.sqpoll = false
+	};
+	return relay_client_init(self, local, &relay_client_uring_adapter, &args);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstd/std.h>
+#include "relay_client.h"
+
+/*
+ * io_uring adapter.
+ *
+ * Like the file-descriptor adapter, but I/O is submitted through io_uring
+ * (one ring per direction, so a sender and a receiver thread may share the
+ * client as with the fd adapter).
+ *
+ * Sends of up to 64 KiB are copied into one of two staging buffers and
+ * submitted without waiting, so the caller continues while the previous send
+ * completes; one send is in flight at a time, which keeps them in order.  While
+ * a batch is open (relay_client_batch_begin) appends collect in the stage and
+ * are submitted when it fills or at flush.  A failed send is reported by the
+ * next send, flush or sync.
+ *
+ * On sockets, one multishot recv keeps receiving into buffers provided to the
+ * kernel, so data which has already arrived is read without a syscall.  Since
+ * received data then no longer waits in the socket, relay_client_get_fd is
+ * only useful for polling before the first receive.  Other fds, and kernels
+ * without multishot recv, use one read per receive.
+ *
+ * With sqpoll, a kernel thread picks up submissions so the hot path avoids
+ * syscalls while busy.
+ *
+ * If the kernel does not support io_uring (or it is disabled), the client
+ * falls back to relay_client_fd_adapter at init.
+ */
+
+struct relay_client_uring_data {
+	int fd;
+	bool owns;
+	bool auth_needed;
+	/* Use a kernel submission-polling thread (may need privileges) */
+	bool sqpoll;
+};
+
+extern const struct relay_client_adapter relay_client_uring_adapter;
+
+bool relay_client_init_uring(struct relay_client *self, const char *local, int fd, bool owns, bool auth_needed);
@@ -8,7 +8,9 @@ const net = require('net');
 const _ = require('lodash');
 const Component = require('component');
 
+const Session = require('./session');
 const SessionList = require('./session-list');
+const packet_format = require('./packet-format');
 
 module.exports = Server;
 
@@ -28,18 +30,100 @@ const defaultOpts = {
 	port: 3031,
 	keepAliveInterval: 10000,
 	noDelay: true,
-	dumpPackets: false
+	dumpPackets: false,
+	recipientCacheSize: 4096,
+	/* Per-session egress limits in bytes, and what to do over the high mark */
+	egressHighWater: 16 * 1024 * 1024,
+	egressLowWater: 4 * 1024 * 1024,
+	egressPolicy: Session.EGRESS_PAUSE
 };
 
+const egressPolicies = [Session.EGRESS_PAUSE, Session.EGRESS_DROP, Session.EGRESS_DISCONNECT];
+
 Server.prototype = new Component();
 function Server(opts) {
 	Component.call(this, 'Relay server', false);
 
 	opts = _.defaults({}, opts, defaultOpts);
+	if (!egressPolicies.includes(opts.egressPolicy)) {
+		throw new Error(`Invalid egress policy: ${JSON.stringify(opts.egressPolicy)}`);
+	}
+	if (opts.egressLowWater > opts.egressHighWater) {
+		throw new Error('Egress low water mark is above the high water mark');
+	}
+
+	/* Other workers in multi-core mode (see cluster.js) */
+	const cluster = opts.cluster || null;
+	const no_workers = [];
 
-	const clients = new SessionList();
+	const clients = new SessionList(cluster ? cluster.register : null);
 	this.bind(clients);
 
+	/*
+	 * Recipients resolved by target, sender and origin, ready to iterate, and
+	 * other workers to forward to.  Valid until the session list generation
+	 * changes (a client registers or leaves), or that of the other workers.
+	 */
+	const recipient_cache = new Map();
+	let recipient_cache_generation = null;
+	const recipient_cache_stats = { hits: 0, misses: 0 };
+
+	const get_recipients = (to, via, from) => {
+		const generation = clients.generation() + (cluster ? cluster.generation() : 0);
+		if (generation !== recipient_cache_generation || recipient_cache.size >= opts.recipientCacheSize) {
+			recipient_cache.clear();
+			recipient_cache_generation = generation;
+		}
+		const key = `${to}\0${via}\0${from}`;
+		let recipients = recipient_cache.get(key);
+		if (recipients) {
+			recipient_cache_stats.hits++;
+			return recipients;
+		}
+		recipient_cache_stats.misses++;
+		/* Loopback not permitted (including by wildcard) */
+		const targets = [];
+		for (const target of clients.get(to)) {
+			const name = target.getName();
+			if (name !== via && name !== from) {
+				targets.push(target);
+			}
+		}
+		const workers = cluster ? cluster.workers_for(to, via, from) : no_workers;
+		recipients = { targets, workers };
+		recipient_cache.set(key, recipients);
+		return recipients;
+	};
+
+	/* Re-address packet for relaying, encoded once and shared by all recipients */
+	const deliver = (packet, targets, sender) => {
+		if (targets.length) {
+			const encoded = packet_format.encode(packet);
+			for (const recipient of targets) {
+				recipient.send(packet_format.readdress(encoded, recipient.getName()), sender);
+			}
+		}
+	};
+
+	/* Sessions by id, for other workers to pause the ones sending to them */
+	const sessions = new Map();
+	let next_session_id = 0;
+
+	if (cluster) {
+		this.$on(clients, 'unregister', cluster.unregister);
+		/* From another worker, already re-addressed by it */
+		this.$on(cluster, 'packet', (packet, to, from, sender) => deliver(packet, get_recipients(to, packet.remote, from).targets, sender));
+		/* A session elsewhere is backed up with our session's packets, or has drained */
+		this.$on(cluster, 'pause', (id, worker) => sessions.has(id) && sessions.get(id).pause_input(`worker ${worker}`));
+		this.$on(cluster, 'resume', (id, worker) => sessions.has(id) && sessions.get(id).resume_input(`worker ${worker}`));
+	}
+
+	this.update_labels = () => clients.update_labels();
+
+	this.stats = () => ({
+		recipient_cache: Object.assign({ size: recipient_cache.size, generation: recipient_cache_generation }, recipient_cache_stats)
+	});
+
 	const accept = socket => {
 
 		const addr = `${socket.remoteAddress}:${socket.remotePort}`;
@@ -51,13 +135,18 @@ function Server(opts) {
 
 		const client = clients.create(socket, opts);
 
+		const session_id = ++next_session_id;
+		if (cluster) {
+			sessions.set(session_id, client);
+			this.$on(client, 'close', () => sessions.delete(session_id));
+		}
+
 		const on_packet_received = packet => {
 			if (packet.type === 'AUTH') {
 				this.warn({ msg: `Client ${client.getName()} at ${addr} attempted to send an AUTH packet` });
 				client.close();
 				return;
 			}
-			/* Loopback not permitted (including by wildcard) */
 			const from = packet.local;
 			const to = packet.remote;
 			const via = client.getName();
@@ -65,16 +154,9 @@ function Server(opts) {
 				this.warn({ msg: `Not forwarding packet of type '${packet.type}' from '${via}' to '${packet.remote}' as it is marked as foreign` });
 				return;
 			}
-			const targets = _([...clients.get(to)])
-				.filter(target => target.getName() !== via && target.getName() !== from)
-				.uniq()
-				.value();
-			/* Re-address packet for relaying */
-			packet.remote = client.getName();
-			for (const recipient of targets) {
-				packet.local = recipient.getName();
-				recipient.send(packet);
-			}
+			const { targets, workers } = get_recipients(to, via, from);
+			packet.remote = via;
+			deliver(packet, targets, client);
 			/* Identification packet, also used to test connection */
 			if (packet.type === 'KES' && to === '*') {
 				const ident = {
@@ -87,7 +169,7 @@ function Server(opts) {
 			}
 			/* Dump */
 			if (opts.dumpPackets) {
-				/* Note: packet remote/local have been altered by this point */
+				/* Note: packet remote has been altered by this point */
 				this.emit('debug', `Packet of type "${packet.type}" from "${from}" ${via === from ? '' : `(via "${via}") `}to ${targets.length ? targets.map(c => `"${c.getName()}"`).join(', ') : `"${to}" (nowhere)`}`);
 				// eslint-disable-next-line no-magic-numbers
 				if (packet.data.length < 400 && isAsciiBuffer(packet.data)) {
@@ -97,6 +179,10 @@ function Server(opts) {
 				}
 				this.emit('debug', '');
 			}
+			/* Last, as the payload may be handed over to another worker */
+			if (workers.length) {
+				cluster.forward(workers, packet, to, from, targets.length > 0, session_id);
+			}
 		};
 
 		this.$on(client, 'data', on_packet_received);
@@ -105,31 +191,47 @@ function Server(opts) {
 	const server = net.createServer(accept);
 	this.$on(server, 'listening', () => {
 		this.$component.ready();
-		this.emit('listening');
+		this.emit('listening', opts.host, opts.port);
 	});
 
-	server.listen(opts.port, opts.host);
+	server.listen({ port: opts.port, host: opts.host, reusePort: !!opts.reusePort });
 }
 
+Server.log_to_console = (server, prefix = '') => {
+	server.on('listening', (host, port) => console.log(`${prefix}Listening on ${host}:${port}`));
+	server.on('info', ({ msg }) => console.info(prefix + msg));
+	server.on('warn', ({ msg }) => console.warn(prefix + msg));
+	server.on('error', err => process.env.DEBUG ? console.error(err) : console.error(`${prefix}ERROR: ${err && err.message || err || '<unknown>'}`));
+	server.on('debug', s => console.info(prefix + ((+new Date() - started) / 1000).toFixed(3) + '\t ' + s));
+};
+
+Server.dump = (server, title = 'Component tree') => {
+	server.update_labels();
+	const rule = '*'.repeat(title.length + 4);
+	console.log([
+		'',
+		rule,
+		`* ${title} *`,
+		rule,
+		'',
+		Component.tree(server, { highlight: null, ready: true }),
+		'',
+		`Recipient cache: ${JSON.stringify(server.stats().recipient_cache)}`,
+		''
+	].join('\n'));
+};
+
 if (!module.parent) {
 	const host = process.env.HOST || '::';
 	const port = +process.env.PORT || defaultOpts.port;
-	const server = new Server({ port, host, dumpPackets: !!process.env.DUMP });
-	server.on('listening', () => console.log(`Listening on ${host}:${port}`));
-	server.on('info', ({ msg }) => console.info(msg));
-	server.on('warn', ({ msg }) => console.warn(msg));
-	server.on('error', err => process.env.DEBUG ? console.error(err) : console.error(`ERROR: ${err && err.message || err || '<unknown>'}`));
-	server.on('debug', s => console.info(((+new Date() - started) / 1000).toFixed(3) + '\t ' + s));
-
-	process.on('SIGHUP', () => {
-		console.log([
-			'',
-			'******************',
-			'* Component tree *',
-			'******************',
-			'',
-			Component.tree(server, { highlight: null, ready: true }),
-			''
-		].join('\n'));
-	});
+	const opts = { port, host, dumpPackets: !!process.env.DUMP, egressPolicy: process.env.EGRESS_POLICY };
+	/* WORKERS=n runs n worker threads sharing the port (see cluster.js), on Node 22.12 or later */
+	const workers = +process.env.WORKERS || 1;
+	if (workers > 1) {
+		require('./cluster').start(opts, workers);
+	} else {
+		const server = new Server(opts);
+		Server.log_to_console(server);
+		process.on('SIGHUP', () => Server.dump(server));
+	}
 }
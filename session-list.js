@@ -1,26 +1,42 @@
 const Component = require('component');
 const Session = require('./session');
 
-const wildcard_to_regexp = require('./wildcard_to_regexp');
+const NameIndex = require('./name-index');
 
 module.exports = SessionList;
 
 const wildcard_rx = /[*?]/;
 
+/*
+ * register(name) is optional, and is called when the first client with a name
+ * arrives.  It may return a promise, for the name to become known elsewhere
+ * (see cluster.js), and clients with that name are only accepted once it
+ * resolves.
+ */
 SessionList.prototype = new Component();
-function SessionList() {
+function SessionList(register) {
 	Component.call(this, 'Session list', true);
 
 	const lists = new Map();
-	/* Get by regular expression */
-	const get_rx = pattern => [...lists.keys()]
-			.filter(key => pattern.test(key))
-			.map(key => lists.get(key))
-			.reduce((xs, x) => new Set([...xs, ...x]), new Set());
+	const index = new NameIndex();
+	/* Name -> promise resolved once the name is registered */
+	const registrations = new Map();
+	/* Bumped whenever a client is registered or unregistered */
+	let generation = 0;
+	/* Get by wildcard pattern */
+	const get_pattern = pattern => {
+		const result = new Set();
+		index.each_match(pattern, key => {
+			for (const client of lists.get(key)) {
+				result.add(client);
+			}
+		});
+		return result;
+	};
 	/* Get by name */
 	const get_name = name => lists.has(name) ? lists.get(name) : new Set();
 	/* Get by name or by wildcard */
-	const get = name => wildcard_rx.test(name) ? get_rx(wildcard_to_regexp(name)) : get_name(name);
+	const get = name => wildcard_rx.test(name) ? get_pattern(name) : get_name(name);
 	/* Remove client */
 	const remove = client => {
 		const name = client.getName();
@@ -31,7 +47,11 @@ function SessionList() {
 		list.delete(client);
 		if (list.size === 0) {
 			lists.delete(name);
+			index.delete(name);
+			registrations.delete(name);
+			this.emit('unregister', name);
 		}
+		generation++;
 		client.close();
 	};
 	/* Called when a client is ready */
@@ -49,11 +69,16 @@ function SessionList() {
 		}
 		if (!lists.has(name)) {
 			lists.set(name, new Set([client]));
+			index.add(name);
+			registrations.set(name, Promise.resolve(register ? register(name) : null));
+			this.emit('register', name);
 		} else {
 			lists.get(name).add(client);
 		}
+		generation++;
 		this.$on(client, 'close', () => remove(client));
 		this.info({ msg: `Registering client ${name} at ${client.getAddr()}` });
+		registrations.get(name).then(() => client.accept());
 	};
 	/* Called when a client closes */
 	const on_client_close = client => {
@@ -75,5 +100,16 @@ function SessionList() {
 	this.create = create;
 	this.get = get;
 	this.remove = remove;
-	this.$on(this, 'close', () => lists.clear());
+	this.generation = () => generation;
+	this.update_labels = () => {
+		for (const list of lists.values()) {
+			for (const client of list) {
+				client.update_label();
+			}
+		}
+	};
+	this.$on(this, 'close', () => {
+		lists.clear();
+		index.clear();
+	});
 }
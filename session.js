@@ -5,6 +5,20 @@ const packet_format = require('./packet-format');
 /* How long to wait for login after connection accepted */
 const NAME_TIMEOUT = 10000;
 
+/*
+ * Fragments are held back while this much output is already buffered for the
+ * socket, so that other packets are not queued behind a bulk transfer.
+ */
+const BULK_HIGH_WATER = 256 * 1024;
+
+/* What to do with packets for a session whose egress queue is over high water */
+Session.EGRESS_PAUSE = 'pause';
+Session.EGRESS_DROP = 'drop';
+Session.EGRESS_DISCONNECT = 'disconnect';
+
+/* Bytes a queued packet is counted as (strings are close enough) */
+const packet_size = packet => packet_format.HEADER_LENGTH + packet.data.length;
+
 module.exports = Session;
 
 Session.STATE_AUTHENTICATING = 0;
@@ -26,6 +40,7 @@ function Session(socket, opts) {
 
 	let state = Session.STATE_AUTHENTICATING;
 	let name = null;
+	let label = this.$component.name;
 
 	let states;
 
@@ -42,9 +57,127 @@ function Session(socket, opts) {
 		socket.destroy();
 	});
 
+	/*
+	 * Egress limits, on bytes buffered by the socket plus those still in our
+	 * queues.  Over the high water mark, packets are dropped, the session is
+	 * disconnected, or the sessions sending to it stop being read from until
+	 * it is back down to the low water mark.
+	 */
+	const { egressHighWater: high_water, egressLowWater: low_water, egressPolicy: policy } = opts;
+	let held_bytes = 0;
+	let overflow = false;
+	let dropped = 0;
+	let dropped_bytes = 0;
+	/* Sessions paused until we drain, and sessions which have paused us */
+	const held_senders = new Set();
+	const paused_by = new Set();
+
+	const queued = () => socket.writableLength + held_bytes;
+
+	const release_senders = () => {
+		for (const sender of held_senders) {
+			sender.resume_input(this);
+		}
+		held_senders.clear();
+	};
+
+	const update_overflow = () => {
+		if (!overflow && queued() >= high_water) {
+			overflow = true;
+			this.info({ msg: `Egress queue for "${name}" over high water mark (${queued()} bytes)` });
+		} else if (overflow && queued() <= low_water) {
+			overflow = false;
+			release_senders();
+		}
+	};
+
+	/* Returns true if the packet may be queued */
+	const admit = (packet, sender) => {
+		update_overflow();
+		if (!overflow) {
+			return true;
+		}
+		switch (policy) {
+		case Session.EGRESS_DROP:
+			dropped++;
+			dropped_bytes += packet_size(packet);
+			return false;
+		case Session.EGRESS_DISCONNECT:
+			this.warn({ msg: `Disconnecting "${name}", egress queue is over high water mark (${queued()} bytes)` });
+			this.close();
+			return false;
+		default:
+			if (sender && sender !== this && !held_senders.has(sender)) {
+				held_senders.add(sender);
+				sender.pause_input(this);
+			}
+			return true;
+		}
+	};
+
+	this.$on(this, 'close', release_senders);
+
+	this.pause_input = by => {
+		paused_by.add(by);
+		if (paused_by.size === 1) {
+			socket.pause();
+		}
+	};
+
+	this.resume_input = by => {
+		if (paused_by.delete(by) && paused_by.size === 0 && state !== Session.STATE_CLOSED) {
+			socket.resume();
+		}
+	};
+
+	/* Egress: fragments wait in the bulk queue, other packets go straight out */
+	const bulk_queue = [];
+	let bulk_head = 0;
+
+	const bulk_pump = () => {
+		while (bulk_head < bulk_queue.length && socket.writableLength < BULK_HIGH_WATER) {
+			const packet = bulk_queue[bulk_head];
+			bulk_queue[bulk_head++] = null;
+			held_bytes -= packet_size(packet);
+			writer.write(packet);
+		}
+		if (bulk_head === bulk_queue.length) {
+			bulk_queue.length = 0;
+			bulk_head = 0;
+		}
+	};
+
+	const send_open = packet => {
+		if (packet.type === packet_format.FRAGMENT_TYPE) {
+			bulk_queue.push(packet);
+			held_bytes += packet_size(packet);
+			bulk_pump();
+		} else {
+			writer.write(packet);
+		}
+	};
+
+	this.$on(socket, 'drain', () => {
+		bulk_pump();
+		update_overflow();
+	});
+	this.$on(this, 'close', () => {
+		bulk_queue.length = 0;
+		bulk_head = 0;
+		held_bytes = 0;
+	});
+
 	const tx_queue = new PacketBuffer();
 	this.bind(tx_queue, true);
-	this.$on(tx_queue, 'flush', writer.write);
+	this.$on(tx_queue, 'flush', packet => {
+		held_bytes -= packet_size(packet);
+		send_open(packet);
+	});
+
+	const hold = packet => {
+		held_bytes += packet_size(packet);
+		tx_queue.push(packet);
+	};
 
 	const on_auth_timeout = () => {
 		this.warn(new Error('Authentication timeout'));
@@ -60,11 +193,22 @@ function Session(socket, opts) {
 		name = _name;
 		clearTimeout(authTimer);
 		authTimer = null;
-		writer.write({ local: name, remote: '', type: 'AUTH', data: '' });
 		set_state(Session.STATE_OPENING);
 		this.info({ msg: `${addr} authenticated as "${name}"` });
-		this.$component.rename(`Session for "${name}" @ ${addr}`);
+		label = `Session for "${name}" @ ${addr}`;
+		this.$component.rename(label);
 		this.$component.ready();
+	};
+
+	/*
+	 * Called by the session list once the name is registered, everywhere that
+	 * packets for it may come from, so the client can be told it is logged in
+	 */
+	this.accept = () => {
+		if (state !== Session.STATE_OPENING) {
+			return;
+		}
+		writer.write({ local: name, remote: '', type: 'AUTH', data: '' });
 		setTimeout(() => {
 			this.emit('open');
 			set_state(Session.STATE_OPEN);
@@ -102,17 +246,17 @@ function Session(socket, opts) {
 		[Session.STATE_AUTHENTICATING]: {
 			name: 'authenticating',
 			on_rx: on_try_auth,
-			on_tx: tx_queue.push
+			on_tx: hold
 		},
 		[Session.STATE_OPENING]: {
 			name: 'opening',
 			on_rx: emit_packet,
-			on_tx: tx_queue.push
+			on_tx: hold
 		},
 		[Session.STATE_OPEN]: {
 			name: 'open',
 			on_rx: emit_packet,
-			on_tx: writer.write
+			on_tx: send_open
 		},
 		[Session.STATE_CLOSED]: {
 			name: 'closed',
@@ -127,10 +271,50 @@ function Session(socket, opts) {
 	this.$on(socket, 'data', buf => reader.write(buf));
 	this.$on(reader, 'data', packet => states[state].on_rx(packet));
 
-	/* (data) -> writer -> socket */
-	this.$on(writer, 'data', buf => socket.write(buf));
+	/* Check whether we are back under the low water mark as output leaves */
+	const on_written = () => {
+		if (overflow) {
+			update_overflow();
+		}
+	};
 
-	this.send = packet => states[state].on_tx(packet);
+	/* (data) -> writer -> socket, header and shared payload in one writev */
+	this.$on(writer, 'data', (buf, payload) => {
+		if (payload === undefined) {
+			socket.write(buf, on_written);
+			return;
+		}
+		socket.cork();
+		if (payload.length) {
+			socket.write(buf);
+			socket.write(payload, on_written);
+		} else {
+			socket.write(buf, on_written);
+		}
+		socket.uncork();
+	});
+
+	/* Sender is the session the packet came from (or a stand-in for one on another worker), paused if we are backed up */
+	this.send = (packet, sender) => {
+		if (state === Session.STATE_CLOSED || admit(packet, sender)) {
+			states[state].on_tx(packet);
+		}
+	};
+
+	/* Show egress queue depth and drops in the component tree */
+	this.update_label = () => {
+		const notes = [`queued ${queued()} B`];
+		if (dropped) {
+			notes.push(`dropped ${dropped} (${dropped_bytes} B)`);
+		}
+		if (overflow) {
+			notes.push('over high water');
+		}
+		if (paused_by.size) {
+			notes.push(`input paused by ${paused_by.size}`);
+		}
+		this.$component.rename(`${label} [${notes.join(', ')}]`);
+	};
 
 	this.getName = () => name;
 	this.getState = () => states[state].name;